@@ -0,0 +1,456 @@
+// Benchmark driver for hmstl.
+// Generates synthetic inputs with hmgen, runs hmstl over a matrix of
+// settings, and reports throughput and peak memory as JSON.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+typedef struct {
+	char *hmstl; // path to hmstl executable under test
+	char *hmgen; // path to hmgen executable used to create inputs
+	char *workdir; // directory for generated inputs and output STL
+	char *sizes; // comma separated list of square image sizes
+	int repeat; // runs per case; median time is reported
+	char *output; // path to JSON results; use stdout if NULL
+	char *baseline; // path to JSON results to compare against; none if NULL
+	double tolerance; // fractional slowdown or growth reported as a regression
+} Settings;
+
+Settings CONFIG = {
+	"./hmstl",
+	"bench/hmgen",
+	"bench/tmp",
+	"256,512,1024",
+	3,
+	NULL,
+	NULL,
+	0.10
+};
+
+// One benchmark case: a generated heightmap, an optional generated mask,
+// and additional hmstl options (the Settings combination being measured).
+typedef struct {
+	const char *name;
+	const char *terrain;
+	const char *mask;
+	const char *options;
+} BenchCase;
+
+static const BenchCase CASES[] = {
+	{"binary",       "terrain", NULL,     ""},
+	{"surface",      "terrain", NULL,     "-s"},
+	{"ascii",        "terrain", NULL,     "-a"},
+	{"heightmask",   "terrain", NULL,     "-h"},
+	{"mask-sparse",  "terrain", "sparse", ""},
+	{"mask-dense",   "terrain", "dense",  ""},
+	{"mask-reverse", "terrain", "dense",  "-r"},
+	{"plateau",      "plateau", NULL,     ""},
+	{"noise",        "noise",   NULL,     ""},
+};
+
+#define NCASES (sizeof(CASES) / sizeof(CASES[0]))
+#define MAXARGS 32
+
+typedef struct {
+	double seconds; // median wall time
+	double user, system; // CPU time of the median run
+	long rss; // peak resident set size in kilobytes (maximum over runs)
+	unsigned long triangles;
+	unsigned long bytes;
+} Result;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Runs argv to completion. Returns exit status, or -1 if it could not run.
+static int run(char **argv, double *seconds, struct rusage *usage) {
+	pid_t pid;
+	int status;
+	double start = now();
+
+	if ((pid = fork()) < 0) {
+		return -1;
+	}
+
+	if (pid == 0) {
+		execv(argv[0], argv);
+		fprintf(stderr, "Cannot execute %s\n", argv[0]);
+		_exit(127);
+	}
+
+	if (wait4(pid, &status, 0, usage) != pid) {
+		return -1;
+	}
+	*seconds = now() - start;
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int fileexists(const char *path) {
+	struct stat st;
+	return stat(path, &st) == 0;
+}
+
+// Generates (once) a synthetic image of the given kind and size.
+static int generate(char *path, size_t len, const char *kind, unsigned int size) {
+	char sizearg[16];
+	char *argv[8];
+	struct rusage usage;
+	double seconds;
+
+	snprintf(path, len, "%s/%s-%u.png", CONFIG.workdir, kind, size);
+	if (fileexists(path)) {
+		return 0;
+	}
+
+	snprintf(sizearg, sizeof(sizearg), "%u", size);
+	argv[0] = CONFIG.hmgen;
+	argv[1] = "-k";
+	argv[2] = (char *)kind;
+	argv[3] = "-n";
+	argv[4] = sizearg;
+	argv[5] = "-o";
+	argv[6] = path;
+	argv[7] = NULL;
+
+	fprintf(stderr, "generating %s\n", path);
+	if (run(argv, &seconds, &usage) != 0) {
+		fprintf(stderr, "Cannot generate %s\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+// Count triangles in an STL file: binary files record the count in the
+// header; ASCII files are scanned for facets.
+static unsigned long countstl(const char *path, int ascii) {
+	unsigned char header[84];
+	unsigned long count = 0;
+	char line[256];
+	FILE *fp;
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		return 0;
+	}
+
+	if (ascii) {
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			char *p = line;
+			while (isspace((unsigned char)*p)) {
+				p++;
+			}
+			if (strncmp(p, "facet", 5) == 0) {
+				count++;
+			}
+		}
+	} else if (fread(header, 84, 1, fp) == 1) {
+		count = (unsigned long)header[80] | ((unsigned long)header[81] << 8) |
+				((unsigned long)header[82] << 16) | ((unsigned long)header[83] << 24);
+	}
+
+	fclose(fp);
+	return count;
+}
+
+static int cmpdouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// returns 0 on success, nonzero otherwise
+static int measure(const BenchCase *bc, unsigned int size, Result *result) {
+	char terrain[512], mask[512], output[512], options[128];
+	char *argv[MAXARGS], *tok;
+	int argc = 0, i;
+	double *times;
+	struct rusage *usages;
+	struct stat st;
+
+	if (generate(terrain, sizeof(terrain), bc->terrain, size)) {
+		return 1;
+	}
+	if (bc->mask != NULL && generate(mask, sizeof(mask), bc->mask, size)) {
+		return 1;
+	}
+	snprintf(output, sizeof(output), "%s/out.stl", CONFIG.workdir);
+
+	argv[argc++] = CONFIG.hmstl;
+	argv[argc++] = "-z";
+	argv[argc++] = "0.25";
+	argv[argc++] = "-i";
+	argv[argc++] = terrain;
+	argv[argc++] = "-o";
+	argv[argc++] = output;
+	if (bc->mask != NULL) {
+		argv[argc++] = "-m";
+		argv[argc++] = mask;
+	}
+	strncpy(options, bc->options, sizeof(options) - 1);
+	options[sizeof(options) - 1] = '\0';
+	for (tok = strtok(options, " "); tok != NULL && argc < MAXARGS - 1; tok = strtok(NULL, " ")) {
+		argv[argc++] = tok;
+	}
+	argv[argc] = NULL;
+
+	times = (double *)malloc(CONFIG.repeat * sizeof(double));
+	usages = (struct rusage *)malloc(CONFIG.repeat * sizeof(struct rusage));
+	if (times == NULL || usages == NULL) {
+		free(times);
+		free(usages);
+		return 1;
+	}
+
+	result->rss = 0;
+	for (i = 0; i < CONFIG.repeat; i++) {
+		if (run(argv, &times[i], &usages[i]) != 0) {
+			fprintf(stderr, "hmstl failed on %s\n", terrain);
+			free(times);
+			free(usages);
+			return 1;
+		}
+		if (usages[i].ru_maxrss > result->rss) {
+			result->rss = usages[i].ru_maxrss;
+		}
+	}
+
+	// report the CPU time of whichever run took the median wall time
+	result->seconds = times[0];
+	result->user = (double)usages[0].ru_utime.tv_sec + usages[0].ru_utime.tv_usec / 1e6;
+	result->system = (double)usages[0].ru_stime.tv_sec + usages[0].ru_stime.tv_usec / 1e6;
+	{
+		double *sorted = (double *)malloc(CONFIG.repeat * sizeof(double));
+		if (sorted != NULL) {
+			memcpy(sorted, times, CONFIG.repeat * sizeof(double));
+			qsort(sorted, CONFIG.repeat, sizeof(double), cmpdouble);
+			result->seconds = sorted[CONFIG.repeat / 2];
+			for (i = 0; i < CONFIG.repeat; i++) {
+				if (times[i] == result->seconds) {
+					result->user = (double)usages[i].ru_utime.tv_sec + usages[i].ru_utime.tv_usec / 1e6;
+					result->system = (double)usages[i].ru_stime.tv_sec + usages[i].ru_stime.tv_usec / 1e6;
+					break;
+				}
+			}
+			free(sorted);
+		}
+	}
+	free(times);
+	free(usages);
+
+	result->bytes = (stat(output, &st) == 0) ? (unsigned long)st.st_size : 0;
+	result->triangles = countstl(output, strstr(bc->options, "-a") != NULL);
+	(void)remove(output);
+
+	return 0;
+}
+
+// Looks up a numeric field of the named result in a baseline file written
+// by a previous run. Returns 0 if found, nonzero otherwise.
+static int baselinefield(FILE *fp, const char *name, const char *field, double *value) {
+	char line[1024], key[160], *p;
+
+	snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strstr(line, key) == NULL) {
+			continue;
+		}
+		snprintf(key, sizeof(key), "\"%s\": ", field);
+		if ((p = strstr(line, key)) == NULL) {
+			return 1;
+		}
+		return sscanf(p + strlen(key), "%lf", value) != 1;
+	}
+	return 1;
+}
+
+// Reports changes relative to the baseline on stderr.
+// Returns nonzero if the result regressed beyond tolerance.
+static int compare(FILE *fp, const char *name, const Result *result) {
+	double seconds, rss, triangles;
+	int regressed = 0;
+
+	if (baselinefield(fp, name, "seconds", &seconds) ||
+			baselinefield(fp, name, "peak_rss_kb", &rss) ||
+			baselinefield(fp, name, "triangles", &triangles)) {
+		fprintf(stderr, "%-28s not in baseline\n", name);
+		return 0;
+	}
+
+	fprintf(stderr, "%-28s %9.3fs %+7.1f%%  %9ldkB %+7.1f%%", name,
+			result->seconds, 100.0 * (result->seconds - seconds) / seconds,
+			result->rss, 100.0 * ((double)result->rss - rss) / rss);
+
+	if ((unsigned long)triangles != result->triangles) {
+		fprintf(stderr, "  OUTPUT CHANGED (%lu triangles, was %lu)", result->triangles, (unsigned long)triangles);
+		regressed = 1;
+	}
+	if (result->seconds > seconds * (1.0 + CONFIG.tolerance)) {
+		fprintf(stderr, "  SLOWER");
+		regressed = 1;
+	}
+	if ((double)result->rss > rss * (1.0 + CONFIG.tolerance)) {
+		fprintf(stderr, "  LARGER");
+		regressed = 1;
+	}
+	fprintf(stderr, "\n");
+
+	return regressed;
+}
+
+// returns 0 if options are parsed successfully; nonzero otherwise
+int parseopts(int argc, char **argv) {
+
+	int c;
+
+	opterr = 0;
+
+	while ((c = getopt(argc, argv, "x:g:d:n:r:o:c:t:")) != -1) {
+		switch (c) {
+			case 'x':
+				CONFIG.hmstl = optarg;
+				break;
+			case 'g':
+				CONFIG.hmgen = optarg;
+				break;
+			case 'd':
+				CONFIG.workdir = optarg;
+				break;
+			case 'n':
+				CONFIG.sizes = optarg;
+				break;
+			case 'r':
+				if (sscanf(optarg, "%5d", &CONFIG.repeat) != 1 || CONFIG.repeat < 1) {
+					fprintf(stderr, "REPEAT must be a positive integer.\n");
+					return 1;
+				}
+				break;
+			case 'o':
+				CONFIG.output = optarg;
+				break;
+			case 'c':
+				CONFIG.baseline = optarg;
+				break;
+			case 't':
+				if (sscanf(optarg, "%20lf", &CONFIG.tolerance) != 1 || CONFIG.tolerance < 0) {
+					fprintf(stderr, "TOLERANCE must be a non-negative number.\n");
+					return 1;
+				}
+				CONFIG.tolerance /= 100.0;
+				break;
+			case '?':
+				if (isprint(optopt)) {
+					fprintf(stderr, "Unknown option or missing argument -%c\n", optopt);
+				} else {
+					fprintf(stderr, "Unknown option character \\x%x\n", optopt);
+				}
+				return 1;
+			default:
+				return 1;
+		}
+	}
+
+	if (optind < argc) {
+		fprintf(stderr, "Extraneous arguments\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	FILE *out = stdout, *base = NULL;
+	char sizes[256], *tok, name[128], options[160];
+	unsigned int size;
+	unsigned long c;
+	int first = 1, regressions = 0;
+	Result result;
+
+	if (parseopts(argc, argv)) {
+		fprintf(stderr, "usage: hmbench [-x HMSTL] [-g HMGEN] [-d WORKDIR] [-n SIZES] [-r REPEAT] [-o OUTPUT] [-c BASELINE] [-t PERCENT]\n");
+		return 1;
+	}
+
+	if (!fileexists(CONFIG.workdir) && mkdir(CONFIG.workdir, 0777) != 0) {
+		fprintf(stderr, "Cannot create %s\n", CONFIG.workdir);
+		return 1;
+	}
+
+	if (CONFIG.baseline != NULL && (base = fopen(CONFIG.baseline, "r")) == NULL) {
+		fprintf(stderr, "Cannot open baseline %s\n", CONFIG.baseline);
+		return 1;
+	}
+
+	if (CONFIG.output != NULL && (out = fopen(CONFIG.output, "w")) == NULL) {
+		fprintf(stderr, "Cannot open %s\n", CONFIG.output);
+		return 1;
+	}
+
+	// one result object per line, so baselines can be compared line by line
+	fprintf(out, "{\n\"benchmark\": \"hmstl\",\n\"repeat\": %d,\n\"results\": [\n", CONFIG.repeat);
+
+	strncpy(sizes, CONFIG.sizes, sizeof(sizes) - 1);
+	sizes[sizeof(sizes) - 1] = '\0';
+	for (tok = strtok(sizes, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (sscanf(tok, "%10u", &size) != 1 || size < 1) {
+			fprintf(stderr, "Invalid size %s\n", tok);
+			return 1;
+		}
+		for (c = 0; c < NCASES; c++) {
+			double pixels = (double)size * size;
+			snprintf(name, sizeof(name), "%s-%u", CASES[c].name, size);
+			snprintf(options, sizeof(options), "%s%s%s%s",
+					CASES[c].mask != NULL ? "-m " : "", CASES[c].mask != NULL ? CASES[c].mask : "",
+					(CASES[c].mask != NULL && CASES[c].options[0] != '\0') ? " " : "", CASES[c].options);
+			fprintf(stderr, "running %s\n", name);
+			if (measure(&CASES[c], size, &result)) {
+				return 1;
+			}
+			fprintf(out, "%s{\"name\": \"%s\", \"size\": %u, \"options\": \"%s\", "
+					"\"pixels\": %.0f, \"triangles\": %lu, \"bytes\": %lu, "
+					"\"seconds\": %.6f, \"user\": %.6f, \"system\": %.6f, "
+					"\"pixels_per_sec\": %.0f, \"triangles_per_sec\": %.0f, \"mb_per_sec\": %.3f, "
+					"\"peak_rss_kb\": %ld}",
+					first ? "" : ",\n", name, size,
+					options, pixels, result.triangles, result.bytes,
+					result.seconds, result.user, result.system,
+					pixels / result.seconds, (double)result.triangles / result.seconds,
+					(double)result.bytes / 1e6 / result.seconds,
+					result.rss);
+			fflush(out);
+			first = 0;
+			if (base != NULL) {
+				regressions += compare(base, name, &result);
+			}
+		}
+	}
+
+	fprintf(out, "\n]\n}\n");
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	if (base != NULL) {
+		fclose(base);
+		if (regressions) {
+			fprintf(stderr, "%d regression(s) relative to %s\n", regressions, CONFIG.baseline);
+			return 2;
+		}
+	}
+
+	return 0;
+}
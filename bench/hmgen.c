@@ -0,0 +1,613 @@
+// Synthetic heightmap generator for hmstl benchmarks.
+// Writes reproducible 8-bit PNG heightmaps and masks of arbitrary size.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#endif
+
+typedef struct {
+	char *kind; // terrain, plateau, noise, sparse, or dense
+	unsigned int width, height;
+	unsigned long seed; // same seed and size always yields the same image
+	int channels; // 1 (grey), 3 (RGB), or 4 (RGBA) output samples per pixel
+	char *output; // path to output file; use stdout if NULL
+} Settings;
+
+Settings CONFIG = {
+	"terrain",
+	256,
+	256,
+	1,
+	1,
+	NULL
+};
+
+// splitmix64; used instead of rand() so output is identical on every platform
+static unsigned long long rngstate;
+
+static unsigned long long rng(void) {
+	unsigned long long z = (rngstate += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// uniform integer in -range..range
+static int rngoffset(int range) {
+	if (range <= 0) {
+		return 0;
+	}
+	return (int)(rng() % (unsigned long long)(2 * range + 1)) - range;
+}
+
+static unsigned short clamp16(long v) {
+	if (v < 0) {
+		return 0;
+	}
+	if (v > 65535) {
+		return 65535;
+	}
+	return (unsigned short)v;
+}
+
+/*
+ * Terrain generators
+ */
+
+// Diamond-square fractal terrain on a (2^k + 1) square grid covering
+// width x height, quantized to 8 bits. Samples are kept as 16 bit values
+// so that a 16k x 16k grid needs 512 MB rather than 1 GB of floats.
+static unsigned char *DiamondSquare(unsigned int width, unsigned int height, double roughness) {
+	unsigned long side = 2, x, y, step, half;
+	unsigned short *grid;
+	unsigned char *img;
+	long range = 12288;
+
+	while (side + 1 < width || side + 1 < height) {
+		side *= 2;
+	}
+
+	if ((grid = (unsigned short *)malloc((side + 1) * (side + 1) * sizeof(unsigned short))) == NULL) {
+		return NULL;
+	}
+
+	#define G(gx, gy) grid[(gy) * (side + 1) + (gx)]
+
+	G(0, 0) = clamp16(32768 + rngoffset(16384));
+	G(side, 0) = clamp16(32768 + rngoffset(16384));
+	G(0, side) = clamp16(32768 + rngoffset(16384));
+	G(side, side) = clamp16(32768 + rngoffset(16384));
+
+	for (step = side; step > 1; step /= 2) {
+		half = step / 2;
+
+		// diamond step: square centers from corners
+		for (y = half; y < side; y += step) {
+			for (x = half; x < side; x += step) {
+				long sum = (long)G(x - half, y - half) + G(x + half, y - half) +
+						G(x - half, y + half) + G(x + half, y + half);
+				G(x, y) = clamp16(sum / 4 + rngoffset((int)range));
+			}
+		}
+
+		// square step: edge midpoints from their (up to four) neighbors
+		for (y = 0; y <= side; y += half) {
+			for (x = ((y / half) % 2 == 0) ? half : 0; x <= side; x += step) {
+				long sum = 0;
+				int n = 0;
+				if (x >= half) { sum += G(x - half, y); n++; }
+				if (x + half <= side) { sum += G(x + half, y); n++; }
+				if (y >= half) { sum += G(x, y - half); n++; }
+				if (y + half <= side) { sum += G(x, y + half); n++; }
+				G(x, y) = clamp16(sum / n + rngoffset((int)range));
+			}
+		}
+
+		range = (long)(range * roughness);
+	}
+
+	if ((img = (unsigned char *)malloc((unsigned long)width * height)) == NULL) {
+		free(grid);
+		return NULL;
+	}
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			img[y * width + x] = (unsigned char)(G(x, y) >> 8);
+		}
+	}
+
+	#undef G
+
+	free(grid);
+	return img;
+}
+
+// Terraced terrain: large flat areas separated by steep steps.
+static unsigned char *Plateau(unsigned int width, unsigned int height) {
+	unsigned char *img;
+	unsigned long i, size = (unsigned long)width * height;
+
+	if ((img = DiamondSquare(width, height, 0.55)) == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < size; i++) {
+		img[i] = (unsigned char)((img[i] / 48) * 48 + 16);
+	}
+
+	return img;
+}
+
+// Uniform white noise; the worst case for compression and branch prediction.
+static unsigned char *Noise(unsigned int width, unsigned int height) {
+	unsigned char *img;
+	unsigned long i, size = (unsigned long)width * height;
+
+	if ((img = (unsigned char *)malloc(size)) == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < size; i++) {
+		img[i] = (unsigned char)(rng() >> 56);
+	}
+
+	return img;
+}
+
+// Binary mask (0 opaque, 255 transparent) with approximately the given
+// fraction of pixels visible, as smooth blob outlines.
+static unsigned char *Mask(unsigned int width, unsigned int height, double visible) {
+	unsigned char *img;
+	unsigned long i, size = (unsigned long)width * height;
+	unsigned long histogram[256] = {0}, count = 0;
+	int threshold = 256;
+
+	if ((img = DiamondSquare(width, height, 0.5)) == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < size; i++) {
+		histogram[img[i]]++;
+	}
+
+	// highest values are visible; lower the threshold until enough are
+	while (threshold > 0 && (double)count < visible * (double)size) {
+		threshold--;
+		count += histogram[threshold];
+	}
+
+	for (i = 0; i < size; i++) {
+		img[i] = (img[i] >= threshold) ? 255 : 0;
+	}
+
+	return img;
+}
+
+/*
+ * PNG output
+ */
+
+static unsigned long crctable[256];
+
+static void crcinit(void) {
+	unsigned long c;
+	int n, k;
+	for (n = 0; n < 256; n++) {
+		c = (unsigned long)n;
+		for (k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xEDB88320UL ^ (c >> 1) : c >> 1;
+		}
+		crctable[n] = c;
+	}
+}
+
+static unsigned long crc(unsigned long c, const unsigned char *buf, unsigned long len) {
+	unsigned long i;
+	c ^= 0xFFFFFFFFUL;
+	for (i = 0; i < len; i++) {
+		c = crctable[(c ^ buf[i]) & 0xFF] ^ (c >> 8);
+	}
+	return c ^ 0xFFFFFFFFUL;
+}
+
+typedef struct {
+	unsigned char *data;
+	unsigned long len, cap;
+	unsigned long bits; // pending output bits, LSB first
+	int nbits;
+} Buffer;
+
+static int bufput(Buffer *b, unsigned char c) {
+	if (b->len == b->cap) {
+		unsigned long cap = b->cap ? b->cap * 2 : 65536;
+		unsigned char *p = (unsigned char *)realloc(b->data, cap);
+		if (p == NULL) {
+			return 1;
+		}
+		b->data = p;
+		b->cap = cap;
+	}
+	b->data[b->len++] = c;
+	return 0;
+}
+
+static int bufbits(Buffer *b, unsigned long value, int count) {
+	b->bits |= value << b->nbits;
+	b->nbits += count;
+	while (b->nbits >= 8) {
+		if (bufput(b, (unsigned char)(b->bits & 0xFF))) {
+			return 1;
+		}
+		b->bits >>= 8;
+		b->nbits -= 8;
+	}
+	return 0;
+}
+
+// huffman codes are packed starting from the most significant bit
+static int bufcode(Buffer *b, unsigned int code, int count) {
+	unsigned int r = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		r = (r << 1) | ((code >> i) & 1);
+	}
+	return bufbits(b, r, count);
+}
+
+// fixed huffman literal/length code
+static int putlitlen(Buffer *b, int v) {
+	if (v <= 143) {
+		return bufcode(b, 0x30 + v, 8);
+	} else if (v <= 255) {
+		return bufcode(b, 0x190 + (v - 144), 9);
+	} else if (v <= 279) {
+		return bufcode(b, v - 256, 7);
+	}
+	return bufcode(b, 0xC0 + (v - 280), 8);
+}
+
+static const int lbase[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const int lextra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const int dbase[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const int dextra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+static int putmatch(Buffer *b, int len, int dist) {
+	int l = 28, d = 29;
+	while (lbase[l] > len) {
+		l--;
+	}
+	while (dbase[d] > dist) {
+		d--;
+	}
+	if (putlitlen(b, 257 + l) || bufbits(b, (unsigned long)(len - lbase[l]), lextra[l])) {
+		return 1;
+	}
+	return bufcode(b, (unsigned int)d, 5) || bufbits(b, (unsigned long)(dist - dbase[d]), dextra[d]);
+}
+
+#define HASHBITS 16
+#define WINDOW 32768
+
+// zlib stream of a single fixed-huffman block with greedy LZ77 matching.
+// Not a strong compressor, but it produces the literal/match mix that
+// real encoders do, so decoder benchmarks exercise realistic paths.
+static int deflate(Buffer *b, const unsigned char *in, unsigned long len) {
+	long *head;
+	unsigned long i = 0, a = 1, s = 0, k;
+
+	if ((head = (long *)malloc(sizeof(long) << HASHBITS)) == NULL) {
+		return 1;
+	}
+	for (k = 0; k < (1UL << HASHBITS); k++) {
+		head[k] = -1;
+	}
+
+	if (bufput(b, 0x78) || bufput(b, 0x01) || bufbits(b, 1, 1) || bufbits(b, 1, 2)) {
+		free(head);
+		return 1;
+	}
+
+	while (i < len) {
+		int best = 0;
+		if (i + 2 < len) {
+			unsigned long h = ((in[i] << 16) ^ (in[i + 1] << 8) ^ in[i + 2]) * 2654435761UL;
+			long cand;
+			h = (h >> 8) & ((1UL << HASHBITS) - 1);
+			cand = head[h];
+			head[h] = (long)i;
+			if (cand >= 0 && i - (unsigned long)cand <= WINDOW) {
+				while (best < 258 && i + best < len && in[cand + best] == in[i + best]) {
+					best++;
+				}
+				if (best >= 3 && putmatch(b, best, (int)(i - (unsigned long)cand))) {
+					free(head);
+					return 1;
+				}
+			}
+		}
+		if (best < 3) {
+			best = 1;
+			if (putlitlen(b, in[i])) {
+				free(head);
+				return 1;
+			}
+		}
+		i += (unsigned long)best;
+	}
+	free(head);
+
+	// end of block, then flush to a byte boundary
+	if (putlitlen(b, 256) || bufbits(b, 0, 7)) {
+		return 1;
+	}
+	b->nbits = 0;
+	b->bits = 0;
+
+	for (i = 0; i < len; i++) {
+		a = (a + in[i]) % 65521;
+		s = (s + a) % 65521;
+	}
+	return bufput(b, (unsigned char)(s >> 8)) || bufput(b, (unsigned char)s) ||
+			bufput(b, (unsigned char)(a >> 8)) || bufput(b, (unsigned char)a);
+}
+
+static void put32(unsigned char *p, unsigned long v) {
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static int writechunk(FILE *fp, const char *type, const unsigned char *data, unsigned long len) {
+	unsigned char head[8], tail[4];
+	unsigned long c;
+	put32(head, len);
+	memcpy(head + 4, type, 4);
+	c = crc(0, head + 4, 4);
+	c = crc(c, data, len);
+	put32(tail, c);
+	return fwrite(head, 8, 1, fp) != 1 ||
+			(len > 0 && fwrite(data, len, 1, fp) != 1) ||
+			fwrite(tail, 4, 1, fp) != 1;
+}
+
+static int paethpredict(int a, int b, int c) {
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+	return (pb <= pc) ? b : c;
+}
+
+// Filter one scanline with each PNG filter type and keep the one with the
+// smallest sum of absolute differences (the libpng heuristic), so that all
+// five filters occur in typical output.
+static void filterrow(unsigned char *out, const unsigned char *cur, const unsigned char *prior, unsigned long stride, int bpp) {
+	static unsigned char *trial = NULL;
+	static unsigned long trialsize = 0;
+	unsigned long i, cost, bestcost = (unsigned long)-1;
+	int f;
+
+	if (trialsize < stride) {
+		free(trial);
+		trial = (unsigned char *)malloc(stride);
+		trialsize = stride;
+	}
+
+	for (f = 0; f < 5; f++) {
+		cost = 0;
+		for (i = 0; i < stride; i++) {
+			int a = (i >= (unsigned long)bpp) ? cur[i - bpp] : 0;
+			int b = prior ? prior[i] : 0;
+			int c = (prior && i >= (unsigned long)bpp) ? prior[i - bpp] : 0;
+			int p;
+			switch (f) {
+				case 1: p = a; break;
+				case 2: p = b; break;
+				case 3: p = (a + b) / 2; break;
+				case 4: p = paethpredict(a, b, c); break;
+				default: p = 0; break;
+			}
+			trial[i] = (unsigned char)(cur[i] - p);
+			cost += (unsigned long)abs((signed char)trial[i]);
+		}
+		if (cost < bestcost) {
+			bestcost = cost;
+			out[0] = (unsigned char)f;
+			memcpy(out + 1, trial, stride);
+		}
+	}
+}
+
+// returns 0 on success, nonzero otherwise
+static int WritePNG(FILE *fp, const unsigned char *grey, unsigned int width, unsigned int height, int channels) {
+	static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	static const int colortype[5] = {0, 0, 4, 2, 6};
+	unsigned char ihdr[13];
+	unsigned char *raw, *row, *prev = NULL;
+	unsigned long stride = (unsigned long)width * channels;
+	unsigned long x, y;
+	Buffer z = {NULL, 0, 0, 0, 0};
+	int c, r;
+
+	if ((raw = (unsigned char *)malloc((stride + 1) * height)) == NULL) {
+		return 1;
+	}
+	if ((row = (unsigned char *)malloc(stride * 2)) == NULL) {
+		free(raw);
+		return 1;
+	}
+
+	// color output spreads luminance over channels so it converts back
+	// to roughly the same heights (R and B carry a little gradient)
+	for (y = 0; y < height; y++) {
+		unsigned char *cur = row + (y % 2) * stride;
+		for (x = 0; x < width; x++) {
+			unsigned char v = grey[y * width + x];
+			for (c = 0; c < channels; c++) {
+				if (c == 3) {
+					cur[x * channels + c] = 255;
+				} else if (channels >= 3 && c != 1) {
+					cur[x * channels + c] = (unsigned char)(v ^ ((x + y) & 7));
+				} else {
+					cur[x * channels + c] = v;
+				}
+			}
+		}
+		filterrow(raw + y * (stride + 1), cur, prev, stride, channels);
+		prev = cur;
+	}
+	free(row);
+
+	r = deflate(&z, raw, (stride + 1) * height);
+	free(raw);
+	if (r) {
+		free(z.data);
+		return 1;
+	}
+
+	put32(ihdr, width);
+	put32(ihdr + 4, height);
+	ihdr[8] = 8;
+	ihdr[9] = (unsigned char)colortype[channels];
+	ihdr[10] = 0;
+	ihdr[11] = 0;
+	ihdr[12] = 0;
+
+	crcinit();
+	r = fwrite(signature, 8, 1, fp) != 1 ||
+			writechunk(fp, "IHDR", ihdr, 13) ||
+			writechunk(fp, "IDAT", z.data, z.len) ||
+			writechunk(fp, "IEND", NULL, 0);
+	free(z.data);
+	return r;
+}
+
+// returns 0 if options are parsed successfully; nonzero otherwise
+int parseopts(int argc, char **argv) {
+
+	int c;
+
+	opterr = 0;
+
+	while ((c = getopt(argc, argv, "k:n:w:h:s:c:o:")) != -1) {
+		switch (c) {
+			case 'k':
+				// Kind of image to generate
+				CONFIG.kind = optarg;
+				break;
+			case 'n':
+				// Square size; shorthand for -w N -h N
+				if (sscanf(optarg, "%10u", &CONFIG.width) != 1 || CONFIG.width < 1) {
+					fprintf(stderr, "SIZE must be a positive integer.\n");
+					return 1;
+				}
+				CONFIG.height = CONFIG.width;
+				break;
+			case 'w':
+				if (sscanf(optarg, "%10u", &CONFIG.width) != 1 || CONFIG.width < 1) {
+					fprintf(stderr, "WIDTH must be a positive integer.\n");
+					return 1;
+				}
+				break;
+			case 'h':
+				if (sscanf(optarg, "%10u", &CONFIG.height) != 1 || CONFIG.height < 1) {
+					fprintf(stderr, "HEIGHT must be a positive integer.\n");
+					return 1;
+				}
+				break;
+			case 's':
+				if (sscanf(optarg, "%20lu", &CONFIG.seed) != 1) {
+					fprintf(stderr, "SEED must be a non-negative integer.\n");
+					return 1;
+				}
+				break;
+			case 'c':
+				if (sscanf(optarg, "%2d", &CONFIG.channels) != 1 || (CONFIG.channels != 1 && CONFIG.channels != 3 && CONFIG.channels != 4)) {
+					fprintf(stderr, "CHANNELS must be 1, 3, or 4.\n");
+					return 1;
+				}
+				break;
+			case 'o':
+				CONFIG.output = optarg;
+				break;
+			case '?':
+				if (isprint(optopt)) {
+					fprintf(stderr, "Unknown option or missing argument -%c\n", optopt);
+				} else {
+					fprintf(stderr, "Unknown option character \\x%x\n", optopt);
+				}
+				return 1;
+			default:
+				return 1;
+		}
+	}
+
+	if (optind < argc) {
+		fprintf(stderr, "Extraneous arguments\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	unsigned char *img;
+	FILE *fp;
+	int r;
+
+	if (parseopts(argc, argv)) {
+		fprintf(stderr, "usage: hmgen [-k terrain|plateau|noise|sparse|dense] [-n SIZE | -w WIDTH -h HEIGHT] [-s SEED] [-c 1|3|4] [-o OUTPUT]\n");
+		return 1;
+	}
+
+	// mix the kind into the seed so a mask and terrain of the same seed differ
+	rngstate = CONFIG.seed * 0x100000001B3ULL + (unsigned char)CONFIG.kind[0];
+
+	if (strcmp(CONFIG.kind, "terrain") == 0) {
+		img = DiamondSquare(CONFIG.width, CONFIG.height, 0.55);
+	} else if (strcmp(CONFIG.kind, "plateau") == 0) {
+		img = Plateau(CONFIG.width, CONFIG.height);
+	} else if (strcmp(CONFIG.kind, "noise") == 0) {
+		img = Noise(CONFIG.width, CONFIG.height);
+	} else if (strcmp(CONFIG.kind, "sparse") == 0) {
+		img = Mask(CONFIG.width, CONFIG.height, 0.1);
+	} else if (strcmp(CONFIG.kind, "dense") == 0) {
+		img = Mask(CONFIG.width, CONFIG.height, 0.9);
+	} else {
+		fprintf(stderr, "Unknown image kind: %s\n", CONFIG.kind);
+		return 1;
+	}
+
+	if (img == NULL) {
+		fprintf(stderr, "Cannot allocate memory for %ux%u image\n", CONFIG.width, CONFIG.height);
+		return 1;
+	}
+
+	if (CONFIG.output == NULL) {
+		fp = stdout;
+	} else if ((fp = fopen(CONFIG.output, "wb")) == NULL) {
+		fprintf(stderr, "Cannot open %s\n", CONFIG.output);
+		free(img);
+		return 1;
+	}
+
+	r = WritePNG(fp, img, CONFIG.width, CONFIG.height, CONFIG.channels);
+	free(img);
+
+	if (fp != stdout && fclose(fp) != 0) {
+		r = 1;
+	}
+	if (r) {
+		fprintf(stderr, "Cannot write PNG output\n");
+	}
+
+	return r;
+}
@@ -0,0 +1,592 @@
+// Microbenchmarks for the mesher and decoder kernels.
+// Each kernel runs in isolation on generated in-memory data, so results
+// are not drowned out by file I/O. Reports the median time per item over
+// a number of repetitions (after warm-up runs), with the median absolute
+// deviation as a measure of noise.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#endif
+
+// the whole of stb_image is compiled here so its static kernels
+// (convert_format, create_png_image_raw) can be called directly
+#define STBI_SIMD
+#include "../stb_image.c"
+
+#include <libtrix.h>
+#include "../heightmap.h"
+#include "../mesh.h"
+#include "../jpegsimd.h"
+
+static struct {
+	unsigned int size; // width and height of generated images
+	unsigned int meshsize; // width and height for kernels that build a mesh
+	int repeat; // timed repetitions per kernel
+	int warmup; // untimed repetitions per kernel
+	char *filter; // only run kernels whose name contains this; all if NULL
+} BENCH = {
+	1024,
+	256,
+	21,
+	3,
+	NULL
+};
+
+typedef struct {
+	const char *name;
+	void (*setup)(void);    // untimed; before each repetition (may be NULL)
+	void (*run)(void);      // timed
+	void (*teardown)(void); // untimed; after each repetition (may be NULL)
+	double items;           // items of work per run (pixels, quads, bytes)
+	const char *unit;
+} Kernel;
+
+// results are accumulated here so the compiler cannot discard the work
+static volatile double sink;
+
+static Heightmap terrain, small, small16, maskimg;
+static Mask *maskbits, *smallmask, *packed;
+static float *samples;
+static unsigned char *rgb, *rgba, *converted;
+static unsigned char *raw, *rawrgb;
+static short *blocks;
+static unsigned short dequant[64];
+static unsigned char *plane;
+static trix_mesh *tmesh;
+static int filtertype;
+static stbi pngstate;
+static png pngdec;
+
+/*
+ * Data generation
+ */
+
+static unsigned long long rngstate = 1;
+
+static unsigned int rng(void) {
+	rngstate ^= rngstate << 13;
+	rngstate ^= rngstate >> 7;
+	rngstate ^= rngstate << 17;
+	return (unsigned int)(rngstate >> 32);
+}
+
+// smooth value noise: bilinear interpolation of a coarse random grid
+static int makeheightmap(Heightmap *hm, unsigned int size, unsigned int cell) {
+	unsigned int x, y, cells = size / cell + 2;
+	unsigned char *grid;
+
+	if ((grid = (unsigned char *)malloc(cells * cells)) == NULL) {
+		return 1;
+	}
+	for (x = 0; x < cells * cells; x++) {
+		grid[x] = (unsigned char)rng();
+	}
+
+	hm->width = size;
+	hm->height = size;
+	hm->size = (unsigned long)size * size;
+	if ((hm->data = (unsigned char *)malloc(hm->size)) == NULL) {
+		free(grid);
+		return 1;
+	}
+
+	for (y = 0; y < size; y++) {
+		for (x = 0; x < size; x++) {
+			unsigned int gx = x / cell, gy = y / cell;
+			unsigned int fx = x % cell, fy = y % cell;
+			unsigned int top = grid[gy * cells + gx] * (cell - fx) + grid[gy * cells + gx + 1] * fx;
+			unsigned int bot = grid[(gy + 1) * cells + gx] * (cell - fx) + grid[(gy + 1) * cells + gx + 1] * fx;
+			hm->data[(unsigned long)y * size + x] = (unsigned char)((top * (cell - fy) + bot * fy) / (cell * cell));
+		}
+	}
+
+	free(grid);
+	hm->xoff = 0;
+	hm->yoff = 0;
+	hm->imagewidth = size;
+	hm->imageheight = size;
+	ScanHeightmap(hm);
+	return 0;
+}
+
+// raw (still filtered) PNG scanlines, every row using the same filter type
+static unsigned char *makeraw(unsigned int size, int channels) {
+	unsigned long stride = (unsigned long)size * channels + 1, i;
+	unsigned char *p;
+
+	if ((p = (unsigned char *)malloc(stride * size)) == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < stride * size; i++) {
+		p[i] = (unsigned char)(rng() & 0x0F);
+	}
+	return p;
+}
+
+static int generate(void) {
+	unsigned long i, n = (unsigned long)BENCH.size * BENCH.size;
+
+	if (makeheightmap(&terrain, BENCH.size, 32) ||
+			makeheightmap(&small, BENCH.meshsize, 16) ||
+			makeheightmap(&maskimg, BENCH.size, 64)) {
+		return 1;
+	}
+
+	// the same mesh heightmap at 16 bits
+	small16 = small;
+	small16.wide = 1;
+	if ((small16.data = (unsigned char *)malloc(small.size * sizeof(unsigned short))) == NULL) {
+		return 1;
+	}
+	for (i = 0; i < small.size; i++) {
+		((unsigned short *)small16.data)[i] = (unsigned short)(small.data[i] * 257);
+	}
+	ScanHeightmap(&small16);
+
+	// the mesh kernels' mask uses the first rows of the full size mask image
+	{
+		Heightmap sub = maskimg;
+		sub.width = small.width;
+		sub.height = small.height;
+		sub.size = small.size;
+		if ((maskbits = MaskFromHeightmap(&maskimg, 127, 0)) == NULL ||
+				(smallmask = MaskFromHeightmap(&sub, 127, 0)) == NULL) {
+			return 1;
+		}
+	}
+
+	// mostly positive corner samples; about one in eight flags an edge
+	if ((samples = (float *)malloc(n * sizeof(float))) == NULL) {
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		samples[i] = (rng() % 8 == 0) ? -1.0f : (float)(rng() % 256);
+	}
+
+	if ((rgb = (unsigned char *)malloc(n * 3)) == NULL || (rgba = (unsigned char *)malloc(n * 4)) == NULL) {
+		return 1;
+	}
+	for (i = 0; i < n * 3; i++) {
+		rgb[i] = (unsigned char)rng();
+	}
+	for (i = 0; i < n * 4; i++) {
+		rgba[i] = (unsigned char)rng();
+	}
+
+	if ((raw = makeraw(BENCH.size, 1)) == NULL || (rawrgb = makeraw(BENCH.size, 3)) == NULL) {
+		return 1;
+	}
+
+	// JPEG coefficient blocks, one per 8x8 pixels: a DC term and a few low
+	// frequencies, with a fine quantization table
+	if ((blocks = (short *)calloc(n, sizeof(short))) == NULL || (plane = (unsigned char *)malloc(n * 3)) == NULL) {
+		return 1;
+	}
+	for (i = 0; i < 64; i++) {
+		dequant[i] = (unsigned short)(1 + i / 4);
+	}
+	for (i = 0; i < n; i += 64) {
+		int k;
+		blocks[i] = (short)(rng() % 2048) - 1024;
+		for (k = 0; k < 5; k++) {
+			blocks[i + 1 + rng() % 15] = (short)(rng() % 64) - 32;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Mesher kernels
+ */
+
+static void run_masked(void) {
+	unsigned int x, y;
+	unsigned long n = 0;
+	mask = maskbits;
+	for (y = 0; y < terrain.height; y++) {
+		for (x = 0; x < terrain.width; x++) {
+			n += (unsigned long)Masked(x, y);
+		}
+	}
+	mask = NULL;
+	sink = (double)n;
+}
+
+static void run_hmzat(void) {
+	unsigned int x, y;
+	float sum = 0;
+	for (y = 0; y < terrain.height; y++) {
+		for (x = 0; x < terrain.width; x++) {
+			sum += hmzat(&terrain, x, y);
+		}
+	}
+	sink = sum;
+}
+
+static void run_avgnonneg(void) {
+	unsigned long i, n = terrain.size - 3;
+	float sum = 0;
+	for (i = 0; i < n; i++) {
+		sum += avgnonneg(samples[i] < 0 ? 1.0f : samples[i], samples[i + 1], samples[i + 2], samples[i + 3]);
+	}
+	sink = sum;
+}
+
+static void create_mesh(void) {
+	if (trixCreate(&tmesh, "microbench") != TRIX_OK) {
+		tmesh = NULL;
+	}
+}
+
+static void release_mesh(void) {
+	if (tmesh != NULL) {
+		(void)trixRelease(&tmesh);
+	}
+}
+
+static void run_surface(void) {
+	unsigned int x, y;
+	trix_vertex v1, v2, v3, v4;
+	for (y = 0; y < small.height; y++) {
+		for (x = 0; x < small.width; x++) {
+			v1.x = (float)x - 0.5f; v1.y = (float)y - 0.5f; v1.z = 1;
+			v2.x = (float)x + 0.5f; v2.y = v1.y; v2.z = 2;
+			v3.x = v2.x; v3.y = (float)y + 0.5f; v3.z = 3;
+			v4.x = v1.x; v4.y = v3.y; v4.z = 4;
+			(void)Surface(tmesh, &v1, &v2, &v3, &v4);
+		}
+	}
+}
+
+static void run_wall(void) {
+	unsigned int x, y;
+	trix_vertex a, b;
+	for (y = 0; y < small.height; y++) {
+		for (x = 0; x < small.width; x++) {
+			a.x = (float)x - 0.5f; a.y = (float)y - 0.5f; a.z = 1;
+			b.x = (float)x + 0.5f; b.y = a.y; b.z = 2;
+			(void)Wall(tmesh, &a, &b);
+		}
+	}
+}
+
+static void run_mesh(void) {
+	mask = NULL;
+	(void)Mesh(&small, tmesh);
+}
+
+static void run_mesh16(void) {
+	mask = NULL;
+	(void)Mesh(&small16, tmesh);
+}
+
+static void run_mesh_masked(void) {
+	mask = smallmask;
+	(void)Mesh(&small, tmesh);
+	mask = NULL;
+}
+
+static void release_packed(void) {
+	FreeMask(&packed);
+}
+
+static void run_pack(void) {
+	packed = MaskFromHeightmap(&maskimg, 127, 0);
+}
+
+static void run_scan(void) {
+	ScanHeightmap(&terrain);
+	sink = terrain.range;
+}
+
+/*
+ * Decoder kernels
+ */
+
+static void copy_rgb(void) {
+	converted = (unsigned char *)malloc(terrain.size * 3);
+	memcpy(converted, rgb, terrain.size * 3);
+}
+
+static void copy_rgba(void) {
+	converted = (unsigned char *)malloc(terrain.size * 4);
+	memcpy(converted, rgba, terrain.size * 4);
+}
+
+static void free_converted(void) {
+	free(converted);
+	converted = NULL;
+}
+
+static void run_convert3(void) {
+	converted = convert_format(converted, 3, 1, BENCH.size, BENCH.size);
+}
+
+static void run_convert4(void) {
+	converted = convert_format(converted, 4, 1, BENCH.size, BENCH.size);
+}
+
+static void set_filter(unsigned char *p, int channels) {
+	unsigned long stride = (unsigned long)BENCH.size * channels + 1;
+	unsigned int y;
+	for (y = 0; y < BENCH.size; y++) {
+		p[y * stride] = (unsigned char)filtertype;
+	}
+	pngstate.img_x = BENCH.size;
+	pngstate.img_y = BENCH.size;
+	pngstate.img_n = channels;
+	pngdec.s = &pngstate;
+	pngdec.depth = 8;
+	pngdec.out = NULL;
+}
+
+static void setup_unfilter(void) {
+	set_filter(raw, 1);
+}
+
+static void setup_unfilter_rgb(void) {
+	set_filter(rawrgb, 3);
+}
+
+static void free_unfiltered(void) {
+	free(pngdec.out);
+	pngdec.out = NULL;
+}
+
+static void run_unfilter(void) {
+	(void)create_png_image_raw(&pngdec, raw, (BENCH.size + 1) * BENCH.size, 1, BENCH.size, BENCH.size);
+}
+
+static void run_unfilter_rgb(void) {
+	(void)create_png_image_raw(&pngdec, rawrgb, (BENCH.size * 3 + 1) * BENCH.size, 3, BENCH.size, BENCH.size);
+}
+
+static void run_idct(void) {
+	unsigned int x, y;
+	const short *b = blocks;
+	for (y = 0; y + 8 <= BENCH.size; y += 8) {
+		for (x = 0; x + 8 <= BENCH.size; x += 8, b += 64) {
+			stbi_idct_installed(plane + (unsigned long)y * BENCH.size + x, (int)BENCH.size, (short *)b, dequant);
+		}
+	}
+}
+
+// YCbCr planes taken from the random RGB data
+static void run_ycbcr(void) {
+	unsigned long n = terrain.size;
+	unsigned int y;
+	for (y = 0; y < BENCH.size; y++) {
+		unsigned long row = (unsigned long)y * BENCH.size;
+		stbi_YCbCr_installed(plane + row * 3, rgb + row, rgb + n + row, rgb + 2 * n + row, (int)BENCH.size, 3);
+	}
+}
+
+/*
+ * Harness
+ */
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int cmpdouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double median(double *v, int n) {
+	qsort(v, (size_t)n, sizeof(double), cmpdouble);
+	return (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+// returns 0 on success, nonzero otherwise
+static int measure(const Kernel *k, const char *label) {
+	double *times, med, mad;
+	double start;
+	int i;
+
+	if ((times = (double *)malloc(BENCH.repeat * sizeof(double))) == NULL) {
+		return 1;
+	}
+
+	for (i = 0; i < BENCH.warmup + BENCH.repeat; i++) {
+		if (k->setup != NULL) {
+			k->setup();
+		}
+		start = now();
+		k->run();
+		if (i >= BENCH.warmup) {
+			times[i - BENCH.warmup] = (now() - start) / k->items;
+		}
+		if (k->teardown != NULL) {
+			k->teardown();
+		}
+	}
+
+	med = median(times, BENCH.repeat);
+	for (i = 0; i < BENCH.repeat; i++) {
+		times[i] = times[i] > med ? times[i] - med : med - times[i];
+	}
+	mad = median(times, BENCH.repeat);
+	free(times);
+
+	printf("%-28s %10.3f ns/%-5s %8.3f MAD %10.1f M%s/s\n",
+			label, med, k->unit, mad, med > 0 ? 1e3 / med : 0, k->unit);
+	return 0;
+}
+
+// returns 0 if options are parsed successfully; nonzero otherwise
+int parseopts(int argc, char **argv) {
+
+	int c;
+
+	opterr = 0;
+
+	while ((c = getopt(argc, argv, "n:m:r:w:k:")) != -1) {
+		switch (c) {
+			case 'n':
+				if (sscanf(optarg, "%10u", &BENCH.size) != 1 || BENCH.size < 16) {
+					fprintf(stderr, "SIZE must be an integer of at least 16.\n");
+					return 1;
+				}
+				break;
+			case 'm':
+				if (sscanf(optarg, "%10u", &BENCH.meshsize) != 1 || BENCH.meshsize < 2) {
+					fprintf(stderr, "MESHSIZE must be an integer of at least 2.\n");
+					return 1;
+				}
+				break;
+			case 'r':
+				if (sscanf(optarg, "%5d", &BENCH.repeat) != 1 || BENCH.repeat < 1) {
+					fprintf(stderr, "REPEAT must be a positive integer.\n");
+					return 1;
+				}
+				break;
+			case 'w':
+				if (sscanf(optarg, "%5d", &BENCH.warmup) != 1 || BENCH.warmup < 0) {
+					fprintf(stderr, "WARMUP must be a non-negative integer.\n");
+					return 1;
+				}
+				break;
+			case 'k':
+				BENCH.filter = optarg;
+				break;
+			case '?':
+				if (isprint(optopt)) {
+					fprintf(stderr, "Unknown option or missing argument -%c\n", optopt);
+				} else {
+					fprintf(stderr, "Unknown option character \\x%x\n", optopt);
+				}
+				return 1;
+			default:
+				return 1;
+		}
+	}
+
+	if (optind < argc) {
+		fprintf(stderr, "Extraneous arguments\n");
+		return 1;
+	}
+
+	if (BENCH.meshsize > BENCH.size) {
+		BENCH.meshsize = BENCH.size;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	static const char *filternames[5] = {"none", "sub", "up", "avg", "paeth"};
+	double pixels, meshpixels;
+	char label[64];
+	unsigned int i;
+	int f;
+
+	if (parseopts(argc, argv)) {
+		fprintf(stderr, "usage: microbench [-n SIZE] [-m MESHSIZE] [-r REPEAT] [-w WARMUP] [-k NAME]\n");
+		return 1;
+	}
+
+	if (generate()) {
+		fprintf(stderr, "Cannot allocate memory for test data\n");
+		return 1;
+	}
+
+	pixels = (double)BENCH.size * BENCH.size;
+	meshpixels = (double)BENCH.meshsize * BENCH.meshsize;
+
+	{
+		const Kernel kernels[] = {
+			{"Masked", NULL, run_masked, NULL, pixels, "px"},
+			{"hmzat", NULL, run_hmzat, NULL, pixels, "px"},
+			{"avgnonneg", NULL, run_avgnonneg, NULL, pixels - 3, "call"},
+			{"Surface", create_mesh, run_surface, release_mesh, meshpixels, "quad"},
+			{"Wall", create_mesh, run_wall, release_mesh, meshpixels, "wall"},
+			{"Mesh", create_mesh, run_mesh, release_mesh, meshpixels, "px"},
+			{"Mesh (masked)", create_mesh, run_mesh_masked, release_mesh, meshpixels, "px"},
+			{"Mesh (16-bit)", create_mesh, run_mesh16, release_mesh, meshpixels, "px"},
+			{"MaskFromHeightmap", NULL, run_pack, release_packed, pixels, "px"},
+			{"ScanHeightmap", NULL, run_scan, NULL, pixels, "px"},
+			{"convert_format 3->1", copy_rgb, run_convert3, free_converted, pixels, "px"},
+			{"convert_format 4->1", copy_rgba, run_convert4, free_converted, pixels, "px"},
+		};
+
+		printf("%ux%u images (%ux%u for mesh kernels), %d repetitions after %d warm-up\n",
+				BENCH.size, BENCH.size, BENCH.meshsize, BENCH.meshsize, BENCH.repeat, BENCH.warmup);
+
+		for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+			if (BENCH.filter != NULL && strstr(kernels[i].name, BENCH.filter) == NULL) {
+				continue;
+			}
+			if (measure(&kernels[i], kernels[i].name)) {
+				return 1;
+			}
+		}
+	}
+
+	// JPEG kernels, once per kernel set this CPU supports
+	{
+		const Kernel idct = {"idct", NULL, run_idct, NULL, pixels, "px"};
+		const Kernel ycbcr = {"YCbCr_to_RGB", NULL, run_ycbcr, NULL, pixels, "px"};
+		JpegKernels k, best = BestJpegKernels();
+
+		for (k = JPEG_SCALAR; k <= best; k++) {
+			(void)InstallJpegKernels(k);
+			snprintf(label, sizeof(label), "idct (%s)", JpegKernelsName(k));
+			if ((BENCH.filter == NULL || strstr(label, BENCH.filter) != NULL) && measure(&idct, label)) {
+				return 1;
+			}
+			snprintf(label, sizeof(label), "YCbCr_to_RGB (%s)", JpegKernelsName(k));
+			if ((BENCH.filter == NULL || strstr(label, BENCH.filter) != NULL) && measure(&ycbcr, label)) {
+				return 1;
+			}
+		}
+	}
+
+	// PNG unfiltering, once per filter type for grey and RGB scanlines
+	for (f = 0; f < 5; f++) {
+		const Kernel grey = {"unfilter", setup_unfilter, run_unfilter, free_unfiltered, pixels, "px"};
+		const Kernel color = {"unfilter", setup_unfilter_rgb, run_unfilter_rgb, free_unfiltered, pixels, "px"};
+		filtertype = f;
+
+		snprintf(label, sizeof(label), "unfilter %s (grey)", filternames[f]);
+		if ((BENCH.filter == NULL || strstr(label, BENCH.filter) != NULL) && measure(&grey, label)) {
+			return 1;
+		}
+		snprintf(label, sizeof(label), "unfilter %s (rgb)", filternames[f]);
+		if ((BENCH.filter == NULL || strstr(label, BENCH.filter) != NULL) && measure(&color, label)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -1,30 +1,56 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 
 #include "stb_image.h"
 #include "heightmap.h"
+#include "trace.h"
 
 
-void ScanHeightmap(Heightmap *hm) {
+// Fold n 8-bit samples into *min and *max
+static void scan8(const unsigned char *data, unsigned long n, unsigned short *min, unsigned short *max) {
 	
 	unsigned long i;
-	unsigned char min, max;
+	unsigned char lo = 255, hi = 0;
+	
+	for (i = 0; i < n; i++) {
+		lo = data[i] < lo ? data[i] : lo;
+		hi = data[i] > hi ? data[i] : hi;
+	}
+	
+	*min = lo < *min ? lo : *min;
+	*max = hi > *max ? hi : *max;
+}
+
+// Fold n 16-bit samples into *min and *max
+static void scan16(const unsigned short *data, unsigned long n, unsigned short *min, unsigned short *max) {
+	
+	unsigned long i;
+	unsigned short lo = 65535, hi = 0;
+	
+	for (i = 0; i < n; i++) {
+		lo = data[i] < lo ? data[i] : lo;
+		hi = data[i] > hi ? data[i] : hi;
+	}
+	
+	*min = lo < *min ? lo : *min;
+	*max = hi > *max ? hi : *max;
+}
+
+void ScanHeightmap(Heightmap *hm) {
+	
+	unsigned short min = 65535, max = 0;
 	
 	if (hm == NULL || hm->data == NULL) {
 		return;
 	}
 	
-	min = 255;
-	max = 0;
-	
-	for (i = 0; i < hm->size; i++) {
-		if (hm->data[i] < min) {
-			min = hm->data[i];
-		}
-		if (hm->data[i] > max) {
-			max = hm->data[i];
-		}
+	if (hm->wide) {
+		scan16((const unsigned short *)hm->data, hm->size, &min, &max);
+	}
+	else {
+		scan8(hm->data, hm->size, &min, &max);
 	}
 	
 	hm->min = min;
@@ -32,51 +58,370 @@ void ScanHeightmap(Heightmap *hm) {
 	hm->range = max - min;
 }
 
+// State for ReadImageRows: each factor x factor block of decoded pixels (or
+// what's left of one at the right and bottom edges) is averaged into one
+// output pixel as the decoded rows arrive.
+typedef struct {
+	ImageRowFunc func;
+	void *user;
+	unsigned int scale;
+	const int *width, *height; // decoded image dimensions
+	unsigned long *sums; // column sums of the output row being averaged
+	unsigned char *out; // the output row (of unsigned short, for 16-bit rows)
+	int failed;
+} ImageRows;
+
+// Row callback for stbi; rows arrive in order.
+static void imagerow(void *user, int y, const unsigned char *row, int len) {
+	
+	ImageRows *r = (ImageRows *)user;
+	unsigned int f = r->scale / (unsigned int)stbi_scale();
+	unsigned int w = ((unsigned int)*r->width + f - 1) / f;
+	unsigned int h = ((unsigned int)*r->height + f - 1) / f;
+	unsigned int x, i, bw, bh;
+	unsigned long sum, avg;
+	const unsigned short *wrow = (const unsigned short *)row;
+	int wide = (stbi_sample_bits() == 16);
+	
+	(void)len;
+	
+	if (r->failed) {
+		return;
+	}
+	
+	if (f <= 1) {
+		r->func(r->user, (unsigned int)y, row, w, h, wide);
+		return;
+	}
+	
+	if (r->sums == NULL) {
+		r->sums = (unsigned long *)calloc(w, sizeof(unsigned long));
+		r->out = (unsigned char *)malloc(w * sizeof(unsigned short));
+		if (r->sums == NULL || r->out == NULL) {
+			r->failed = 1;
+			return;
+		}
+	}
+	
+	for (x = 0; x < w; x++) {
+		bw = ((unsigned int)*r->width - x * f < f ? (unsigned int)*r->width - x * f : f);
+		sum = 0;
+		if (wide) {
+			for (i = 0; i < bw; i++) {
+				sum += wrow[x * f + i];
+			}
+		}
+		else {
+			for (i = 0; i < bw; i++) {
+				sum += row[x * f + i];
+			}
+		}
+		r->sums[x] += sum;
+	}
+	
+	// last row of a block (or of the image): average it and hand it over
+	if ((unsigned int)y % f == f - 1 || y == *r->height - 1) {
+		bh = (unsigned int)y % f + 1;
+		for (x = 0; x < w; x++) {
+			bw = ((unsigned int)*r->width - x * f < f ? (unsigned int)*r->width - x * f : f);
+			avg = (r->sums[x] + (unsigned long)(bw * bh) / 2) / (unsigned long)(bw * bh);
+			if (wide) {
+				((unsigned short *)r->out)[x] = (unsigned short)avg;
+			}
+			else {
+				r->out[x] = (unsigned char)avg;
+			}
+			r->sums[x] = 0;
+		}
+		r->func(r->user, (unsigned int)y / f, r->out, w, h, wide);
+	}
+}
+
+// Read a greyscale image from the file at path (or stdin, if path is NULL)
+// a row at a time, reduced by scale in each dimension (rounding up), passing
+// each row to func in order. JPEG images are reduced by 2, 4 or 8 while
+// decoding where scale allows; anything left is averaged here. Only the
+// first rows of the reduced image are read if rows is not 0. Non-interlaced
+// PNG is decoded a few rows at a time, so no whole image is ever held.
+// Samples are 8-bit, except that if wide is true those of a 16-bit PNG are
+// kept at 16 bits (and func is told so).
+// Returns 0 on success, nonzero otherwise (after printing the reason)
+int ReadImageRows(const char *path, unsigned int rows, unsigned int scale, int wide, ImageRowFunc func, void *user) {
+	
+	int width, height, depth, ok;
+	ImageRows r = {func, user, scale, &width, &height, NULL, NULL, 0};
+	
+	stbi_set_row_limit((int)(rows * scale));
+	stbi_set_scale((int)scale);
+	stbi_set_sample_bits(wide ? 16 : 8);
+	stbi_set_row_callback(imagerow, &r);
+	if (path == NULL) {
+		ok = stbi_load_rows_from_file(stdin, &width, &height, &depth, 1);
+	}
+	else {
+		ok = stbi_load_rows(path, &width, &height, &depth, 1);
+	}
+	stbi_set_row_callback(NULL, NULL);
+	stbi_set_row_limit(0);
+	stbi_set_scale(1);
+	stbi_set_sample_bits(8);
+	
+	free(r.sums);
+	free(r.out);
+	
+	if (!ok) {
+		fprintf(stderr, "%s\n", stbi_failure_reason());
+		return 1;
+	}
+	
+	if (r.failed) {
+		fprintf(stderr, "Cannot allocate memory for image rows\n");
+		return 1;
+	}
+	
+	return 0;
+}
+
+// Returns 1 if head is the start of a PNG with 16-bit samples, 0 otherwise
+static int png16(const unsigned char head[29]) {
+	static const unsigned char png[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	return memcmp(head, png, 8) == 0 && head[24] == 16;
+}
+
+// Roughly the memory stb_image holds while ReadImageRows reads an image of
+// the given (full) dimensions and components, whose first bytes are head:
+// a few rows and the inflate window for non-interlaced PNG, the luma plane
+// at the reduced size it decodes for JPEG, and the whole image (before it
+// is converted to grey) for anything else.
+static unsigned long decodebytes(const unsigned char head[29], unsigned int width, unsigned int height, int comp, unsigned int scale) {
+	
+	static const unsigned char png[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	unsigned long w = width, h = height, bytes = (png16(head) ? 2 : 1);
+	unsigned int j;
+	
+	if (memcmp(head, png, 8) == 0 && head[28] == 0) {
+		return 2 * 65536 + 8 * w * 4 * bytes;
+	}
+	
+	if (head[0] == 0xFF && head[1] == 0xD8) {
+		for (j = 8; j > 1 && scale % j != 0; j /= 2);
+		return ((w + j - 1) / j + 16) * ((h + j - 1) / j + 16);
+	}
+	
+	return w * h * ((unsigned long)comp + 1) * bytes;
+}
+
+// Read what the header of the image at path says about reading it with
+// ReadImageRows at the given scale. Nothing is decoded.
+// Returns 0 on success, nonzero otherwise
+int ReadImageInfo(const char *path, unsigned int scale, ImageInfo *info) {
+	
+	FILE *fp;
+	unsigned char head[29];
+	int w, h, comp;
+	
+	if ((fp = fopen(path, "rb")) == NULL) {
+		return 1;
+	}
+	
+	memset(head, 0, sizeof(head));
+	if (!stbi_info_from_file(fp, &w, &h, &comp) || w <= 0 || h <= 0) {
+		fclose(fp);
+		return 1;
+	}
+	(void)fread(head, 1, sizeof(head), fp);
+	fclose(fp);
+	
+	info->width = ((unsigned int)w + scale - 1) / scale;
+	info->height = ((unsigned int)h + scale - 1) / scale;
+	info->wide = png16(head);
+	info->decode = decodebytes(head, (unsigned int)w, (unsigned int)h, comp, scale);
+	return 0;
+}
+
 // Returns pointer to Heightmap
 // Returns NULL on error
 Heightmap *ReadHeightmap(const char *path) {
-	
-	int width, height, depth;
-	unsigned char *data;
+	return ReadHeightmapRows(path, 0, 1);
+}
+
+// Heightmap being filled in by ReadImageRows, with a running min/max of
+// the rows so far
+typedef struct {
 	Heightmap *hm;
+	unsigned int rows; // row limit, or 0
+	unsigned int scale;
+	unsigned int scanned;
+	unsigned short min, max;
+	int failed;
+	HeightmapProgress progress;
+	void *user;
+	int stopped; // progress asked to stop
+} HeightmapRows;
+
+// Image row callback; allocates the raster on the first row and folds each
+// row into the scan while it is still in cache.
+static void heightmaprow(void *user, unsigned int y, const unsigned char *row, unsigned int width, unsigned int height, int wide) {
 	
-	if (path == NULL) {
-		data = stbi_load_from_file(stdin, &width, &height, &depth, 1);
+	HeightmapRows *r = (HeightmapRows *)user;
+	Heightmap *hm = r->hm;
+	unsigned long bytes = (wide ? 2 : 1);
+	
+	if (r->failed || r->stopped) {
+		return;
+	}
+	
+	if (hm->data == NULL) {
+		hm->width = width;
+		hm->imagewidth = width;
+		hm->imageheight = height;
+		hm->wide = wide;
+		
+		// rows past the limit are never read; leave them out
+		hm->height = (r->rows > 0 && r->rows < height ? r->rows : height);
+		hm->size = (unsigned long)width * hm->height;
+		
+		if ((hm->data = (unsigned char *)calloc(hm->size, bytes)) == NULL) {
+			r->failed = 1;
+			return;
+		}
+	}
+	
+	if (y >= hm->height) {
+		return;
+	}
+	
+	memcpy(hm->data + (unsigned long)y * hm->width * bytes, row, hm->width * bytes);
+	
+	if (wide) {
+		scan16((const unsigned short *)row, width, &r->min, &r->max);
 	}
 	else {
-		data = stbi_load(path, &width, &height, &depth, 1);
+		scan8(row, width, &r->min, &r->max);
 	}
+	r->scanned++;
 	
-	if (data == NULL) {
-		fprintf(stderr, "%s\n", stbi_failure_reason());
-		return NULL;
+	if (r->progress != NULL && r->progress(r->user, hm, y + 1)) {
+		r->stopped = 1;
+		return;
 	}
 	
-	if ((hm = (Heightmap *)malloc(sizeof(Heightmap))) == NULL) {
+	// progress lowered the height; read no further than that
+	if (hm->height < (r->rows > 0 ? r->rows : height)) {
+		r->rows = hm->height;
+		stbi_set_row_limit((int)(r->rows * r->scale));
+	}
+}
+
+// The read failed: tell progress, if it has been called, so it can stop
+// using the raster, and free the heightmap
+static void abandon(HeightmapRows *r) {
+	if (r->progress != NULL && r->scanned > 0) {
+		(void)r->progress(r->user, r->hm, 0);
+	}
+	FreeHeightmap(&r->hm);
+}
+
+// Returns pointer to Heightmap holding only the first rows of the image
+// (or the whole image, if rows is 0), reduced by scale in each dimension
+// (1 for full size; see ReadImageRows). Decoding may stop early after them.
+// Returns NULL on error
+Heightmap *ReadHeightmapRows(const char *path, unsigned int rows, unsigned int scale) {
+	return ReadHeightmapProgress(path, rows, scale, NULL, NULL);
+}
+
+// As ReadHeightmapRows, calling progress (unless it is NULL) as each row is
+// filled in, from the thread that called this. progress may lower
+// hm->height (and size) to stop reading after fewer rows. Returns NULL on
+// error, or if progress returns nonzero (after printing the reason,
+// presumably); progress is then called once more with rows 0 before the
+// raster is freed, if it has been called at all.
+Heightmap *ReadHeightmapProgress(const char *path, unsigned int rows, unsigned int scale, HeightmapProgress progress, void *user) {
+	
+	Heightmap *hm;
+	TraceSpan span;
+	HeightmapRows r = {NULL, rows, scale, 0, 65535, 0, 0, progress, user, 0};
+	
+	if ((hm = (Heightmap *)calloc(1, sizeof(Heightmap))) == NULL) {
 		fprintf(stderr, "Cannot allocate memory for heightmap structure\n");
-		free(data);
 		return NULL;
 	}
+	r.hm = hm;
 	
-	hm->width = (unsigned int)width;
-	hm->height = (unsigned int)height;
-	hm->size = (unsigned long)width * (unsigned long)height;
-	hm->data = data;
+	TraceBegin(&span, "decode", (path == NULL ? "stdin" : path), -1, rows > 0 ? (long)rows - 1 : -1);
+	if (ReadImageRows(path, rows, scale, 1, heightmaprow, &r)) {
+		TraceEnd(&span);
+		abandon(&r);
+		return NULL;
+	}
+	TraceEnd(&span);
 	
-	ScanHeightmap(hm);
+	if (r.stopped) {
+		abandon(&r);
+		return NULL;
+	}
+	
+	if (r.failed || hm->data == NULL) {
+		fprintf(stderr, "Cannot allocate memory for heightmap\n");
+		abandon(&r);
+		return NULL;
+	}
+	
+	// a decoder that stops short leaves the rest of the raster 0; rows
+	// scanned before progress lowered the height may be past it
+	if (r.scanned == hm->height) {
+		hm->min = r.min;
+		hm->max = r.max;
+		hm->range = r.max - r.min;
+	}
+	else {
+		ScanHeightmap(hm);
+	}
 	
 	return hm;
 }
 
+// Crop heightmap in place to the given rectangle of its current raster.
+// The offsets and image dimensions still refer to the original image.
+// Returns 0 on success, nonzero otherwise
+int CropHeightmap(Heightmap *hm, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+	
+	unsigned int row;
+	unsigned char *data;
+	unsigned long bytes = (hm->wide ? 2 : 1);
+	
+	if (width == 0 || height == 0 || x + width > hm->width || y + height > hm->height) {
+		return 1;
+	}
+	
+	for (row = 0; row < height; row++) {
+		memmove(hm->data + (unsigned long)row * width * bytes,
+				hm->data + ((unsigned long)(y + row) * hm->width + x) * bytes, width * bytes);
+	}
+	
+	hm->xoff += x;
+	hm->yoff += y;
+	hm->width = width;
+	hm->height = height;
+	hm->size = (unsigned long)width * height;
+	
+	// release the rest of the raster; keep the original if that fails
+	if ((data = (unsigned char *)realloc(hm->data, hm->size * bytes)) != NULL) {
+		hm->data = data;
+	}
+	
+	ScanHeightmap(hm);
+	
+	return 0;
+}
+
 void FreeHeightmap(Heightmap **hm) {
 	
 	if (hm == NULL || *hm == NULL) {
 		return;
 	}
 	
-	if ((*hm)->data != NULL) {
-		stbi_image_free((*hm)->data);
-	}
+	free((*hm)->data);
 	
 	free(*hm);
 	*hm = NULL;
@@ -86,9 +431,13 @@ void DumpHeightmap(const Heightmap *hm) {
 	fprintf(stderr, "Width: %u\n", hm->width);
 	fprintf(stderr, "Height: %u\n", hm->height);
 	fprintf(stderr, "Size: %lu\n", hm->size);
+	fprintf(stderr, "Bits: %d\n", hm->wide ? 16 : 8);
 	fprintf(stderr, "Min: %d\n", hm->min);
 	fprintf(stderr, "Max: %d\n", hm->max);
 	fprintf(stderr, "Range: %d\n", hm->range);
+	if (hm->width != hm->imagewidth || hm->height != hm->imageheight) {
+		fprintf(stderr, "Cropped from: %ux%u (at %u, %u)\n", hm->imagewidth, hm->imageheight, hm->xoff, hm->yoff);
+	}
 }
 
 
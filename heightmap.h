@@ -8,14 +8,54 @@ typedef struct {
 	unsigned long size;
 	
 	// z dimensions (range = max - min = relief)
-	unsigned char min, max, range;
+	unsigned short min, max, range;
 	
-	// raster with size pixels ranging in value from min to max
+	// boolean; samples are 16-bit (from a 16-bit PNG) if true, 8-bit otherwise
+	int wide;
+	
+	// raster with size pixels ranging in value from min to max: unsigned
+	// char samples, or unsigned short if wide
 	unsigned char *data;
 	
+	// position of this raster within the original image, and the original
+	// image dimensions (which differ only if the heightmap is cropped)
+	unsigned int xoff, yoff, imagewidth, imageheight;
+	
 } Heightmap;
 
+// Returns sample i of hm's raster, whichever its width
+static inline unsigned int HeightmapSample(const Heightmap *hm, unsigned long i) {
+	return hm->wide ? ((const unsigned short *)hm->data)[i] : hm->data[i];
+}
+
+// Called by ReadImageRows with each row of the (reduced) image, in order.
+// width and height are those of the whole reduced image, even if only its
+// first rows are read. The row holds unsigned short samples if wide is
+// true, unsigned char otherwise.
+typedef void (*ImageRowFunc)(void *user, unsigned int y, const unsigned char *row, unsigned int width, unsigned int height, int wide);
+
+// What an image's header says about reading it with ReadImageRows
+typedef struct {
+	unsigned int width, height; // reduced by scale, as ReadImageRows would
+	int wide; // boolean; 16-bit samples (a 16-bit PNG) if true
+	unsigned long decode; // bytes the decoder holds while reading it, roughly
+} ImageInfo;
+
+int ReadImageInfo(const char *path, unsigned int scale, ImageInfo *info);
+int ReadImageRows(const char *path, unsigned int rows, unsigned int scale, int wide, ImageRowFunc func, void *user);
 Heightmap *ReadHeightmap(const char *path);
+Heightmap *ReadHeightmapRows(const char *path, unsigned int rows, unsigned int scale);
+
+// Called by ReadHeightmapProgress once the first rows rows of hm are filled
+// in, for each row in turn. hm's dimensions and raster are set by the first
+// call; it may lower hm->height and size to leave out the rows after them.
+// Returns 0 to carry on, nonzero to stop (the read then fails). If the read
+// fails after the first call, it is called with rows 0 before hm is freed.
+typedef int (*HeightmapProgress)(void *user, Heightmap *hm, unsigned int rows);
+
+Heightmap *ReadHeightmapProgress(const char *path, unsigned int rows, unsigned int scale, HeightmapProgress progress, void *user);
+int CropHeightmap(Heightmap *hm, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+void ScanHeightmap(Heightmap *hm);
 void FreeHeightmap(Heightmap **hm);
 void DumpHeightmap(const Heightmap *hm);
 
@@ -1,324 +1,427 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 
 #ifndef S_SPLINT_S
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
 #endif
 
 #include <libtrix.h>
 #include "heightmap.h"
+#include "stats.h"
+#include "trace.h"
+#include "mesh.h"
+#include "pipeline.h"
+#include "jpegsimd.h"
+#include "stb_image.h"
 
-typedef struct {
-	int base; // boolean; output walls and bottom as well as terrain surface if true
-	int ascii; // boolean; output ASCII STL instead of binary STL if true	
-	char *input; // path to input file; use stdin if NULL
-	char *output; // path to output file; use stdout if NULL
-	char *mask; // path to mask file; no mask if NULL
-	int threshold; // 0-255; maximum value considered masked
-	int reversed; // boolean; reverse results of mask tests if true
-	int heightmask; // boolean; use heightmap as it's own mask if true
-	float zscale; // scaling factor applied to raw Z values
-	float baseheight; // height in STL units of base below lowest terrain (technically, offset added to scaled Z values)
-} Settings;
-
-Settings CONFIG = {
-	1,    // generate base (walls and bottom)
-	0,    // binary output
-	NULL, // read from stdin
-	NULL, // write to stdout
-	NULL, // no mask
-	127,  // middle of 8 bit range
-	0,    // normal un-reversed mask
-	0,    // no heightmasking
-	1.0,  // no z scaling (use raw heightmap values)
-	1.0   // minimum base thickness of one unit
-};
+// size of the STL output just written, or -1 if it cannot be determined
+static long OutputBytes(const Stats *stats) {
+	struct stat st;
+	unsigned long triangles = stats->surface + stats->walls + stats->bottom;
+	
+	if (CONFIG.output != NULL) {
+		if (stat(CONFIG.output, &st) == 0) {
+			return (long)st.st_size;
+		}
+	} else if (fstat(fileno(stdout), &st) == 0 && S_ISREG(st.st_mode)) {
+		return (long)st.st_size;
+	}
+	
+	// binary STL is an 80 byte header, a 4 byte count, and 50 bytes per triangle
+	return CONFIG.ascii ? -1 : (long)(84 + 50 * triangles);
+}
 
-Heightmap *mask = NULL;
+// Check the mask (if masked) and region against a heightmap of the given
+// dimensions. Returns 0 on success, nonzero otherwise
+static int CheckDimensions(unsigned int width, unsigned int height, int masked, unsigned int maskwidth, unsigned int maskheight) {
+	
+	if (masked && (maskwidth != width || maskheight != height)) {
+		fprintf(stderr, "Mask dimensions do not match heightmap dimensions.\n");
+		fprintf(stderr, "Heightmap width: %u, height: %u\n", width, height);
+		return 1;
+	}
+	
+	// (compared so as not to overflow)
+	if (CONFIG.region[2] > 0 &&
+			(CONFIG.region[0] >= width || CONFIG.region[2] > width - CONFIG.region[0] ||
+			CONFIG.region[1] >= height || CONFIG.region[3] > height - CONFIG.region[1])) {
+		fprintf(stderr, "Region extends beyond heightmap.\n");
+		fprintf(stderr, "Heightmap width: %u, height: %u\n", width, height);
+		return 1;
+	}
+	
+	return 0;
+}
 
-// If a mask is defined, only portions of the heightmap that are visible through the mask are output.
-// Bright areas of the mask image are considered transparent and dark areas are considered opaque.
-int Masked(unsigned int x, unsigned int y) {
-	unsigned long index;
-	int result = 0;
-	
-	// is masking mode even on?
-	// (not if no heightmask or mask file.)
-	if (mask == NULL) {
+// Rows of an image height rows high down to the one below the region, or
+// 0 if that is past the last row (or there is no region)
+static unsigned int RegionRows(unsigned int height) {
+	if (CONFIG.region[2] == 0 || CONFIG.region[1] >= height || CONFIG.region[3] >= height - CONFIG.region[1] - 1) {
 		return 0;
 	}
+	return CONFIG.region[1] + CONFIG.region[3] + 1;
+}
+
+// returns 0 on success, nonzero otherwise
+static int CheckHeightmap(const Heightmap *hm) {
+	return CheckDimensions(hm->imagewidth, hm->imageheight, mask != NULL,
+			mask != NULL ? mask->width : 0, mask != NULL ? mask->height : 0);
+}
+
+// How the conversion runs, planned from the image headers before anything
+// is decoded (or, for a heightmap on stdin, once its dimensions are known)
+static struct {
+	int pending; // not planned yet
+	int masked; // mask holds what the mask file's header says
+	ImageInfo mask;
+	unsigned long memory, output; // estimated peak bytes in use, and bytes of STL
+	int streaming; // mesh and write a chunk at a time, rather than whole
+	unsigned int depth; // pipeline ring slots
+} PLAN = {1, 0, {0, 0, 0, 0}, 0, 0, 0, PIPELINE_DEPTH};
+
+// bytes of a packed mask
+static unsigned long MaskBytes(unsigned int width, unsigned int height) {
+	return ((unsigned long)width + 63) / 64 * 8 * height;
+}
+
+static unsigned long Larger(unsigned long a, unsigned long b) {
+	return a > b ? a : b;
+}
+
+// The largest unit (bytes, KB, MB, or GB) that divides bytes exactly,
+// which is the suffix --max-memory was given with, or a smaller one
+static unsigned long MemoryUnit(unsigned long bytes, const char **name) {
+	static const char *names[] = {"bytes", "KB", "MB", "GB"};
+	int i;
 	
-	index = (y * mask->width) + x;
-	if (mask->data[index] <= (unsigned char)CONFIG.threshold) {
-		result = 1;
+	for (i = 0; i < 3 && bytes % (1UL << (10 * (i + 1))) == 0; i++);
+	*name = names[i];
+	return 1UL << (10 * i);
+}
+
+// Estimate the peak memory and the output size of converting a heightmap of
+// the given dimensions (with 16-bit samples, if wide), which the decoder
+// needs decode bytes to read, and decide how to run it: in memory for -h
+// and --reference, or else a chunk at a time through the pipeline. Given
+// --max-memory, a heightmask whole mesh that would take more is streamed
+// instead, and the pipeline's ring made shallower until it fits. Returns 0
+// to go ahead, nonzero if it still doesn't fit (after printing why)
+static int PlanConversion(unsigned int width, unsigned int height, int wide, unsigned long decode) {
+	unsigned int rows = height, mw = width, mh = height;
+	unsigned long fixed, maskdecode = 0, triangles, inmemory, pipeline, streaming, unit;
+	const char *name;
+	
+	// the rows down to the one below the region are decoded, and the
+	// region meshed
+	if (CONFIG.region[2] > 0) {
+		if (!CONFIG.reference && RegionRows(height) > 0) {
+			rows = RegionRows(height);
+		}
+		mw = CONFIG.region[2];
+		mh = CONFIG.region[3];
+	}
+	
+	// the heightmap raster and the mask are held throughout
+	fixed = (unsigned long)width * rows * (wide ? 2 : 1);
+	if (CONFIG.heightmask) {
+		fixed += MaskBytes(width, rows);
+	}
+	else if (CONFIG.mask != NULL) {
+		fixed += MaskBytes(width, height);
+		maskdecode = (PLAN.masked ? PLAN.mask.decode : 0);
+	}
+	
+	triangles = EstimateTriangles(mw, mh);
+	
+	// the mask is read, then the heightmap decoded, then meshed whole
+	inmemory = fixed + Larger(Larger(maskdecode, decode), EstimateMeshMemory(triangles));
+	
+	// the pipeline runs while both images decode, or after the heightmap
+	// for a heightmask; its ring is made shallower until it fits
+	for (PLAN.depth = PIPELINE_DEPTH; ; PLAN.depth--) {
+		pipeline = PipelineMemory(width, rows, PLAN.depth);
+		streaming = fixed + (CONFIG.heightmask ? Larger(decode, pipeline) : decode + maskdecode + pipeline);
+		if (CONFIG.maxmemory == 0 || streaming <= CONFIG.maxmemory || PLAN.depth == 1) {
+			break;
+		}
+	}
+	
+	PLAN.pending = 0;
+	PLAN.streaming = !CONFIG.reference && !CONFIG.heightmask;
+	if (CONFIG.maxmemory > 0 && !CONFIG.reference && !PLAN.streaming && inmemory > CONFIG.maxmemory) {
+		PLAN.streaming = 1;
+	}
+	PLAN.memory = (PLAN.streaming ? streaming : inmemory);
+	PLAN.output = EstimateOutput(triangles);
+	
+	if (STATS != NULL) {
+		STATS->estmemory = PLAN.memory / 1024;
+		STATS->estbytes = PLAN.output;
+		STATS->streamed = PLAN.streaming;
 	}
 	
-	if (CONFIG.reversed) {
-		result = !result;
+	// in the unit the limit was given in
+	if (CONFIG.maxmemory > 0 && PLAN.memory > CONFIG.maxmemory) {
+		unit = MemoryUnit(CONFIG.maxmemory, &name);
+		fprintf(stderr, "Estimated peak memory of %.*f %s exceeds --max-memory of %lu %s (for %.*f %s of output).\n",
+				unit > 1, (double)PLAN.memory / unit, name, CONFIG.maxmemory / unit, name,
+				unit > 1, (double)PLAN.output / unit, name);
+		fprintf(stderr, "Use -d or -R to convert less of the heightmap.\n");
+		return 1;
 	}
 	
-	return result;
+	return 0;
 }
 
-static trix_result Wall(trix_mesh *mesh, const trix_vertex *a, const trix_vertex *b) {
-	trix_vertex a0 = *a;
-	trix_vertex b0 = *b;
-	trix_triangle t1;
-	trix_triangle t2;
-	trix_result r;
-	a0.z = 0;
-	b0.z = 0;
-	t1.a = *a;
-	t1.b = *b;
-	t1.c = b0;
-	t2.a = b0;
-	t2.b = a0;
-	t2.c = *a;
-	if ((r = trixAddTriangle(mesh, &t1)) != TRIX_OK) {
-		return r;
-	}
-	if ((r = trixAddTriangle(mesh, &t2)) != TRIX_OK) {
-		return r;
-	}
-	return TRIX_OK;
+// Check the mask and region against the heightmap's dimensions as given by
+// the image headers, and plan the conversion, before anything is decoded.
+// Images whose headers can't be read (or a heightmap on stdin) are left
+// for the decoders to check, and the plan waits for the heightmap's
+// dimensions. Returns 0 on success, nonzero otherwise
+static int CheckHeaders(void) {
+	ImageInfo image;
+	
+	PLAN.pending = 1;
+	if (CONFIG.mask != NULL && !CONFIG.heightmask) {
+		PLAN.masked = !ReadImageInfo(CONFIG.mask, CONFIG.scale, &PLAN.mask);
+	}
+	
+	if (CONFIG.input == NULL || ReadImageInfo(CONFIG.input, CONFIG.scale, &image)) {
+		return 0;
+	}
+	
+	if (CheckDimensions(image.width, image.height, PLAN.masked, PLAN.mask.width, PLAN.mask.height)) {
+		return 1;
+	}
+	
+	return PlanConversion(image.width, image.height, image.wide, image.decode);
 }
 
-// returns average of all non-negative arguments.
-// If any argument is negative, it is not included in the average.
-// argument zp will always be nonnegative.
-static float avgnonneg(float zp, float z1, float z2, float z3) {
-	float sum = zp;
-	float z[3] = {z1, z2, z3};
-	int i, n = 1;
-	
-	for (i = 0; i < 3; i++) {
-		if (z[i] >= 0) {
-			sum += z[i];
-			n++;
-		}
+// Plan the conversion of a decoded heightmap, if the headers couldn't.
+// Returns 0 on success, nonzero otherwise
+static int PlanHeightmap(const Heightmap *hm) {
+	return PLAN.pending ? PlanConversion(hm->imagewidth, hm->imageheight, hm->wide, 0) : 0;
+}
+
+// A mask file read on a thread of its own while the heightmap is decoded
+typedef struct {
+	pthread_t thread;
+	int running; // thread started and not yet joined
+	int done; // set (atomically) once the thread has finished
+	Mask *mask; // the mask read, or NULL on error
+} MaskReader;
+
+static void *ReadMaskThread(void *arg) {
+	MaskReader *m = (MaskReader *)arg;
+	
+	TraceThreadName("mask");
+	m->mask = ReadMask(CONFIG.mask, CONFIG.scale, CONFIG.threshold, CONFIG.reversed);
+	__atomic_store_n(&m->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// Wait for the mask reader, and make its mask the mask.
+// Returns 0 on success, nonzero otherwise
+static int JoinMask(MaskReader *m) {
+	
+	if (!m->running) {
+		return 0;
 	}
 	
-	return sum / (float)n;
+	(void)pthread_join(m->thread, NULL);
+	m->running = 0;
+	if (m->mask == NULL) {
+		return 1;
+	}
+	
+	mask = m->mask;
+	return 0;
 }
 
-static float hmzat(const Heightmap *hm, unsigned int x, unsigned int y) {
-	return CONFIG.baseheight + (CONFIG.zscale * hm->data[(hm->width * y) + x]);;
+// Rows of the heightmap that are needed to mesh what the mask leaves
+// visible: up to the last visible row, plus one below it. 0 if all are.
+static unsigned int MaskRowsNeeded(void) {
+	unsigned int x0, y0, x1, y1;
+	
+	if (mask != NULL && MaskBounds(mask, &x0, &y0, &x1, &y1) == 0 && y1 < mask->height) {
+		return y1 + 1;
+	}
+	return 0;
 }
 
-// given four vertices and a mesh, add two triangles representing the quad with given corners
-trix_result Surface(trix_mesh *mesh, const trix_vertex *v1, const trix_vertex *v2, const trix_vertex *v3, const trix_vertex *v4) {
-	trix_triangle i, j;
-	trix_result r;
+// State of a pipelined conversion
+typedef struct {
+	Pipeline p;
+	MaskReader reader;
+	int started; // pipeline started
+} Decode;
+
+// Once the heightmap's dimensions and the mask are both known: check the
+// mask, leave out the rows below the last visible one (the decoder then
+// stops there), restrict the mask to the region, and start meshing and
+// writing. The heightmap is meshed uncropped, since the mesher skips empty
+// blocks anyway. Returns 0 on success, nonzero otherwise
+static int StartMeshing(Decode *d, Heightmap *hm) {
+	unsigned int rows;
 	
-	i.a = *v4;
-	i.b = *v2;
-	i.c = *v1;
+	if (JoinMask(&d->reader) || CheckHeightmap(hm) || PlanHeightmap(hm)) {
+		return 1;
+	}
 	
-	j.a = *v4;
-	j.b = *v3;
-	j.c = *v2;
+	if ((rows = MaskRowsNeeded()) > 0 && rows < hm->height) {
+		hm->height = rows;
+		hm->size = (unsigned long)hm->width * rows;
+	}
 	
-	if ((r = trixAddTriangle(mesh, &i)) != TRIX_OK) {
-		return r;
+	if (CONFIG.region[2] > 0 && RestrictToRegion(hm, CONFIG.region[0], CONFIG.region[1], CONFIG.region[2], CONFIG.region[3], 0)) {
+		return 1;
 	}
 	
-	if ((r = trixAddTriangle(mesh, &j)) != TRIX_OK) {
-		return r;
+	if (StartPipeline(&d->p, hm, PLAN.depth)) {
+		return 1;
 	}
 	
-	return TRIX_OK;
+	d->started = 1;
+	return 0;
+}
+
+// Heightmap progress callback for the pipeline. The rows decoded before
+// the mask is ready are kept; once it is, meshing starts, and after that
+// each row is passed on to the meshers as it is decoded. If the decode
+// fails (rows 0), the meshers and writer are stopped and joined before the
+// raster is freed. Returns 0 on success, nonzero otherwise
+static int Decoded(void *user, Heightmap *hm, unsigned int rows) {
+	Decode *d = (Decode *)user;
+	
+	if (rows == 0) {
+		if (d->started) {
+			(void)FinishPipeline(&d->p, 1);
+			d->started = 0;
+		}
+		return 1;
+	}
+	
+	if (!d->started) {
+		if (d->reader.running && !__atomic_load_n(&d->reader.done, __ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+		if (StartMeshing(d, hm)) {
+			return 1;
+		}
+	}
+	
+	PipelineRows(&d->p, rows < hm->height ? rows : hm->height);
+	return 0;
 }
 
-trix_result Mesh(const Heightmap *hm, trix_mesh *mesh) {
-	unsigned int x, y;
-	float az, bz, cz, dz, ez, fz, gz, hz;
-	trix_vertex vp, v1, v2, v3, v4;
+// Decode, mesh, and write at once. A mask file is decoded alongside the
+// heightmap, given another CPU to do it on; with just one, it is read first,
+// so that the heightmap can stop after the last row it leaves visible.
+// Meshing starts once both have begun. Returns the heightmap, or NULL on
+// error
+static Heightmap *PipelineToSTL(unsigned int rows) {
+	static Decode d;
+	Heightmap *hm;
 	trix_result r;
+	unsigned int height;
+	TraceSpan span;
 	
-	for (y = 0; y < hm->height; y++) {
-		for (x = 0; x < hm->width; x++) {
-			
-			if (Masked(x, y)) {
-				continue;
-			}
-			
-			/*
-			
-			+---+---+---+
-			|   |   |   |
-			| A | B | C |
-			|   |   |   |
-			+---1---2---+
-			|   |I /|   |
-			| H | P | D |
-			|   |/ J|   |
-			+---4---3---+
-			|   |   |   |
-			| G | F | E |
-			|   |   |   |
-			+---+---+---+
-			
-			Current pixel position is marked at center as P.
-			This pixel is output as two triangles, I and J.
-			Points 1, 2, 3, and 4 are offset half a unit from P.
-			Neighboring pixels are A, B, C, D, E, F, G, and H.
-			
-			Vertex 1 z is average of ABPH z
-			Vertex 2 z is average of BCDP z
-			Vertex 3 z is average of PDEF z
-			Vertex 4 z is average of HPFG z
-			
-			Averages do not include neighbors that would lie
-			outside the image, but do included masked values.
-			
-			*/
-			
-			// determine elevation of neighboring pixels in order to
-			// to interpolate height of corners 1, 2, 3, and 4.
-			// -1 is used to flag edge pixels to disregard.
-			// (Masked neighbors are still considered.)
-			
-			if (x == 0 || y == 0) {
-				az = -1;
-			} else {
-				az = hmzat(hm, x - 1, y - 1);
-			}
-			
-			if (y == 0) {
-				bz = -1;
-			} else {
-				bz = hmzat(hm, x, y - 1);
-			}
-			
-			if (y == 0 || x + 1 == hm->width) {
-				cz = -1;
-			} else {
-				cz = hmzat(hm, x + 1, y - 1);
-			}
-			
-			if (x + 1 == hm->width) {
-				dz = -1;
-			} else {
-				dz = hmzat(hm, x + 1, y);
-			}
-			
-			if (x + 1 == hm->width || y + 1 == hm->height) {
-				ez = -1;
-			} else {
-				ez = hmzat(hm, x + 1, y + 1);
-			}
-			
-			if (y + 1 == hm->height) {
-				fz = -1;
-			} else {
-				fz = hmzat(hm, x, y + 1);
-			}
-			
-			if (y + 1 == hm->height || x == 0) {
-				gz = -1;
-			} else {
-				gz = hmzat(hm, x - 1, y + 1);
-			}
-			
-			if (x == 0) {
-				hz = -1;
-			} else {
-				hz = hmzat(hm, x - 1, y);
-			}
-			
-			// pixel vertex
-			vp.x = (float)x;
-			vp.y = (float)(hm->height - y);
-			vp.z = hmzat(hm, x, y);
-			
-			// Vertex 1
-			v1.x = (float)x - 0.5;
-			v1.y = ((float)hm->height - ((float)y - 0.5));
-			v1.z = avgnonneg(vp.z, az, bz, hz);
-			
-			// Vertex 2
-			v2.x = (float)x + 0.5;
-			v2.y = v1.y;
-			v2.z = avgnonneg(vp.z, bz, cz, dz);
-			
-			// Vertex 3
-			v3.x = v2.x;
-			v3.y = ((float)hm->height - ((float)y + 0.5));
-			v3.z = avgnonneg(vp.z, dz, ez, fz);
-			
-			// Vertex 4
-			v4.x = v1.x;
-			v4.y = v3.y;
-			v4.z = avgnonneg(vp.z, hz, fz, gz);
-			
-			// Upper surface
-			if ((r = Surface(mesh, &v1, &v2, &v3, &v4)) != TRIX_OK) {
-				return r;
-			}
-			
-			// nothing left to do for this pixel unless we need to make walls
-			if (!CONFIG.base) {
-				continue;
-			}
-			
-			// north wall (vertex 1 to 2)
-			if (y == 0 || Masked(x, y - 1)) {
-				if ((r = Wall(mesh, &v1, &v2)) != TRIX_OK) {
-					return r;
-				}
-			}
-			
-			// east wall (vertex 2 to 3)
-			if (x + 1 == hm->width || Masked(x + 1, y)) {
-				if ((r = Wall(mesh, &v2, &v3)) != TRIX_OK) {
-					return r;
-				}
-			}
-			
-			// south wall (vertex 3 to 4)
-			if (y + 1 == hm->height || Masked(x, y + 1)) {
-				if ((r = Wall(mesh, &v3, &v4)) != TRIX_OK) {
-					return r;
-				}
-			}
-			
-			// west wall (vertex 4 to 1)
-			if (x == 0 || Masked(x - 1, y)) {
-				if ((r = Wall(mesh, &v4, &v1)) != TRIX_OK) {
-					return r;
-				}
-			}
-			
-			// bottom surface - same as top, except with z = 0 and reverse winding
-			v1.z = 0; v2.z = 0; v3.z = 0; v4.z = 0;
-			if ((r = Surface(mesh, &v4, &v3, &v2, &v1)) != TRIX_OK) {
-				return r;
+	if (STATS != NULL) {
+		STATS->pipelined = 1;
+	}
+	
+	if (CONFIG.mask != NULL && CONFIG.threads > 1) {
+		if (pthread_create(&d.reader.thread, NULL, ReadMaskThread, &d.reader) != 0) {
+			fprintf(stderr, "Cannot start mask reader\n");
+			return NULL;
+		}
+		d.reader.running = 1;
+	}
+	else if (CONFIG.mask != NULL) {
+		StatsBegin(STAGE_MASK);
+		TraceBegin(&span, "mask", CONFIG.mask, -1, -1);
+		if ((mask = ReadMask(CONFIG.mask, CONFIG.scale, CONFIG.threshold, CONFIG.reversed)) == NULL) {
+			return NULL;
+		}
+		TraceEnd(&span);
+		StatsEnd(STAGE_MASK);
+	}
+	
+	StatsBegin(STAGE_DECODE);
+	hm = ReadHeightmapProgress(CONFIG.input, rows, CONFIG.scale, Decoded, &d);
+	StatsEnd(STAGE_DECODE);
+	
+	// the heightmap was decoded before the mask
+	if (hm != NULL && !d.started) {
+		height = hm->height;
+		StatsBegin(STAGE_MASK);
+		if (StartMeshing(&d, hm)) {
+			FreeHeightmap(&hm);
+		}
+		StatsEnd(STAGE_MASK);
+		if (hm != NULL) {
+			if (hm->height < height) {
+				ScanHeightmap(hm);
 			}
+			PipelineRows(&d.p, hm->height);
 		}
 	}
 	
-	return TRIX_OK;
+	// the mask reader outlives a failed decode
+	(void)JoinMask(&d.reader);
+	
+	if ((r = FinishPipeline(&d.p, hm == NULL)) != TRIX_OK && hm != NULL) {
+		fprintf(stderr, "Heightmap conversion failed (%d)\n", (int)r);
+		FreeHeightmap(&hm);
+	}
+	
+	if (hm != NULL && STATS != NULL) {
+		CountTriangles(hm, STATS);
+		STATS->bytes = OutputBytes(STATS);
+	}
+	
+	return hm;
 }
 
 // returns 0 on success, nonzero otherwise
 int HeightmapToSTL(Heightmap *hm) {
 	trix_result r;
 	trix_mesh *mesh;
+	TraceSpan span;
 	
 	if ((r = trixCreate(&mesh, "hmstl")) != TRIX_OK) {
 		return (int)r;
 	}
 	
-	if ((r = Mesh(hm, mesh)) != TRIX_OK) {
+	StatsBegin(STAGE_MESH);
+	if ((r = (CONFIG.reference ? MeshReference(hm, mesh) : Mesh(hm, mesh))) != TRIX_OK) {
 		return (int)r;
 	}
+	StatsEnd(STAGE_MESH);
 	
 	// writes to stdout if CONFIG.output is null, otherwise writes to path it names
+	StatsBegin(STAGE_WRITE);
+	TraceBegin(&span, "write", (CONFIG.output == NULL ? "stdout" : CONFIG.output), -1, -1);
 	if ((r = trixWrite(mesh, CONFIG.output, (CONFIG.ascii ? TRIX_STL_ASCII : TRIX_STL_BINARY))) != TRIX_OK) {
 		return (int)r;
 	}
+	TraceEnd(&span);
+	StatsEnd(STAGE_WRITE);
 	
+	TraceBegin(&span, "release", NULL, -1, -1);
 	(void)trixRelease(&mesh);
+	TraceEnd(&span);
+	
+	if (STATS != NULL) {
+		CountTriangles(hm, STATS);
+		STATS->bytes = OutputBytes(STATS);
+	}
 	
 	return 0;
 }
@@ -327,12 +430,34 @@ int HeightmapToSTL(Heightmap *hm) {
 // returns 0 if options are parsed successfully; nonzero otherwise
 int parseopts(int argc, char **argv) {
 	
-	int c;
+	// long options that have no single-letter equivalent
+	enum {
+		OPT_STATS = 256,
+		OPT_TRACE,
+		OPT_PERF,
+		OPT_REFERENCE,
+		OPT_MAX_MEMORY,
+		OPT_THREADS
+	};
+	static struct option longopts[] = {
+		{"stats", optional_argument, NULL, OPT_STATS},
+		{"trace", required_argument, NULL, OPT_TRACE},
+		{"perf", no_argument, NULL, OPT_PERF},
+		{"reference", no_argument, NULL, OPT_REFERENCE},
+		{"max-memory", required_argument, NULL, OPT_MAX_MEMORY},
+		{"threads", required_argument, NULL, OPT_THREADS},
+		{NULL, 0, NULL, 0}
+	};
+	
+	int c, len;
+	char unit;
+	unsigned long region[4];
+	static const char units[] = "BKMG";
 	
 	// suppress automatic error messages generated by getopt
 	opterr = 0;
 	
-	while ((c = getopt(argc, argv, "az:b:o:i:m:t:rhs")) != -1) {
+	while ((c = getopt_long(argc, argv, "az:b:o:i:m:t:rhsR:d:", longopts, NULL)) != -1) {
 		switch (c) {
 			case 'a':
 				// ASCII mode output
@@ -383,6 +508,61 @@ int parseopts(int argc, char **argv) {
 				// surface only mode - omit base (walls and bottom)
 				CONFIG.base = 0;
 				break;
+			case 'R':
+				// Region of interest (x,y,width,height in pixels)
+				// (%lu would take -1 for the largest value, so signs are refused)
+				len = -1;
+				if (strpbrk(optarg, "+-") != NULL ||
+						sscanf(optarg, "%20lu,%20lu,%20lu,%20lu%n", &region[0], &region[1], &region[2], &region[3], &len) != 4 ||
+						len != (int)strlen(optarg) || region[0] > UINT_MAX || region[1] > UINT_MAX ||
+						region[2] == 0 || region[2] > UINT_MAX || region[3] == 0 || region[3] > UINT_MAX) {
+					fprintf(stderr, "REGION must be X,Y,WIDTH,HEIGHT with WIDTH and HEIGHT greater than 0.\n");
+					return 1;
+				}
+				for (len = 0; len < 4; len++) {
+					CONFIG.region[len] = (unsigned int)region[len];
+				}
+				break;
+			case 'd':
+				// Downsampling factor (1/SCALE of the width and height)
+				if (sscanf(optarg, "%10u", &CONFIG.scale) != 1 || CONFIG.scale == 0) {
+					fprintf(stderr, "SCALE must be a positive integer.\n");
+					return 1;
+				}
+				break;
+			case OPT_STATS:
+				// Per-stage statistics, to stderr or a JSON file
+				CONFIG.stats = (optarg == NULL ? "" : optarg);
+				break;
+			case OPT_TRACE:
+				// Trace Event Format timeline
+				CONFIG.trace = optarg;
+				break;
+			case OPT_PERF:
+				// Hardware performance counters (reported with --stats)
+				CONFIG.perf = 1;
+				break;
+			case OPT_REFERENCE:
+				// Scalar reference mesher, for checking optimized paths
+				CONFIG.reference = 1;
+				break;
+			case OPT_MAX_MEMORY:
+				// Refuse conversions estimated to need more memory (bytes, or K, M or G)
+				unit = 'B';
+				if (sscanf(optarg, "%20lu%c", &CONFIG.maxmemory, &unit) < 1 || CONFIG.maxmemory == 0 ||
+						unit == '\0' || strchr(units, toupper((unsigned char)unit)) == NULL) {
+					fprintf(stderr, "MAXMEMORY must be a positive number of bytes, optionally with a K, M or G suffix.\n");
+					return 1;
+				}
+				CONFIG.maxmemory <<= 10 * (strchr(units, toupper((unsigned char)unit)) - units);
+				break;
+			case OPT_THREADS:
+				// Threads to decode and mesh on (default one per CPU)
+				if (sscanf(optarg, "%10u", &CONFIG.threads) != 1 || CONFIG.threads == 0) {
+					fprintf(stderr, "THREADS must be a positive integer.\n");
+					return 1;
+				}
+				break;
 			case '?':
 				// unrecognized option OR missing option argument
 				switch (optopt) {
@@ -392,10 +572,25 @@ int parseopts(int argc, char **argv) {
 					case 'o':
 					case 'm':
 					case 't':
+					case 'R':
+					case 'd':
 						fprintf(stderr, "Option -%c requires an argument.\n", optopt);
 						break;
+					case OPT_TRACE:
+						fprintf(stderr, "Option --trace requires an argument.\n");
+						break;
+					case OPT_MAX_MEMORY:
+						fprintf(stderr, "Option --max-memory requires an argument.\n");
+						break;
+					case OPT_THREADS:
+						fprintf(stderr, "Option --threads requires an argument.\n");
+						break;
 					default:
-						if (isprint(optopt)) {
+						if (optopt == 0) {
+							// unrecognized long option
+							fprintf(stderr, "Unknown option %s\n", argv[optind - 1]);
+						}
+						else if (isprint(optopt)) {
 							fprintf(stderr, "Unknown option -%c\n", optopt);
 						}
 						else {
@@ -424,52 +619,174 @@ int parseopts(int argc, char **argv) {
 	return 0;
 }
 
+// Mesh and write a decoded heightmap a chunk at a time through the
+// pipeline, rather than as a whole mesh.
+// returns 0 on success, nonzero otherwise
+static int StreamToSTL(const Heightmap *hm) {
+	static Pipeline p;
+	trix_result r;
+	
+	if (StartPipeline(&p, hm, PLAN.depth)) {
+		return (int)TRIX_ERR_FILE;
+	}
+	
+	if ((r = FinishPipeline(&p, 0)) != TRIX_OK) {
+		return (int)r;
+	}
+	
+	if (STATS != NULL) {
+		CountTriangles(hm, STATS);
+		STATS->bytes = OutputBytes(STATS);
+	}
+	
+	return 0;
+}
+
+// Decode, then mesh and write, for the reference mesher or a heightmask.
+// A mask file is read first. The mesh is built whole unless the plan says
+// otherwise. Returns the heightmap, or NULL on error
+static Heightmap *SerialToSTL(unsigned int rows) {
+	Heightmap *hm;
+	trix_result r;
+	TraceSpan span;
+	
+	if (CONFIG.mask != NULL && !CONFIG.heightmask) {
+		StatsBegin(STAGE_MASK);
+		TraceBegin(&span, "mask", CONFIG.mask, -1, -1);
+		if ((mask = ReadMask(CONFIG.mask, CONFIG.scale, CONFIG.threshold, CONFIG.reversed)) == NULL) {
+			return NULL;
+		}
+		TraceEnd(&span);
+		StatsEnd(STAGE_MASK);
+	}
+	
+	StatsBegin(STAGE_DECODE);
+	if ((hm = ReadHeightmapRows(CONFIG.input, rows, CONFIG.scale)) == NULL) {
+		return NULL;
+	}
+	StatsEnd(STAGE_DECODE);
+	
+	if (CheckHeightmap(hm) || PlanHeightmap(hm)) {
+		return NULL;
+	}
+	
+	StatsBegin(STAGE_MASK);
+	TraceBegin(&span, "mask", CONFIG.mask, -1, -1);
+	if (CONFIG.heightmask) {
+		// build the mask from the heightmap
+		// instead of reading a separate image
+		if ((mask = MaskFromHeightmap(hm, CONFIG.threshold, CONFIG.reversed)) == NULL) {
+			return NULL;
+		}
+	}
+	
+	// pixels outside the region of interest are masked
+	if (CONFIG.region[2] > 0 && RestrictToRegion(hm, CONFIG.region[0], CONFIG.region[1], CONFIG.region[2], CONFIG.region[3], !CONFIG.reference)) {
+		return NULL;
+	}
+	
+	// mesh only the part of the heightmap the mask leaves visible
+	// (the reference mesher always works on the whole image)
+	if (mask != NULL && !CONFIG.reference && CropToMask(hm)) {
+		return NULL;
+	}
+	TraceEnd(&span);
+	StatsEnd(STAGE_MASK);
+	
+	if ((r = (trix_result)(PLAN.streaming ? StreamToSTL(hm) : HeightmapToSTL(hm))) != TRIX_OK) {
+		fprintf(stderr, "Heightmap conversion failed (%d)\n", (int)r);
+		return NULL;
+	}
+	
+	return hm;
+}
+
 int main(int argc, char **argv) {
 	Heightmap *hm = NULL;
-	trix_result r;
+	unsigned int rows;
+	long cpus;
 	
 	if (parseopts(argc, argv)) {
 		fprintf(stderr, "option parsing failed\n");
 		return 1;
 	}
 	
-	if ((hm = ReadHeightmap(CONFIG.input)) == NULL) {
+	// counters are reported with the other statistics; to stderr by default
+	if (CONFIG.perf && CONFIG.stats == NULL) {
+		CONFIG.stats = "";
+	}
+	
+	if (CONFIG.stats != NULL && StatsEnable()) {
 		return 1;
 	}
 	
-	if (CONFIG.heightmask) {
-		// point the mask at the heightmap
-		// instead of reading a separate image
-		mask = hm;
-	} else {
-		mask = NULL;
+	if (CONFIG.perf) {
+		StatsEnablePerf();
+	}
+	
+	if (CONFIG.trace != NULL) {
+		(void)TraceEnable();
+		TraceThreadName("main");
+	}
+	
+	// one thread per CPU unless --threads says otherwise
+	if (CONFIG.threads == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		CONFIG.threads = (cpus > 1 ? (unsigned int)cpus : 1);
+	}
+	
+	// the fastest JPEG kernels this CPU has, and the threads for JPEG
+	// restart intervals (the output is the same); --reference keeps
+	// stb_image's own kernels and decodes serially
+	if (!CONFIG.reference) {
+		(void)InstallJpegKernels(BestJpegKernels());
+		stbi_set_threads(CONFIG.threads > INT_MAX ? INT_MAX : (int)CONFIG.threads);
 	}
 	
-	// mask file loaded only if heightmask isn't already assigned
-	if (CONFIG.mask != NULL && mask == NULL) {
-		
-		if ((mask = ReadHeightmap(CONFIG.mask)) == NULL) {
+	// a mismatched mask or region, or a conversion that would need more
+	// than --max-memory, fails before either image is decoded
+	if (CheckHeaders()) {
+		return 1;
+	}
+	
+	// Decoding stops after the region of interest and the row below it
+	// (and after the last row the mask leaves visible, once that's known)
+	mask = NULL;
+	rows = 0;
+	if (!CONFIG.reference) {
+		rows = RegionRows(UINT_MAX);
+	}
+	
+	// Unless the mask comes from the heightmap itself, meshing and writing
+	// can start as soon as the heightmap's dimensions and the mask are known
+	if (!CONFIG.reference && !CONFIG.heightmask) {
+		if ((hm = PipelineToSTL(rows)) == NULL) {
 			return 1;
 		}
-		
-		if ((mask->width != hm->width) || (mask->height != hm->height)) {
-			fprintf(stderr, "Mask dimensions do not match heightmap dimensions.\n");
-			fprintf(stderr, "Heightmap width: %u, height: %u\n", hm->width, hm->height);
+	}
+	else if ((hm = SerialToSTL(rows)) == NULL) {
+		return 1;
+	}
+	
+	if (CONFIG.stats != NULL) {
+		if (CONFIG.stats[0] == '\0') {
+			StatsPrint();
+		} else if (StatsWriteJSON(CONFIG.stats)) {
 			return 1;
 		}
 	}
 	
-	if ((r = HeightmapToSTL(hm)) != TRIX_OK) {
-		fprintf(stderr, "Heightmap conversion failed (%d)\n", (int)r);
+	if (CONFIG.perf) {
+		PerfClose();
+	}
+	
+	if (CONFIG.trace != NULL && TraceWrite(CONFIG.trace)) {
 		return 1;
 	}
 	
 	FreeHeightmap(&hm);
 	
-	// free mask iff it is its own image
-	if (mask != NULL && !CONFIG.heightmask) {
-		FreeHeightmap(&mask);
-	}
+	FreeMask(&mask);
 	
 	return 0;
 }
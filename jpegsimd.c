@@ -0,0 +1,304 @@
+#include <string.h>
+
+#define STBI_SIMD
+#include "stb_image.h"
+#include "jpegsimd.h"
+
+// The kernels are written once with GCC vector extensions, eight 32-bit
+// lanes wide, and compiled for each instruction set with target attributes.
+// They do the same integer arithmetic as stb_image's scalar code (the IDCT
+// without its all-zero column shortcut, which gives the same result), so
+// they produce identical output. Loads and stores use SSE2 intrinsics, as
+// the generic vector conversions compile to scalar code there.
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define JPEGSIMD_X86
+#endif
+
+#ifdef JPEGSIMD_X86
+
+#include <emmintrin.h>
+
+typedef int v8i __attribute__((vector_size(32)));
+
+#ifdef __clang__
+#define SHUFFLE(a, b, ...) __builtin_shufflevector(a, b, __VA_ARGS__)
+#else
+#define SHUFFLE(a, b, ...) __builtin_shuffle(a, b, (v8i){__VA_ARGS__})
+#endif
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+// stb_image's fixed point constants
+#define f2f(x) ((int)(((x) * 4096 + 0.5)))
+#define fsh(x) ((x) << 12)
+#define float2fixed(x) ((int)((x) * 65536 + 0.5))
+
+// stb_image's IDCT_1D, on vectors
+#define IDCT_1D(s0,s1,s2,s3,s4,s5,s6,s7) \
+	v8i t0, t1, t2, t3, p1, p2, p3, p4, p5, x0, x1, x2, x3; \
+	p2 = s2; \
+	p3 = s6; \
+	p1 = (p2 + p3) * f2f(0.5411961f); \
+	t2 = p1 + p3 * f2f(-1.847759065f); \
+	t3 = p1 + p2 * f2f(0.765366865f); \
+	p2 = s0; \
+	p3 = s4; \
+	t0 = fsh(p2 + p3); \
+	t1 = fsh(p2 - p3); \
+	x0 = t0 + t3; \
+	x3 = t0 - t3; \
+	x1 = t1 + t2; \
+	x2 = t1 - t2; \
+	t0 = s7; \
+	t1 = s5; \
+	t2 = s3; \
+	t3 = s1; \
+	p3 = t0 + t2; \
+	p4 = t1 + t3; \
+	p1 = t0 + t3; \
+	p2 = t1 + t2; \
+	p5 = (p3 + p4) * f2f(1.175875602f); \
+	t0 = t0 * f2f(0.298631336f); \
+	t1 = t1 * f2f(2.053119869f); \
+	t2 = t2 * f2f(3.072711026f); \
+	t3 = t3 * f2f(1.501321110f); \
+	p1 = p5 + p1 * f2f(-0.899976223f); \
+	p2 = p5 + p2 * f2f(-2.562915447f); \
+	p3 = p3 * f2f(-1.961570560f); \
+	p4 = p4 * f2f(-0.390180644f); \
+	t3 += p1 + p4; \
+	t2 += p2 + p3; \
+	t1 += p2 + p4; \
+	t0 += p1 + p3;
+
+// One 1D pass over eight vectors; out[k] is output k of each lane.
+#define IDCT_PASS(in, out, bias, shift) { \
+	IDCT_1D(in[0], in[1], in[2], in[3], in[4], in[5], in[6], in[7]) \
+	x0 += bias; x1 += bias; x2 += bias; x3 += bias; \
+	out[0] = (x0 + t3) >> shift; \
+	out[7] = (x0 - t3) >> shift; \
+	out[1] = (x1 + t2) >> shift; \
+	out[6] = (x1 - t2) >> shift; \
+	out[2] = (x2 + t1) >> shift; \
+	out[5] = (x2 - t1) >> shift; \
+	out[3] = (x3 + t0) >> shift; \
+	out[4] = (x3 - t0) >> shift; \
+}
+
+// Transpose four rows of four 32-bit lanes.
+#define TRANSPOSE4(a, b, c, d) { \
+	__m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(c, d); \
+	__m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(c, d); \
+	a = _mm_unpacklo_epi64(t0, t1); \
+	b = _mm_unpackhi_epi64(t0, t1); \
+	c = _mm_unpacklo_epi64(t2, t3); \
+	d = _mm_unpackhi_epi64(t2, t3); \
+}
+
+// Transpose an 8x8 matrix held as eight vectors, in place. With wide
+// (256-bit) registers, generic shuffles compile well; with SSE2 they don't,
+// so it's done as four 4x4 transposes there.
+ALWAYS_INLINE void transpose(v8i m[8], int wide) {
+
+	v8i t[8], u[8];
+	int i;
+
+	if (!wide) {
+		__m128i h[8][2], r[2];
+		memcpy(h, m, sizeof(h));
+		for (i = 0; i < 2; i++) {
+			TRANSPOSE4(h[0][i], h[1][i], h[2][i], h[3][i])
+			TRANSPOSE4(h[4][i], h[5][i], h[6][i], h[7][i])
+		}
+		for (i = 0; i < 8; i++) {
+			r[0] = h[i % 4][i / 4];
+			r[1] = h[4 + i % 4][i / 4];
+			memcpy(&m[i], r, sizeof(r));
+		}
+		return;
+	}
+
+	for (i = 0; i < 8; i += 2) {
+		t[i] = SHUFFLE(m[i], m[i + 1], 0, 8, 1, 9, 4, 12, 5, 13);
+		t[i + 1] = SHUFFLE(m[i], m[i + 1], 2, 10, 3, 11, 6, 14, 7, 15);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = SHUFFLE(t[i], t[i + 2], 0, 1, 8, 9, 4, 5, 12, 13);
+		u[i + 1] = SHUFFLE(t[i], t[i + 2], 2, 3, 10, 11, 6, 7, 14, 15);
+		u[i + 2] = SHUFFLE(t[i + 1], t[i + 3], 0, 1, 8, 9, 4, 5, 12, 13);
+		u[i + 3] = SHUFFLE(t[i + 1], t[i + 3], 2, 3, 10, 11, 6, 7, 14, 15);
+	}
+	for (i = 0; i < 4; i++) {
+		m[i] = SHUFFLE(u[i], u[i + 4], 0, 1, 2, 3, 8, 9, 10, 11);
+		m[i + 4] = SHUFFLE(u[i], u[i + 4], 4, 5, 6, 7, 12, 13, 14, 15);
+	}
+}
+
+// Load eight 16-bit coefficients times their dequantization factors (at
+// most 255, so the signed 16-bit multiplies are exact) as 32-bit lanes.
+ALWAYS_INLINE void load_dequantized(v8i *v, const short *data, const unsigned short *dq) {
+
+	__m128i d = _mm_loadu_si128((const __m128i *)data);
+	__m128i q = _mm_loadu_si128((const __m128i *)dq);
+	__m128i lo = _mm_mullo_epi16(d, q), hi = _mm_mulhi_epi16(d, q);
+	__m128i h[2];
+
+	h[0] = _mm_unpacklo_epi16(lo, hi);
+	h[1] = _mm_unpackhi_epi16(lo, hi);
+	memcpy(v, h, sizeof(h));
+}
+
+// Load eight bytes as 32-bit lanes.
+ALWAYS_INLINE void load_bytes(v8i *v, const stbi_uc *p) {
+
+	__m128i zero = _mm_setzero_si128();
+	__m128i w = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), zero);
+	__m128i h[2];
+
+	h[0] = _mm_unpacklo_epi16(w, zero);
+	h[1] = _mm_unpackhi_epi16(w, zero);
+	memcpy(v, h, sizeof(h));
+}
+
+// Clamp eight lanes to 0..255 and narrow them to bytes. The saturating
+// packs clamp exactly as stb_image's clamp() does.
+ALWAYS_INLINE __m128i clamp8(const v8i *v) {
+
+	__m128i h[2];
+
+	memcpy(h, v, sizeof(h));
+	h[0] = _mm_packs_epi32(h[0], h[1]);
+	return _mm_packus_epi16(h[0], h[0]);
+}
+
+// Same as stb_image's idct_block.
+ALWAYS_INLINE void idct(stbi_uc *out, int out_stride, short data[64], unsigned short *dequantize, int wide) {
+
+	v8i v[8], w[8];
+	int i;
+
+	// columns: vector i holds row i of the block, so each lane is a column
+	for (i = 0; i < 8; i++) {
+		load_dequantized(&v[i], data + i * 8, dequantize + i * 8);
+	}
+	IDCT_PASS(v, w, 512, 10)
+
+	// rows
+	transpose(w, wide);
+	IDCT_PASS(w, v, 65536 + (128 << 17), 17)
+	transpose(v, wide);
+
+	for (i = 0; i < 8; i++, out += out_stride) {
+		_mm_storel_epi64((__m128i *)out, clamp8(&v[i]));
+	}
+}
+
+// Same as stb_image's YCbCr_to_RGB_row.
+ALWAYS_INLINE void ycbcr(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step) {
+
+	int i, k, n;
+
+	for (i = 0; i < count; i += 8) {
+		stbi_uc yb[8] = {0}, cbb[8] = {0}, crb[8] = {0}, rgb[3][16];
+		v8i yf, cb, cr, c;
+
+		n = count - i < 8 ? count - i : 8;
+		memcpy(yb, y + i, n);
+		memcpy(cbb, pcb + i, n);
+		memcpy(crb, pcr + i, n);
+		load_bytes(&yf, yb);
+		load_bytes(&cb, cbb);
+		load_bytes(&cr, crb);
+
+		yf = (yf << 16) + 32768; // rounding
+		cb -= 128;
+		cr -= 128;
+		c = (yf + cr * float2fixed(1.40200f)) >> 16;
+		_mm_storeu_si128((__m128i *)rgb[0], clamp8(&c));
+		c = (yf - cr * float2fixed(0.71414f) - cb * float2fixed(0.34414f)) >> 16;
+		_mm_storeu_si128((__m128i *)rgb[1], clamp8(&c));
+		c = (yf + cb * float2fixed(1.77200f)) >> 16;
+		_mm_storeu_si128((__m128i *)rgb[2], clamp8(&c));
+
+		for (k = 0; k < n; k++, out += step) {
+			out[0] = rgb[0][k];
+			out[1] = rgb[1][k];
+			out[2] = rgb[2][k];
+			out[3] = 255;
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+static void idct_sse2(stbi_uc *out, int out_stride, short data[64], unsigned short *dequantize) {
+	idct(out, out_stride, data, dequantize, 0);
+}
+
+__attribute__((target("sse2")))
+static void ycbcr_sse2(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb, stbi_uc const *cr, int count, int step) {
+	ycbcr(out, y, cb, cr, count, step);
+}
+
+__attribute__((target("avx2")))
+static void idct_avx2(stbi_uc *out, int out_stride, short data[64], unsigned short *dequantize) {
+	idct(out, out_stride, data, dequantize, 1);
+}
+
+__attribute__((target("avx2")))
+static void ycbcr_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb, stbi_uc const *cr, int count, int step) {
+	ycbcr(out, y, cb, cr, count, step);
+}
+
+#endif
+
+JpegKernels BestJpegKernels(void) {
+	#ifdef JPEGSIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return JPEG_AVX2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return JPEG_SSE2;
+	}
+	#endif
+	return JPEG_SCALAR;
+}
+
+// Returns 0 on success, nonzero otherwise
+int InstallJpegKernels(JpegKernels kernels) {
+
+	if (kernels > BestJpegKernels()) {
+		return 1;
+	}
+
+	switch (kernels) {
+		#ifdef JPEGSIMD_X86
+		case JPEG_AVX2:
+			stbi_install_idct(idct_avx2);
+			stbi_install_YCbCr_to_RGB(ycbcr_avx2);
+			break;
+		case JPEG_SSE2:
+			stbi_install_idct(idct_sse2);
+			stbi_install_YCbCr_to_RGB(ycbcr_sse2);
+			break;
+		#endif
+		default:
+			// NULL restores stb_image's own
+			stbi_install_idct(NULL);
+			stbi_install_YCbCr_to_RGB(NULL);
+			break;
+	}
+
+	return 0;
+}
+
+const char *JpegKernelsName(JpegKernels kernels) {
+	switch (kernels) {
+		case JPEG_AVX2:
+			return "avx2";
+		case JPEG_SSE2:
+			return "sse2";
+		default:
+			return "scalar";
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef _JPEGSIMD_H_
+#define _JPEGSIMD_H_
+
+// Sets of JPEG decoding kernels (dequantize and IDCT, YCbCr to RGB),
+// from slowest to fastest.
+typedef enum {
+	JPEG_SCALAR, // stb_image's own idct_block and YCbCr_to_RGB_row
+	JPEG_SSE2,
+	JPEG_AVX2
+} JpegKernels;
+
+// Returns the fastest kernel set this CPU supports
+JpegKernels BestJpegKernels(void);
+
+// Install the given kernel set in stb_image (through the STBI_SIMD hooks).
+// Returns 0 on success, nonzero if this CPU or build doesn't support it
+int InstallJpegKernels(JpegKernels kernels);
+
+// Returns a short name for the kernel set
+const char *JpegKernelsName(JpegKernels kernels);
+
+#endif
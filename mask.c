@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "heightmap.h"
+#include "mask.h"
+#include "trace.h"
+
+// Returns pointer to a Mask with all pixels unmasked (padding bits set)
+// Returns NULL on error
+Mask *CreateMask(unsigned int width, unsigned int height) {
+	
+	Mask *m;
+	unsigned long y;
+	
+	if ((m = (Mask *)malloc(sizeof(Mask))) == NULL) {
+		return NULL;
+	}
+	
+	m->width = width;
+	m->height = height;
+	m->stride = ((unsigned long)width + 63) / 64;
+	
+	if ((m->bits = (uint64_t *)calloc(m->stride * height, sizeof(uint64_t))) == NULL) {
+		free(m);
+		return NULL;
+	}
+	
+	if (width % 64 != 0) {
+		for (y = 0; y < height; y++) {
+			m->bits[y * m->stride + m->stride - 1] = ~(uint64_t)0 << (width % 64);
+		}
+	}
+	
+	return m;
+}
+
+// Pack one row of 8-bit mask samples into row y of the mask. Samples less
+// than or equal to threshold are masked; reversed inverts the result.
+void MaskRow(Mask *m, unsigned int y, const unsigned char *row, int threshold, int reversed) {
+	
+	uint64_t *words = m->bits + (unsigned long)y * m->stride;
+	uint64_t flip = reversed ? ~(uint64_t)0 : 0;
+	unsigned char t = (unsigned char)threshold;
+	unsigned int x, n, b;
+	
+	for (x = 0; x < m->width; x += 64) {
+		uint64_t word = 0;
+		n = (m->width - x < 64 ? m->width - x : 64);
+		for (b = 0; b < n; b++) {
+			word |= (uint64_t)(row[x + b] <= t) << b;
+		}
+		// keep the padding bits set regardless of reversal
+		if (n < 64) {
+			word = ((word ^ flip) & ~(~(uint64_t)0 << n)) | (~(uint64_t)0 << n);
+		} else {
+			word ^= flip;
+		}
+		words[x / 64] = word;
+	}
+}
+
+// Returns pointer to a Mask built from a heightmap (such as the heightmap
+// itself, in heightmask mode). 16-bit samples are tested by their high
+// byte, as if the image had been read at 8 bits. Returns NULL on error.
+Mask *MaskFromHeightmap(const Heightmap *hm, int threshold, int reversed) {
+	
+	Mask *m;
+	unsigned int x, y;
+	unsigned char *row = NULL;
+	const unsigned short *wide;
+	
+	if ((m = CreateMask(hm->width, hm->height)) == NULL ||
+			(hm->wide && (row = (unsigned char *)malloc(hm->width)) == NULL)) {
+		fprintf(stderr, "Cannot allocate memory for mask\n");
+		FreeMask(&m);
+		return NULL;
+	}
+	
+	for (y = 0; y < hm->height; y++) {
+		if (hm->wide) {
+			wide = (const unsigned short *)hm->data + (unsigned long)y * hm->width;
+			for (x = 0; x < hm->width; x++) {
+				row[x] = (unsigned char)(wide[x] >> 8);
+			}
+			MaskRow(m, y, row, threshold, reversed);
+		}
+		else {
+			MaskRow(m, y, hm->data + (unsigned long)y * hm->width, threshold, reversed);
+		}
+	}
+	
+	free(row);
+	return m;
+}
+
+// Mask being filled in by ReadImageRows
+typedef struct {
+	Mask *m;
+	int threshold, reversed;
+	int failed;
+} MaskRows;
+
+// Image row callback; creates the mask on the first row.
+static void maskrow(void *user, unsigned int y, const unsigned char *row, unsigned int width, unsigned int height, int wide) {
+	
+	MaskRows *r = (MaskRows *)user;
+	
+	(void)wide; // always 8-bit; see ReadMask
+	
+	if (r->failed) {
+		return;
+	}
+	
+	if (r->m == NULL && (r->m = CreateMask(width, height)) == NULL) {
+		r->failed = 1;
+		return;
+	}
+	
+	MaskRow(r->m, y, row, r->threshold, r->reversed);
+}
+
+// Returns pointer to a Mask read from the image file at path, reduced by
+// scale like the heightmap (see ReadImageRows). Each row is packed as it is
+// decoded; only the bits are kept. 16-bit images are read at 8 bits.
+// Returns NULL on error.
+Mask *ReadMask(const char *path, unsigned int scale, int threshold, int reversed) {
+	
+	MaskRows r = {NULL, threshold, reversed, 0};
+	TraceSpan span;
+	int err;
+	
+	TraceBegin(&span, "decode", path, -1, -1);
+	err = ReadImageRows(path, 0, scale, 0, maskrow, &r);
+	TraceEnd(&span);
+	
+	if (err) {
+		FreeMask(&r.m);
+		return NULL;
+	}
+	
+	if (r.failed || r.m == NULL) {
+		fprintf(stderr, "Cannot allocate memory for mask\n");
+		FreeMask(&r.m);
+		return NULL;
+	}
+	
+	return r.m;
+}
+
+// Find the bounding box of the visible (unmasked) pixels: x0, y0 inclusive
+// to x1, y1 exclusive. Returns 0 on success, nonzero if nothing is visible.
+int MaskBounds(const Mask *m, unsigned int *x0, unsigned int *y0, unsigned int *x1, unsigned int *y1) {
+	
+	unsigned long i, first = m->stride, last = 0;
+	unsigned int y, top = m->height, bottom = 0;
+	uint64_t *any, visible;
+	int b;
+	
+	// visible pixels of each word position, over all rows
+	if ((any = (uint64_t *)calloc(m->stride, sizeof(uint64_t))) == NULL) {
+		return 1;
+	}
+	
+	for (y = 0; y < m->height; y++) {
+		visible = 0;
+		for (i = 0; i < m->stride; i++) {
+			any[i] |= ~m->bits[(unsigned long)y * m->stride + i];
+			visible |= ~m->bits[(unsigned long)y * m->stride + i];
+		}
+		if (visible != 0) {
+			if (top == m->height) {
+				top = y;
+			}
+			bottom = y + 1;
+		}
+	}
+	
+	for (i = 0; i < m->stride; i++) {
+		if (any[i] != 0) {
+			if (first == m->stride) {
+				first = i;
+			}
+			last = i;
+		}
+	}
+	
+	if (top == m->height) {
+		free(any);
+		return 1;
+	}
+	
+	for (b = 0; !((any[first] >> b) & 1); b++);
+	*x0 = (unsigned int)(first * 64 + (unsigned long)b);
+	for (b = 63; !((any[last] >> b) & 1); b--);
+	*x1 = (unsigned int)(last * 64 + (unsigned long)b + 1);
+	*y0 = top;
+	*y1 = bottom;
+	
+	free(any);
+	return 0;
+}
+
+// Returns pointer to a new Mask holding the given rectangle of m.
+// Returns NULL on error.
+Mask *CropMask(const Mask *m, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+	
+	unsigned long i, src, shift;
+	unsigned int row;
+	const uint64_t *in;
+	uint64_t word;
+	Mask *c;
+	
+	if (x + width > m->width || y + height > m->height || (c = CreateMask(width, height)) == NULL) {
+		return NULL;
+	}
+	
+	shift = x % 64;
+	for (row = 0; row < height; row++) {
+		in = m->bits + (unsigned long)(y + row) * m->stride;
+		for (i = 0; i < c->stride; i++) {
+			src = x / 64 + i;
+			word = in[src] >> shift;
+			if (shift != 0 && src + 1 < m->stride) {
+				word |= in[src + 1] << (64 - shift);
+			}
+			// keep the padding bits CreateMask() set past the right edge
+			if (i + 1 == c->stride && width % 64 != 0) {
+				word |= ~(uint64_t)0 << (width % 64);
+			}
+			c->bits[(unsigned long)row * c->stride + i] = word;
+		}
+	}
+	
+	return c;
+}
+
+// Mask every pixel outside the rectangle at x, y of the given width and height.
+void MaskOutside(Mask *m, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+	
+	unsigned long i, lo, hi, x1 = (unsigned long)x + width;
+	unsigned int row;
+	uint64_t inside;
+	
+	for (row = 0; row < m->height; row++) {
+		for (i = 0; i < m->stride; i++) {
+			
+			// bits of this word that lie inside the rectangle
+			inside = 0;
+			if (row >= y && row - y < height) {
+				lo = (x > i * 64 ? x - i * 64 : 0);
+				hi = (x1 < i * 64 + 64 ? (x1 > i * 64 ? x1 - i * 64 : 0) : 64);
+				if (lo < hi) {
+					inside = (hi == 64 ? ~(uint64_t)0 : ((uint64_t)1 << hi) - 1) & (~(uint64_t)0 << lo);
+				}
+			}
+			
+			m->bits[(unsigned long)row * m->stride + i] |= ~inside;
+		}
+	}
+}
+
+void FreeMask(Mask **m) {
+	
+	if (m == NULL || *m == NULL) {
+		return;
+	}
+	
+	free((*m)->bits);
+	free(*m);
+	*m = NULL;
+}
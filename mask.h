@@ -0,0 +1,37 @@
+#ifndef _MASK_H
+#define _MASK_H
+
+#include <stdint.h>
+#include "heightmap.h"
+
+// Packed 1-bit mask. A set bit marks a masked pixel (omitted from output);
+// the threshold and reverse settings are applied when the mask is built.
+typedef struct {
+	
+	// xy dimensions; must match the heightmap
+	unsigned int width, height;
+	
+	// 64-bit words per row. Rows are padded to whole words, and padding
+	// bits past the right edge are set (as if masked).
+	unsigned long stride;
+	
+	// height * stride words; bit (x % 64) of word x / 64 in row y is pixel x, y
+	uint64_t *bits;
+	
+} Mask;
+
+Mask *CreateMask(unsigned int width, unsigned int height);
+void MaskRow(Mask *m, unsigned int y, const unsigned char *row, int threshold, int reversed);
+Mask *MaskFromHeightmap(const Heightmap *hm, int threshold, int reversed);
+Mask *ReadMask(const char *path, unsigned int scale, int threshold, int reversed);
+int MaskBounds(const Mask *m, unsigned int *x0, unsigned int *y0, unsigned int *x1, unsigned int *y1);
+Mask *CropMask(const Mask *m, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+void MaskOutside(Mask *m, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+void FreeMask(Mask **m);
+
+// returns nonzero if pixel x, y is masked
+static inline int MaskBit(const Mask *m, unsigned int x, unsigned int y) {
+	return (int)((m->bits[(unsigned long)y * m->stride + (x >> 6)] >> (x & 63)) & 1);
+}
+
+#endif
@@ -0,0 +1,817 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libtrix.h>
+#include "heightmap.h"
+#include "stats.h"
+#include "trace.h"
+#include "mesh.h"
+
+Settings CONFIG = {
+	1,    // generate base (walls and bottom)
+	0,    // binary output
+	NULL, // read from stdin
+	NULL, // write to stdout
+	NULL, // no mask
+	127,  // middle of 8 bit range
+	0,    // normal un-reversed mask
+	0,    // no heightmasking
+	1.0,  // no z scaling (use raw heightmap values)
+	1.0,  // minimum base thickness of one unit
+	NULL, // no statistics
+	NULL, // no trace
+	0,    // no performance counters
+	0,    // optimized mesher
+	{0, 0, 0, 0}, // whole image
+	1,    // full size
+	0,    // no memory limit
+	0     // one thread per CPU
+};
+
+Mask *mask = NULL;
+
+trix_result Wall(trix_mesh *mesh, const trix_vertex *a, const trix_vertex *b) {
+	trix_vertex a0 = *a;
+	trix_vertex b0 = *b;
+	trix_triangle t1;
+	trix_triangle t2;
+	trix_result r;
+	a0.z = 0;
+	b0.z = 0;
+	t1.a = *a;
+	t1.b = *b;
+	t1.c = b0;
+	t2.a = b0;
+	t2.b = a0;
+	t2.c = *a;
+	if ((r = trixAddTriangle(mesh, &t1)) != TRIX_OK) {
+		return r;
+	}
+	if ((r = trixAddTriangle(mesh, &t2)) != TRIX_OK) {
+		return r;
+	}
+	return TRIX_OK;
+}
+
+// returns average of all non-negative arguments.
+// If any argument is negative, it is not included in the average.
+// argument zp will always be nonnegative.
+float avgnonneg(float zp, float z1, float z2, float z3) {
+	float sum = zp;
+	float z[3] = {z1, z2, z3};
+	int i, n = 1;
+	
+	for (i = 0; i < 3; i++) {
+		if (z[i] >= 0) {
+			sum += z[i];
+			n++;
+		}
+	}
+	
+	return sum / (float)n;
+}
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE static inline
+#endif
+
+// hmzat for 8-bit samples, or 16-bit if wide. wide is a constant wherever
+// this is inlined, so each sample type gets a mesher of its own.
+ALWAYS_INLINE float zat(const Heightmap *hm, unsigned int x, unsigned int y, int wide) {
+	if (wide) {
+		return CONFIG.baseheight + (CONFIG.zscale * ((const unsigned short *)hm->data)[(hm->width * y) + x]);
+	}
+	return CONFIG.baseheight + (CONFIG.zscale * hm->data[(hm->width * y) + x]);
+}
+
+float hmzat(const Heightmap *hm, unsigned int x, unsigned int y) {
+	return hm->wide ? zat(hm, x, y, 1) : zat(hm, x, y, 0);
+}
+
+// given four vertices and a mesh, add two triangles representing the quad with given corners
+trix_result Surface(trix_mesh *mesh, const trix_vertex *v1, const trix_vertex *v2, const trix_vertex *v3, const trix_vertex *v4) {
+	trix_triangle i, j;
+	trix_result r;
+	
+	i.a = *v4;
+	i.b = *v2;
+	i.c = *v1;
+	
+	j.a = *v4;
+	j.b = *v3;
+	j.c = *v2;
+	
+	if ((r = trixAddTriangle(mesh, &i)) != TRIX_OK) {
+		return r;
+	}
+	
+	if ((r = trixAddTriangle(mesh, &j)) != TRIX_OK) {
+		return r;
+	}
+	
+	return TRIX_OK;
+}
+
+// Straightforward scalar mesher, one pixel at a time. This is the reference
+// implementation that Mesh() and any optimized paths must match exactly;
+// keep it simple rather than fast. Selected with --reference. Expects an
+// uncropped heightmap; vertex positions ignore the crop offsets.
+trix_result MeshReference(const Heightmap *hm, trix_mesh *mesh) {
+	unsigned int x, y;
+	float az, bz, cz, dz, ez, fz, gz, hz;
+	trix_vertex vp, v1, v2, v3, v4;
+	trix_result r;
+	
+	for (y = 0; y < hm->height; y++) {
+		for (x = 0; x < hm->width; x++) {
+			
+			if (Masked(x, y)) {
+				continue;
+			}
+			
+			/*
+			
+			+---+---+---+
+			|   |   |   |
+			| A | B | C |
+			|   |   |   |
+			+---1---2---+
+			|   |I /|   |
+			| H | P | D |
+			|   |/ J|   |
+			+---4---3---+
+			|   |   |   |
+			| G | F | E |
+			|   |   |   |
+			+---+---+---+
+			
+			Current pixel position is marked at center as P.
+			This pixel is output as two triangles, I and J.
+			Points 1, 2, 3, and 4 are offset half a unit from P.
+			Neighboring pixels are A, B, C, D, E, F, G, and H.
+			
+			Vertex 1 z is average of ABPH z
+			Vertex 2 z is average of BCDP z
+			Vertex 3 z is average of PDEF z
+			Vertex 4 z is average of HPFG z
+			
+			Averages do not include neighbors that would lie
+			outside the image, but do included masked values.
+			
+			*/
+			
+			// determine elevation of neighboring pixels in order to
+			// to interpolate height of corners 1, 2, 3, and 4.
+			// -1 is used to flag edge pixels to disregard.
+			// (Masked neighbors are still considered.)
+			
+			if (x == 0 || y == 0) {
+				az = -1;
+			} else {
+				az = hmzat(hm, x - 1, y - 1);
+			}
+			
+			if (y == 0) {
+				bz = -1;
+			} else {
+				bz = hmzat(hm, x, y - 1);
+			}
+			
+			if (y == 0 || x + 1 == hm->width) {
+				cz = -1;
+			} else {
+				cz = hmzat(hm, x + 1, y - 1);
+			}
+			
+			if (x + 1 == hm->width) {
+				dz = -1;
+			} else {
+				dz = hmzat(hm, x + 1, y);
+			}
+			
+			if (x + 1 == hm->width || y + 1 == hm->height) {
+				ez = -1;
+			} else {
+				ez = hmzat(hm, x + 1, y + 1);
+			}
+			
+			if (y + 1 == hm->height) {
+				fz = -1;
+			} else {
+				fz = hmzat(hm, x, y + 1);
+			}
+			
+			if (y + 1 == hm->height || x == 0) {
+				gz = -1;
+			} else {
+				gz = hmzat(hm, x - 1, y + 1);
+			}
+			
+			if (x == 0) {
+				hz = -1;
+			} else {
+				hz = hmzat(hm, x - 1, y);
+			}
+			
+			// pixel vertex
+			vp.x = (float)x;
+			vp.y = (float)(hm->height - y);
+			vp.z = hmzat(hm, x, y);
+			
+			// Vertex 1
+			v1.x = (float)x - 0.5;
+			v1.y = ((float)hm->height - ((float)y - 0.5));
+			v1.z = avgnonneg(vp.z, az, bz, hz);
+			
+			// Vertex 2
+			v2.x = (float)x + 0.5;
+			v2.y = v1.y;
+			v2.z = avgnonneg(vp.z, bz, cz, dz);
+			
+			// Vertex 3
+			v3.x = v2.x;
+			v3.y = ((float)hm->height - ((float)y + 0.5));
+			v3.z = avgnonneg(vp.z, dz, ez, fz);
+			
+			// Vertex 4
+			v4.x = v1.x;
+			v4.y = v3.y;
+			v4.z = avgnonneg(vp.z, hz, fz, gz);
+			
+			// Upper surface
+			if ((r = Surface(mesh, &v1, &v2, &v3, &v4)) != TRIX_OK) {
+				return r;
+			}
+			
+			// nothing left to do for this pixel unless we need to make walls
+			if (!CONFIG.base) {
+				continue;
+			}
+			
+			// north wall (vertex 1 to 2)
+			if (y == 0 || Masked(x, y - 1)) {
+				if ((r = Wall(mesh, &v1, &v2)) != TRIX_OK) {
+					return r;
+				}
+			}
+			
+			// east wall (vertex 2 to 3)
+			if (x + 1 == hm->width || Masked(x + 1, y)) {
+				if ((r = Wall(mesh, &v2, &v3)) != TRIX_OK) {
+					return r;
+				}
+			}
+			
+			// south wall (vertex 3 to 4)
+			if (y + 1 == hm->height || Masked(x, y + 1)) {
+				if ((r = Wall(mesh, &v3, &v4)) != TRIX_OK) {
+					return r;
+				}
+			}
+			
+			// west wall (vertex 4 to 1)
+			if (x == 0 || Masked(x - 1, y)) {
+				if ((r = Wall(mesh, &v4, &v1)) != TRIX_OK) {
+					return r;
+				}
+			}
+			
+			// bottom surface - same as top, except with z = 0 and reverse winding
+			v1.z = 0; v2.z = 0; v3.z = 0; v4.z = 0;
+			if ((r = Surface(mesh, &v4, &v3, &v2, &v1)) != TRIX_OK) {
+				return r;
+			}
+		}
+	}
+	
+	return TRIX_OK;
+}
+
+// rows meshed per band; bands are the unit of work shown in traces,
+// and each band is one row of blocks in the MeshIndex
+#define MESH_BAND MESH_BLOCK
+
+// wall flags for MeshPixel(); set for each side that faces a masked
+// neighbor or the edge of the image
+#define WALL_NORTH 1
+#define WALL_EAST 2
+#define WALL_SOUTH 4
+#define WALL_WEST 8
+
+// mesh the unmasked pixel at x, y, with walls on the given sides, from
+// 8-bit samples or (if wide) 16-bit ones
+ALWAYS_INLINE trix_result MeshPixel(const Heightmap *hm, trix_mesh *mesh, unsigned int x, unsigned int y, int walls, int wide) {
+	float az, bz, cz, dz, ez, fz, gz, hz;
+	trix_vertex vp, v1, v2, v3, v4;
+	trix_result r;
+	
+	// position in the original image, if the heightmap is cropped
+	unsigned int ix = x + hm->xoff, iy = y + hm->yoff;
+	
+	/*
+	
+	+---+---+---+
+	|   |   |   |
+	| A | B | C |
+	|   |   |   |
+	+---1---2---+
+	|   |I /|   |
+	| H | P | D |
+	|   |/ J|   |
+	+---4---3---+
+	|   |   |   |
+	| G | F | E |
+	|   |   |   |
+	+---+---+---+
+	
+	Current pixel position is marked at center as P.
+	This pixel is output as two triangles, I and J.
+	Points 1, 2, 3, and 4 are offset half a unit from P.
+	Neighboring pixels are A, B, C, D, E, F, G, and H.
+	
+	Vertex 1 z is average of ABPH z
+	Vertex 2 z is average of BCDP z
+	Vertex 3 z is average of PDEF z
+	Vertex 4 z is average of HPFG z
+	
+	Averages do not include neighbors that would lie
+	outside the image, but do included masked values.
+	
+	*/
+	
+	// determine elevation of neighboring pixels in order to
+	// to interpolate height of corners 1, 2, 3, and 4.
+	// -1 is used to flag edge pixels to disregard.
+	// (Masked neighbors are still considered.)
+	
+	if (x == 0 || y == 0) {
+		az = -1;
+	} else {
+		az = zat(hm, x - 1, y - 1, wide);
+	}
+	
+	if (y == 0) {
+		bz = -1;
+	} else {
+		bz = zat(hm, x, y - 1, wide);
+	}
+	
+	if (y == 0 || x + 1 == hm->width) {
+		cz = -1;
+	} else {
+		cz = zat(hm, x + 1, y - 1, wide);
+	}
+	
+	if (x + 1 == hm->width) {
+		dz = -1;
+	} else {
+		dz = zat(hm, x + 1, y, wide);
+	}
+	
+	if (x + 1 == hm->width || y + 1 == hm->height) {
+		ez = -1;
+	} else {
+		ez = zat(hm, x + 1, y + 1, wide);
+	}
+	
+	if (y + 1 == hm->height) {
+		fz = -1;
+	} else {
+		fz = zat(hm, x, y + 1, wide);
+	}
+	
+	if (y + 1 == hm->height || x == 0) {
+		gz = -1;
+	} else {
+		gz = zat(hm, x - 1, y + 1, wide);
+	}
+	
+	if (x == 0) {
+		hz = -1;
+	} else {
+		hz = zat(hm, x - 1, y, wide);
+	}
+	
+	// pixel vertex
+	vp.x = (float)ix;
+	vp.y = (float)(hm->imageheight - iy);
+	vp.z = zat(hm, x, y, wide);
+	
+	// Vertex 1
+	v1.x = (float)ix - 0.5;
+	v1.y = ((float)hm->imageheight - ((float)iy - 0.5));
+	v1.z = avgnonneg(vp.z, az, bz, hz);
+	
+	// Vertex 2
+	v2.x = (float)ix + 0.5;
+	v2.y = v1.y;
+	v2.z = avgnonneg(vp.z, bz, cz, dz);
+	
+	// Vertex 3
+	v3.x = v2.x;
+	v3.y = ((float)hm->imageheight - ((float)iy + 0.5));
+	v3.z = avgnonneg(vp.z, dz, ez, fz);
+	
+	// Vertex 4
+	v4.x = v1.x;
+	v4.y = v3.y;
+	v4.z = avgnonneg(vp.z, hz, fz, gz);
+	
+	// Upper surface
+	if ((r = Surface(mesh, &v1, &v2, &v3, &v4)) != TRIX_OK) {
+		return r;
+	}
+	
+	// nothing left to do for this pixel unless we need to make walls
+	if (!CONFIG.base) {
+		return TRIX_OK;
+	}
+	
+	// north wall (vertex 1 to 2)
+	if (walls & WALL_NORTH) {
+		if ((r = Wall(mesh, &v1, &v2)) != TRIX_OK) {
+			return r;
+		}
+	}
+	
+	// east wall (vertex 2 to 3)
+	if (walls & WALL_EAST) {
+		if ((r = Wall(mesh, &v2, &v3)) != TRIX_OK) {
+			return r;
+		}
+	}
+	
+	// south wall (vertex 3 to 4)
+	if (walls & WALL_SOUTH) {
+		if ((r = Wall(mesh, &v3, &v4)) != TRIX_OK) {
+			return r;
+		}
+	}
+	
+	// west wall (vertex 4 to 1)
+	if (walls & WALL_WEST) {
+		if ((r = Wall(mesh, &v4, &v1)) != TRIX_OK) {
+			return r;
+		}
+	}
+	
+	// bottom surface - same as top, except with z = 0 and reverse winding
+	v1.z = 0; v2.z = 0; v3.z = 0; v4.z = 0;
+	if ((r = Surface(mesh, &v4, &v3, &v2, &v1)) != TRIX_OK) {
+		return r;
+	}
+	
+	return TRIX_OK;
+}
+
+#if defined(__GNUC__)
+#define ctz64(w) __builtin_ctzll(w)
+#else
+static int ctz64(uint64_t w) {
+	int n = 0;
+	while (!(w & 1)) {
+		w >>= 1;
+		n++;
+	}
+	return n;
+}
+#endif
+
+// Returns word i of the packed mask row y (set bits are masked pixels).
+// Rows outside the image are entirely masked, and without a mask only
+// the padding past the right edge is set.
+static inline uint64_t MaskWord(const Heightmap *hm, long y, unsigned long i) {
+	unsigned long stride = ((unsigned long)hm->width + 63) / 64;
+	if (y < 0 || y >= (long)hm->height) {
+		return ~(uint64_t)0;
+	}
+	if (mask != NULL) {
+		return mask->bits[(unsigned long)y * mask->stride + i];
+	}
+	if (i + 1 == stride && hm->width % 64 != 0) {
+		return ~(uint64_t)0 << (hm->width % 64);
+	}
+	return 0;
+}
+
+// Returns the visible pixels of word i of row y, and sets north, east,
+// south, and west to the pixels of that word whose neighbor on that side
+// is masked or outside the image. The east neighbor of bit b is bit b + 1,
+// carried in from the next word; the west neighbor is bit b - 1.
+static inline uint64_t WordWalls(const Heightmap *hm, unsigned int y, unsigned long i, unsigned long stride,
+		uint64_t *north, uint64_t *east, uint64_t *south, uint64_t *west) {
+	uint64_t here = MaskWord(hm, (long)y, i);
+	*north = MaskWord(hm, (long)y - 1, i);
+	*south = MaskWord(hm, (long)y + 1, i);
+	*east = (here >> 1) | ((i + 1 < stride ? MaskWord(hm, (long)y, i + 1) : 1) << 63);
+	*west = (here << 1) | (i > 0 ? MaskWord(hm, (long)y, i - 1) >> 63 : 1);
+	return ~here;
+}
+
+#if defined(__GNUC__)
+#define popcount64(w) __builtin_popcountll(w)
+#else
+static int popcount64(uint64_t w) {
+	int n = 0;
+	for (; w != 0; w &= w - 1) {
+		n++;
+	}
+	return n;
+}
+#endif
+
+// Returns pointer to an occupancy index of the heightmap and current mask.
+// Returns NULL on error.
+MeshIndex *CreateMeshIndex(const Heightmap *hm) {
+	unsigned long stride = ((unsigned long)hm->width + 63) / 64;
+	unsigned long cols1, r, c, i;
+	uint64_t visible, north, east, south, west;
+	unsigned int y;
+	MeshIndex *index;
+	
+	if ((index = (MeshIndex *)malloc(sizeof(MeshIndex))) == NULL) {
+		return NULL;
+	}
+	
+	index->width = hm->width;
+	index->height = hm->height;
+	index->cols = (hm->width + MESH_BLOCK - 1) / MESH_BLOCK;
+	index->rows = (hm->height + MESH_BLOCK - 1) / MESH_BLOCK;
+	cols1 = (unsigned long)index->cols + 1;
+	
+	index->visible = (unsigned long *)calloc(cols1 * (index->rows + 1), sizeof(unsigned long));
+	index->walls = (unsigned long *)calloc(cols1 * (index->rows + 1), sizeof(unsigned long));
+	if (index->visible == NULL || index->walls == NULL) {
+		FreeMeshIndex(&index);
+		return NULL;
+	}
+	
+	// tally each block into entry (r + 1, c + 1), one mask word per block row
+	for (y = 0; y < hm->height; y++) {
+		r = y / MESH_BLOCK + 1;
+		for (i = 0; i < stride; i++) {
+			visible = WordWalls(hm, y, i, stride, &north, &east, &south, &west);
+			c = i * 64 / MESH_BLOCK + 1;
+			index->visible[r * cols1 + c] += (unsigned long)popcount64(visible);
+			index->walls[r * cols1 + c] += (unsigned long)(popcount64(visible & north) + popcount64(visible & east) +
+					popcount64(visible & south) + popcount64(visible & west));
+		}
+	}
+	
+	// then accumulate the sums of all blocks above and to the left
+	for (r = 1; r <= index->rows; r++) {
+		for (c = 1; c < cols1; c++) {
+			index->visible[r * cols1 + c] += index->visible[(r - 1) * cols1 + c] +
+					index->visible[r * cols1 + c - 1] - index->visible[(r - 1) * cols1 + c - 1];
+			index->walls[r * cols1 + c] += index->walls[(r - 1) * cols1 + c] +
+					index->walls[r * cols1 + c - 1] - index->walls[(r - 1) * cols1 + c - 1];
+		}
+	}
+	
+	return index;
+}
+
+void FreeMeshIndex(MeshIndex **index) {
+	
+	if (index == NULL || *index == NULL) {
+		return;
+	}
+	
+	free((*index)->visible);
+	free((*index)->walls);
+	free(*index);
+	*index = NULL;
+}
+
+static unsigned long sat(const unsigned long *table, const MeshIndex *index,
+		unsigned int col0, unsigned int row0, unsigned int col1, unsigned int row1) {
+	unsigned long cols1 = (unsigned long)index->cols + 1;
+	return table[row1 * cols1 + col1] - table[row0 * cols1 + col1] -
+			table[row1 * cols1 + col0] + table[row0 * cols1 + col0];
+}
+
+// Returns the number of visible pixels in blocks col0 through col1 and
+// row0 through row1 (exclusive).
+unsigned long IndexVisible(const MeshIndex *index, unsigned int col0, unsigned int row0, unsigned int col1, unsigned int row1) {
+	return sat(index->visible, index, col0, row0, col1, row1);
+}
+
+// Returns the number of wall sides (two triangles each) in the blocks.
+unsigned long IndexWalls(const MeshIndex *index, unsigned int col0, unsigned int row0, unsigned int col1, unsigned int row1) {
+	return sat(index->walls, index, col0, row0, col1, row1);
+}
+
+// Returns the exact number of triangles Mesh() emits for the blocks.
+unsigned long IndexTriangles(const MeshIndex *index, unsigned int col0, unsigned int row0, unsigned int col1, unsigned int row1) {
+	unsigned long visible = IndexVisible(index, col0, row0, col1, row1);
+	if (!CONFIG.base) {
+		return 2 * visible;
+	}
+	return 4 * visible + 2 * IndexWalls(index, col0, row0, col1, row1);
+}
+
+// Returns whether block col, row is entirely masked, entirely visible, or mixed.
+BlockState IndexBlock(const MeshIndex *index, unsigned int col, unsigned int row) {
+	unsigned long visible = IndexVisible(index, col, row, col + 1, row + 1);
+	unsigned long w = (col + 1 == index->cols ? index->width - col * MESH_BLOCK : MESH_BLOCK);
+	unsigned long h = (row + 1 == index->rows ? index->height - row * MESH_BLOCK : MESH_BLOCK);
+	if (visible == 0) {
+		return BLOCK_EMPTY;
+	}
+	return (visible == w * h ? BLOCK_FULL : BLOCK_MIXED);
+}
+
+// MeshRows for 8-bit samples, or 16-bit if wide
+ALWAYS_INLINE trix_result meshrows(const Heightmap *hm, trix_mesh *mesh, const MeshIndex *index, unsigned int band, unsigned int first, unsigned int last, int wide) {
+	unsigned long i, stride = ((unsigned long)hm->width + 63) / 64;
+	uint64_t north, south, east, west, visible;
+	unsigned int x, y;
+	int b, walls;
+	trix_result r;
+	
+	for (y = first; y < last; y++) {
+		for (i = 0; i < stride; i++) {
+			
+			if (IndexBlock(index, (unsigned int)(i * 64 / MESH_BLOCK), band) == BLOCK_EMPTY) {
+				continue;
+			}
+			
+			if ((visible = WordWalls(hm, y, i, stride, &north, &east, &south, &west)) == 0) {
+				continue;
+			}
+			
+			while (visible != 0) {
+				b = ctz64(visible);
+				visible &= visible - 1;
+				x = (unsigned int)(i * 64 + (unsigned long)b);
+				
+				walls = (int)((north >> b) & 1) * WALL_NORTH |
+						(int)((east >> b) & 1) * WALL_EAST |
+						(int)((south >> b) & 1) * WALL_SOUTH |
+						(int)((west >> b) & 1) * WALL_WEST;
+				
+				if ((r = MeshPixel(hm, mesh, x, y, walls, wide)) != TRIX_OK) {
+					return r;
+				}
+			}
+		}
+	}
+	
+	return TRIX_OK;
+}
+
+static trix_result meshrows8(const Heightmap *hm, trix_mesh *mesh, const MeshIndex *index, unsigned int band, unsigned int first, unsigned int last) {
+	return meshrows(hm, mesh, index, band, first, last, 0);
+}
+
+static trix_result meshrows16(const Heightmap *hm, trix_mesh *mesh, const MeshIndex *index, unsigned int band, unsigned int first, unsigned int last) {
+	return meshrows(hm, mesh, index, band, first, last, 1);
+}
+
+// Mesh rows first (inclusive) through last (exclusive), which lie within
+// block row band of the index. Rows are scanned a 64-pixel word of the mask
+// at a time: words in empty blocks are skipped without touching the mask,
+// visible pixels are found with count-trailing-zeros, and the wall tests for
+// a whole word are made at once from the neighboring rows and words. The
+// mesher is specialised on the sample type, chosen here once per call.
+trix_result MeshRows(const Heightmap *hm, trix_mesh *mesh, const MeshIndex *index, unsigned int band, unsigned int first, unsigned int last) {
+	return hm->wide ? meshrows16(hm, mesh, index, band, first, last) : meshrows8(hm, mesh, index, band, first, last);
+}
+
+trix_result Mesh(const Heightmap *hm, trix_mesh *mesh) {
+	unsigned int first, last, band;
+	MeshIndex *index;
+	TraceSpan span;
+	trix_result r = TRIX_OK;
+	
+	if ((index = CreateMeshIndex(hm)) == NULL) {
+		return TRIX_ERR_MEM;
+	}
+	
+	for (band = 0, first = 0; first < hm->height && r == TRIX_OK; band++, first = last) {
+		last = (hm->height - first > MESH_BAND ? first + MESH_BAND : hm->height);
+		
+		// nothing to do for fully masked bands
+		if (IndexVisible(index, 0, band, index->cols, band + 1) == 0) {
+			continue;
+		}
+		
+		TraceBegin(&span, "mesh band", NULL, (long)first, (long)last - 1);
+		r = MeshRows(hm, mesh, index, band, first, last);
+		TraceEnd(&span);
+	}
+	
+	FreeMeshIndex(&index);
+	return r;
+}
+
+// Mask every pixel outside the rectangle at x, y (in original image
+// coordinates) of the given width and height, creating a mask if there is
+// none. If crop is true, the heightmap and mask are first cropped to the
+// rectangle plus a one pixel halo, whose heights are still needed to
+// average the corners along the edges of the region.
+// Returns 0 on success, nonzero otherwise
+int RestrictToRegion(Heightmap *hm, unsigned int x, unsigned int y, unsigned int width, unsigned int height, int crop) {
+	unsigned int x0, y0, x1, y1;
+	Mask *cropped;
+	
+	if (crop) {
+		x0 = (x > hm->xoff ? x - 1 - hm->xoff : 0);
+		y0 = (y > hm->yoff ? y - 1 - hm->yoff : 0);
+		x1 = (x + width - hm->xoff < hm->width ? x + width + 1 - hm->xoff : hm->width);
+		y1 = (y + height - hm->yoff < hm->height ? y + height + 1 - hm->yoff : hm->height);
+		
+		cropped = NULL;
+		if ((mask != NULL && (cropped = CropMask(mask, x0, y0, x1 - x0, y1 - y0)) == NULL) ||
+				CropHeightmap(hm, x0, y0, x1 - x0, y1 - y0)) {
+			fprintf(stderr, "Cannot crop heightmap to region\n");
+			FreeMask(&cropped);
+			return 1;
+		}
+		if (mask != NULL) {
+			FreeMask(&mask);
+			mask = cropped;
+		}
+	}
+	
+	if (mask == NULL && (mask = CreateMask(hm->width, hm->height)) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for mask\n");
+		return 1;
+	}
+	
+	MaskOutside(mask, x - hm->xoff, y - hm->yoff, width, height);
+	return 0;
+}
+
+// Crop the heightmap and mask to the bounding box of the visible pixels,
+// plus a one pixel border so that corner heights are averaged as before.
+// Nothing is cropped if the mask hides everything or nothing.
+// Returns 0 on success, nonzero otherwise
+int CropToMask(Heightmap *hm) {
+	unsigned int x0, y0, x1, y1;
+	Mask *cropped;
+	
+	if (MaskBounds(mask, &x0, &y0, &x1, &y1)) {
+		return 0;
+	}
+	
+	x0 = (x0 > 0 ? x0 - 1 : 0);
+	y0 = (y0 > 0 ? y0 - 1 : 0);
+	x1 = (x1 < hm->width ? x1 + 1 : hm->width);
+	y1 = (y1 < hm->height ? y1 + 1 : hm->height);
+	
+	if (x0 == 0 && y0 == 0 && x1 == mask->width && y1 == mask->height) {
+		return 0;
+	}
+	
+	if ((cropped = CropMask(mask, x0, y0, x1 - x0, y1 - y0)) == NULL ||
+			CropHeightmap(hm, x0, y0, x1 - x0, y1 - y0)) {
+		fprintf(stderr, "Cannot crop heightmap to mask\n");
+		FreeMask(&cropped);
+		return 1;
+	}
+	
+	FreeMask(&mask);
+	mask = cropped;
+	return 0;
+}
+
+// Triangles in the model of a width x height heightmap (or region of one)
+// with nothing masked, as CountTriangles would count them: two per pixel
+// for the surface and two for the bottom, and two for each side of the
+// edge pixels. Masks usually leave fewer, but can add walls.
+unsigned long EstimateTriangles(unsigned int width, unsigned int height) {
+	unsigned long pixels = (unsigned long)width * height;
+	
+	return 2 * pixels + (CONFIG.base ? 2 * pixels + 4 * ((unsigned long)width + height) : 0);
+}
+
+// Bytes of memory a trix_mesh of the given number of triangles holds,
+// roughly: libtrix allocates each face separately.
+unsigned long EstimateMeshMemory(unsigned long triangles) {
+	return triangles * ((sizeof(trix_face) + sizeof(size_t) + 15) & ~(unsigned long)15);
+}
+
+// Tally pixels and triangles by part of the model for --stats.
+// Counts come from the same occupancy index Mesh() uses, so that Mesh()
+// itself carries no counters.
+void CountTriangles(const Heightmap *hm, Stats *stats) {
+	unsigned long visible = 0, walls = 0;
+	MeshIndex *index;
+	
+	if ((index = CreateMeshIndex(hm)) != NULL) {
+		visible = IndexVisible(index, 0, 0, index->cols, index->rows);
+		walls = (CONFIG.base ? IndexWalls(index, 0, 0, index->cols, index->rows) : 0);
+		FreeMeshIndex(&index);
+	}
+	
+	// pixels cropped away are all masked
+	stats->hm = hm;
+	stats->pixels = (unsigned long)hm->imagewidth * hm->imageheight;
+	stats->masked = stats->pixels - visible;
+	stats->surface = 2 * visible;
+	stats->walls = 2 * walls;
+	stats->bottom = CONFIG.base ? 2 * visible : 0;
+}
@@ -0,0 +1,84 @@
+#ifndef _MESH_H
+#define _MESH_H
+
+#include <libtrix.h>
+#include "heightmap.h"
+#include "mask.h"
+#include "stats.h"
+
+typedef struct {
+	int base; // boolean; output walls and bottom as well as terrain surface if true
+	int ascii; // boolean; output ASCII STL instead of binary STL if true	
+	char *input; // path to input file; use stdin if NULL
+	char *output; // path to output file; use stdout if NULL
+	char *mask; // path to mask file; no mask if NULL
+	int threshold; // 0-255; maximum value considered masked
+	int reversed; // boolean; reverse results of mask tests if true
+	int heightmask; // boolean; use heightmap as it's own mask if true
+	float zscale; // scaling factor applied to raw Z values
+	float baseheight; // height in STL units of base below lowest terrain (technically, offset added to scaled Z values)
+	char *stats; // path to JSON statistics file; "" to print statistics to stderr; NULL for none
+	char *trace; // path to Trace Event Format JSON file; no tracing if NULL
+	int perf; // boolean; collect hardware performance counters per stage if true
+	int reference; // boolean; mesh with the reference implementation if true
+	unsigned int region[4]; // x, y, width, height of region of interest; whole image if width is 0
+	unsigned int scale; // reduce heightmap (and mask) by this factor in each dimension; 1 for full size
+	unsigned long maxmemory; // bytes of memory a conversion may be estimated to need; 0 for no limit
+	unsigned int threads; // threads to decode and mesh on; 0 for one per CPU
+} Settings;
+
+extern Settings CONFIG;
+
+// packed mask (from a mask image, or the heightmap itself in heightmask mode), or NULL for no mask
+extern Mask *mask;
+
+// If a mask is defined, only portions of the heightmap that are visible through the mask are output.
+// Bright areas of the mask image are considered transparent and dark areas are considered opaque.
+// The threshold and reverse settings are applied when the mask is built.
+static inline int Masked(unsigned int x, unsigned int y) {
+	return mask != NULL && MaskBit(mask, x, y);
+}
+
+trix_result Wall(trix_mesh *mesh, const trix_vertex *a, const trix_vertex *b);
+float avgnonneg(float zp, float z1, float z2, float z3);
+float hmzat(const Heightmap *hm, unsigned int x, unsigned int y);
+trix_result Surface(trix_mesh *mesh, const trix_vertex *v1, const trix_vertex *v2, const trix_vertex *v3, const trix_vertex *v4);
+// Occupancy index over square blocks of MESH_BLOCK pixels (a multiple of
+// the 64-pixel mask word). Summed-area tables of visible pixels and wall
+// sides answer whether a block is empty, full, or mixed, and give exact
+// triangle counts for any rectangle of blocks, in constant time.
+#define MESH_BLOCK 64
+
+typedef enum {
+	BLOCK_EMPTY, // every pixel masked
+	BLOCK_MIXED,
+	BLOCK_FULL   // every pixel visible
+} BlockState;
+
+typedef struct {
+	unsigned int width, height; // pixels
+	unsigned int cols, rows; // blocks
+	
+	// (rows + 1) * (cols + 1) summed-area tables: entry r, c is the total
+	// for all blocks above row r and left of column c
+	unsigned long *visible; // visible pixels
+	unsigned long *walls; // sides of visible pixels facing a masked pixel or the image edge
+} MeshIndex;
+
+MeshIndex *CreateMeshIndex(const Heightmap *hm);
+void FreeMeshIndex(MeshIndex **index);
+unsigned long IndexVisible(const MeshIndex *index, unsigned int col0, unsigned int row0, unsigned int col1, unsigned int row1);
+unsigned long IndexWalls(const MeshIndex *index, unsigned int col0, unsigned int row0, unsigned int col1, unsigned int row1);
+unsigned long IndexTriangles(const MeshIndex *index, unsigned int col0, unsigned int row0, unsigned int col1, unsigned int row1);
+BlockState IndexBlock(const MeshIndex *index, unsigned int col, unsigned int row);
+
+trix_result MeshReference(const Heightmap *hm, trix_mesh *mesh);
+trix_result Mesh(const Heightmap *hm, trix_mesh *mesh);
+trix_result MeshRows(const Heightmap *hm, trix_mesh *mesh, const MeshIndex *index, unsigned int band, unsigned int first, unsigned int last);
+int RestrictToRegion(Heightmap *hm, unsigned int x, unsigned int y, unsigned int width, unsigned int height, int crop);
+int CropToMask(Heightmap *hm);
+unsigned long EstimateTriangles(unsigned int width, unsigned int height);
+unsigned long EstimateMeshMemory(unsigned long triangles);
+void CountTriangles(const Heightmap *hm, Stats *stats);
+
+#endif
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "perfcount.h"
+
+const char *PERFNAMES[PERF_COUNT] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+
+static int fds[PERF_COUNT] = {-1, -1, -1, -1};
+
+#ifdef __linux__
+
+static const unsigned long long configs[PERF_COUNT] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES
+};
+
+int PerfOpen(void) {
+	struct perf_event_attr attr;
+	int i, available = 0;
+	
+	for (i = 0; i < PERF_COUNT; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = configs[i];
+		attr.exclude_kernel = 1; // permitted at the default perf_event_paranoid level
+		attr.exclude_hv = 1;
+		attr.inherit = 1; // include threads created after this point
+		
+		// each counter is opened independently, so a counter the CPU or
+		// hypervisor lacks does not prevent the others from being read
+		fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (fds[i] >= 0) {
+			available |= 1 << i;
+		}
+	}
+	
+	if (available == 0) {
+		fprintf(stderr, "Hardware performance counters unavailable (%s); see /proc/sys/kernel/perf_event_paranoid\n", strerror(errno));
+	}
+	
+	return available;
+}
+
+void PerfRead(unsigned long long values[PERF_COUNT]) {
+	int i;
+	for (i = 0; i < PERF_COUNT; i++) {
+		values[i] = 0;
+		if (fds[i] >= 0 && read(fds[i], &values[i], sizeof(values[i])) != (ssize_t)sizeof(values[i])) {
+			values[i] = 0;
+		}
+	}
+}
+
+void PerfClose(void) {
+	int i;
+	for (i = 0; i < PERF_COUNT; i++) {
+		if (fds[i] >= 0) {
+			(void)close(fds[i]);
+			fds[i] = -1;
+		}
+	}
+}
+
+#else
+
+int PerfOpen(void) {
+	fprintf(stderr, "Hardware performance counters are only supported on Linux\n");
+	return 0;
+}
+
+void PerfRead(unsigned long long values[PERF_COUNT]) {
+	int i;
+	for (i = 0; i < PERF_COUNT; i++) {
+		values[i] = 0;
+	}
+}
+
+void PerfClose(void) {
+	(void)fds;
+}
+
+#endif
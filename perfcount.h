@@ -0,0 +1,24 @@
+#ifndef _PERFCOUNT_H
+#define _PERFCOUNT_H
+
+typedef enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_COUNT
+} PerfCounter;
+
+// Opens hardware counters for this process (and threads it creates later).
+// Returns a bitmask of the counters that could be opened; 0 if none could,
+// for example if the kernel disallows them or the platform is not Linux.
+int PerfOpen(void);
+
+// Reads the current value of each open counter; unopened counters read 0.
+void PerfRead(unsigned long long values[PERF_COUNT]);
+
+void PerfClose(void);
+
+extern const char *PERFNAMES[PERF_COUNT];
+
+#endif
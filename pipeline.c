@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#include <sched.h>
+#endif
+
+#include <libtrix.h>
+#include "heightmap.h"
+#include "mesh.h"
+#include "stats.h"
+#include "trace.h"
+#include "pipeline.h"
+
+// Binary STL is an 80 byte header, a 4 byte count, and 50 bytes per
+// triangle (normal, three vertices, and a 2 byte attribute). The name in
+// the header (and the ASCII solid) is the one HeightmapToSTL() gives trixCreate().
+#define STL_NAME "hmstl"
+#define STL_TRIANGLE 50
+
+// ASCII STL runs to about 180 bytes per triangle, depending on the
+// magnitude of the coordinates; estimates allow a little more.
+#define STL_ASCII_TRIANGLE 192
+
+// Growable byte buffer for an encoded chunk
+typedef struct {
+	unsigned char *data;
+	size_t len, size;
+} Chunk;
+
+// returns 0 on success, nonzero otherwise
+static int reserve(Chunk *c, size_t n) {
+	unsigned char *data;
+	size_t size = (c->size > 0 ? c->size : 4096);
+
+	if (c->len + n <= c->size) {
+		return 0;
+	}
+	while (size < c->len + n) {
+		size *= 2;
+	}
+	if ((data = (unsigned char *)realloc(c->data, size)) == NULL) {
+		return 1;
+	}
+	c->data = data;
+	c->size = size;
+	return 0;
+}
+
+// Append formatted text (without the terminating NUL).
+// Returns 0 on success, nonzero otherwise
+static int appendf(Chunk *c, const char *format, ...) {
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, format);
+		n = vsnprintf((char *)c->data + c->len, c->size - c->len, format, ap);
+		va_end(ap);
+		if (n < 0) {
+			return 1;
+		}
+		if (c->len + (size_t)n < c->size) {
+			c->len += (size_t)n;
+			return 0;
+		}
+		if (reserve(c, (size_t)n + 1)) {
+			return 1;
+		}
+	}
+}
+
+// Append the faces of mesh to c exactly as trixWrite() writes them.
+// Returns 0 on success, nonzero otherwise
+static int encode(Chunk *c, const trix_mesh *mesh) {
+	const trix_face *f;
+	unsigned char *out;
+
+	if (!CONFIG.ascii) {
+		if (reserve(c, mesh->facecount * STL_TRIANGLE)) {
+			return 1;
+		}
+		out = c->data + c->len;
+		for (f = mesh->first; f != NULL; f = f->next) {
+			memcpy(out, &f->normal, 12);
+			memcpy(out + 12, &f->triangle, 36);
+			out[48] = 0;
+			out[49] = 0;
+			out += STL_TRIANGLE;
+		}
+		c->len = (size_t)(out - c->data);
+		return 0;
+	}
+
+	if (reserve(c, 256)) {
+		return 1;
+	}
+	for (f = mesh->first; f != NULL; f = f->next) {
+		if (appendf(c, "facet normal %f %f %f\nouter loop\n", f->normal.x, f->normal.y, f->normal.z) ||
+				appendf(c, "vertex %f %f %f\n", f->triangle.a.x, f->triangle.a.y, f->triangle.a.z) ||
+				appendf(c, "vertex %f %f %f\n", f->triangle.b.x, f->triangle.b.y, f->triangle.b.z) ||
+				appendf(c, "vertex %f %f %f\n", f->triangle.c.x, f->triangle.c.y, f->triangle.c.z) ||
+				appendf(c, "endloop\nendfacet\n")) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Wait a little before checking again on another stage. The first few
+// waits only yield; later ones sleep, so that waiting threads leave the
+// CPU to the stage they wait for.
+static void backoff(unsigned int *tries) {
+	struct timespec ts = {0, 50000};
+
+	if (++*tries < 64) {
+		(void)sched_yield();
+	} else {
+		(void)nanosleep(&ts, NULL);
+	}
+}
+
+static void fail(Pipeline *p, trix_result r) {
+	trix_result ok = TRIX_OK;
+	(void)__atomic_compare_exchange_n(&p->result, &ok, r, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->failed, 1, __ATOMIC_RELEASE);
+}
+
+static int failed(Pipeline *p) {
+	return __atomic_load_n(&p->failed, __ATOMIC_ACQUIRE);
+}
+
+// rows first (inclusive) through last (exclusive) of chunk n, and the
+// MeshIndex block row they lie in
+static void chunkrows(const Pipeline *p, unsigned long n, unsigned int *band, unsigned int *first, unsigned int *last) {
+	unsigned int lo = 0, hi = p->index->rows, mid;
+
+	// the block row whose chunks include n
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (p->bandchunk[mid] <= n) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	*band = lo;
+	*first = lo * MESH_BLOCK + (unsigned int)(n - p->bandchunk[lo]) * p->bandrows[lo];
+	*last = *first + p->bandrows[lo];
+	if (*last > p->hm->height) {
+		*last = p->hm->height;
+	}
+}
+
+// Divide each row of MeshIndex blocks into chunks no taller than an
+// unmasked one of PIPELINE_CHUNK pixels, nor with more triangles, going by
+// the row's total (so assuming its triangles are spread evenly over it).
+// Sparse rows are not put in taller chunks: that would save little, and
+// meshing would wait longer for decoding. Returns 0 on success, nonzero
+// otherwise
+static int planchunks(Pipeline *p) {
+	unsigned long target, triangles;
+	unsigned int most, rows, band, height;
+
+	if ((p->bandrows = (unsigned char *)malloc(p->index->rows)) == NULL ||
+			(p->bandchunk = (unsigned long *)malloc(((unsigned long)p->index->rows + 1) * sizeof(unsigned long))) == NULL) {
+		return 1;
+	}
+
+	for (most = MESH_BLOCK; most > 1 && (unsigned long)most * p->hm->width > PIPELINE_CHUNK; most /= 2);
+	target = EstimateTriangles(p->hm->width, most);
+
+	p->bandchunk[0] = 0;
+	for (band = 0; band < p->index->rows; band++) {
+		height = (band + 1 == p->index->rows ? p->hm->height - band * MESH_BLOCK : MESH_BLOCK);
+		triangles = IndexTriangles(p->index, 0, band, p->index->cols, band + 1);
+		for (rows = most; rows > 1 && triangles * rows > target * height; rows /= 2);
+		p->bandrows[band] = (unsigned char)rows;
+		p->bandchunk[band + 1] = p->bandchunk[band] + (height + rows - 1) / rows;
+	}
+	p->chunks = p->bandchunk[p->index->rows];
+
+	return 0;
+}
+
+static void freechunks(Pipeline *p) {
+	free(p->bandrows);
+	free(p->bandchunk);
+	p->bandrows = NULL;
+	p->bandchunk = NULL;
+}
+
+// Mesh chunk n into c. Returns TRIX_OK on success, or an error.
+static trix_result meshchunk(Pipeline *p, unsigned long n, Chunk *c) {
+	unsigned int band, first, last, need;
+	unsigned int tries = 0;
+	trix_mesh *mesh;
+	trix_result r;
+	TraceSpan span;
+
+	chunkrows(p, n, &band, &first, &last);
+	if (IndexVisible(p->index, 0, band, p->index->cols, band + 1) == 0) {
+		return TRIX_OK;
+	}
+
+	// the row below the chunk is needed to average its bottom corners
+	need = (last < p->hm->height ? last + 1 : last);
+	while (__atomic_load_n(&p->ready, __ATOMIC_ACQUIRE) < need) {
+		if (failed(p)) {
+			return TRIX_OK;
+		}
+		backoff(&tries);
+	}
+
+	TraceBegin(&span, "mesh band", NULL, (long)first, (long)last - 1);
+	if ((r = trixCreate(&mesh, STL_NAME)) == TRIX_OK) {
+		if ((r = MeshRows(p->hm, mesh, p->index, band, first, last)) == TRIX_OK && encode(c, mesh)) {
+			r = TRIX_ERR_MEM;
+		}
+		(void)trixRelease(&mesh);
+	}
+	TraceEnd(&span);
+
+	return r;
+}
+
+static void *mesher(void *arg) {
+	Pipeline *p = (Pipeline *)arg;
+	PipelineSlot *slot;
+	unsigned long n;
+	unsigned int tries;
+	Chunk c;
+	trix_result r;
+
+	TraceThreadName("mesher");
+
+	while (!failed(p) && (n = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->chunks) {
+
+		// wait until the writer is close enough behind for this chunk's slot to be free
+		tries = 0;
+		while (n >= __atomic_load_n(&p->written, __ATOMIC_ACQUIRE) + p->depth) {
+			if (failed(p)) {
+				return NULL;
+			}
+			backoff(&tries);
+		}
+
+		memset(&c, 0, sizeof(c));
+		if ((r = meshchunk(p, n, &c)) != TRIX_OK) {
+			free(c.data);
+			fail(p, r);
+			return NULL;
+		}
+
+		slot = &p->slots[n % p->depth];
+		slot->data = c.data;
+		slot->len = c.len;
+		__atomic_store_n(&slot->seq, n + 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void *writer(void *arg) {
+	Pipeline *p = (Pipeline *)arg;
+	PipelineSlot *slot;
+	unsigned long n;
+	unsigned int tries;
+	TraceSpan span;
+
+	TraceThreadName("writer");
+
+	for (n = 0; n < p->chunks; n++) {
+		slot = &p->slots[n % p->depth];
+		tries = 0;
+		while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n + 1) {
+			if (failed(p)) {
+				return NULL;
+			}
+			backoff(&tries);
+		}
+
+		if (slot->len > 0) {
+			TraceBegin(&span, "write", NULL, -1, -1);
+			if (fwrite(slot->data, 1, slot->len, p->fp) != slot->len) {
+				fail(p, TRIX_ERR_FILE);
+			}
+			TraceEnd(&span);
+		}
+		free(slot->data);
+		slot->data = NULL;
+		__atomic_store_n(&p->written, n + 1, __ATOMIC_RELEASE);
+
+		if (failed(p)) {
+			return NULL;
+		}
+	}
+
+	if (CONFIG.ascii && fprintf(p->fp, "endsolid %s\n", STL_NAME) < 0) {
+		fail(p, TRIX_ERR_FILE);
+	}
+
+	return NULL;
+}
+
+// Start meshing hm (whose dimensions, and the mask, must now be final) and
+// writing the output, with the STL header written right away, using depth
+// slots of the ring (1 to PIPELINE_DEPTH; fewer hold less memory, but let
+// meshing run less far ahead of writing). Rows become available to the
+// meshers as PipelineRows() reports them.
+// Returns 0 on success, nonzero otherwise (after printing the reason)
+int StartPipeline(Pipeline *p, const Heightmap *hm, unsigned int depth) {
+	char header[80];
+	uint32_t count;
+	long cpus;
+
+	memset(p, 0, sizeof(Pipeline));
+	p->hm = hm;
+	p->depth = (depth < 1 ? 1 : (depth > PIPELINE_DEPTH ? PIPELINE_DEPTH : depth));
+
+	if ((p->index = CreateMeshIndex(hm)) == NULL || planchunks(p)) {
+		fprintf(stderr, "Cannot allocate memory for mesh index\n");
+		FreeMeshIndex(&p->index);
+		freechunks(p);
+		return 1;
+	}
+	p->triangles = IndexTriangles(p->index, 0, 0, p->index->cols, p->index->rows);
+
+	// writes to stdout if CONFIG.output is null, otherwise writes to path it names
+	if ((p->fp = (CONFIG.output == NULL ? stdout : fopen(CONFIG.output, "wb"))) == NULL) {
+		fprintf(stderr, "Cannot open output file %s\n", CONFIG.output);
+		FreeMeshIndex(&p->index);
+		freechunks(p);
+		return 1;
+	}
+
+	if (CONFIG.ascii) {
+		(void)fprintf(p->fp, "solid %s\n", STL_NAME);
+	} else {
+		memset(header, 0, sizeof(header));
+		strncpy(header, STL_NAME, sizeof(header) - 1);
+		count = (uint32_t)p->triangles;
+		(void)fwrite(header, sizeof(header), 1, p->fp);
+		(void)fwrite(&count, 4, 1, p->fp);
+	}
+	(void)fflush(p->fp);
+
+	cpus = (CONFIG.threads > PIPELINE_THREADS ? PIPELINE_THREADS : (long)CONFIG.threads);
+	cpus = (cpus < 1 ? 1 : cpus);
+
+	p->started = 1;
+	if (pthread_create(&p->writer, NULL, writer, p) != 0) {
+		p->started = 0;
+	}
+	while (p->started && p->threads < (int)cpus && pthread_create(&p->meshers[p->threads], NULL, mesher, p) == 0) {
+		p->threads++;
+	}
+	if (!p->started || p->threads == 0) {
+		fprintf(stderr, "Cannot start mesher threads\n");
+		(void)FinishPipeline(p, 1);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Bytes of STL output for the given number of triangles (roughly, if ASCII)
+unsigned long EstimateOutput(unsigned long triangles) {
+	return CONFIG.ascii ? 128 + triangles * STL_ASCII_TRIANGLE : 84 + triangles * STL_TRIANGLE;
+}
+
+// Most memory the pipeline could hold at once, roughly, for a width x
+// height heightmap with depth slots in its ring: the mesh index and chunk
+// table, and a chunk in every slot (and in each mesher's mesh, for those
+// being meshed). Chunks have no more triangles than an unmasked one,
+// whatever the mask.
+unsigned long PipelineMemory(unsigned int width, unsigned int height, unsigned int depth) {
+	unsigned long triangles, index;
+	unsigned int rows;
+	long cpus;
+	
+	// chunks are PIPELINE_CHUNK pixels or so, and at least a row
+	rows = (width < PIPELINE_CHUNK ? PIPELINE_CHUNK / width : 1);
+	triangles = EstimateTriangles(width, rows);
+	
+	index = 2 * sizeof(unsigned long) * ((unsigned long)width / MESH_BLOCK + 2) * ((unsigned long)height / MESH_BLOCK + 2) +
+			(sizeof(unsigned long) + 1) * ((unsigned long)height / MESH_BLOCK + 2);
+	
+	cpus = (CONFIG.threads > PIPELINE_THREADS ? PIPELINE_THREADS : (long)CONFIG.threads);
+	cpus = (cpus < 1 ? 1 : cpus);
+	cpus = (cpus > (long)depth ? (long)depth : cpus);
+	
+	return index + depth * EstimateOutput(triangles) + (unsigned long)cpus * EstimateMeshMemory(triangles);
+}
+
+// Report that the first rows rows of the heightmap are filled in.
+void PipelineRows(Pipeline *p, unsigned int rows) {
+	__atomic_store_n(&p->ready, rows, __ATOMIC_RELEASE);
+}
+
+// Wait for the meshers and writer to finish, once every row is filled in,
+// and close the output. If failed is nonzero, the decode failed; the other
+// stages stop where they are, and any output file is removed.
+// Returns TRIX_OK on success, or the first error.
+trix_result FinishPipeline(Pipeline *p, int failed) {
+	int i;
+
+	if (failed) {
+		fail(p, TRIX_ERR_ARG);
+	}
+	else {
+		PipelineRows(p, p->hm->height);
+	}
+
+	StatsBegin(STAGE_MESH);
+	for (i = 0; i < p->threads; i++) {
+		(void)pthread_join(p->meshers[i], NULL);
+	}
+	StatsEnd(STAGE_MESH);
+
+	StatsBegin(STAGE_WRITE);
+	if (p->started) {
+		(void)pthread_join(p->writer, NULL);
+	}
+	if (p->fp != NULL && (p->fp == stdout ? fflush(p->fp) : fclose(p->fp)) != 0) {
+		fail(p, TRIX_ERR_FILE);
+	}
+	StatsEnd(STAGE_WRITE);
+
+	for (i = 0; i < PIPELINE_DEPTH; i++) {
+		free(p->slots[i].data);
+		p->slots[i].data = NULL;
+	}
+	FreeMeshIndex(&p->index);
+	freechunks(p);
+
+	if (p->failed && CONFIG.output != NULL && p->fp != NULL) {
+		(void)unlink(CONFIG.output);
+	}
+	p->fp = NULL;
+	p->started = 0;
+	p->threads = 0;
+
+	return p->result;
+}
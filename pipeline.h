@@ -0,0 +1,64 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <pthread.h>
+#include <libtrix.h>
+#include "heightmap.h"
+#include "mesh.h"
+
+// Encoded STL chunks that may be in flight between the meshers and the
+// writer at once (meshed and waiting, or being meshed); meshers wait for
+// the writer once this many are ahead of it. A pipeline may use fewer.
+#define PIPELINE_DEPTH 16
+
+// Pixels meshed per chunk, at most. Chunks are a power of two rows high,
+// fewer where the mask's walls make more triangles than unmasked pixels
+// would, and never straddle a row of MeshIndex blocks.
+#define PIPELINE_CHUNK 16384
+
+// Maximum mesher threads
+#define PIPELINE_THREADS 64
+
+// A slot of the ring between meshers and the writer. Chunk n goes in slot
+// n % PIPELINE_DEPTH; seq is n + 1 once its bytes are ready.
+typedef struct {
+	unsigned long seq;
+	unsigned char *data;
+	size_t len;
+} PipelineSlot;
+
+// Meshes a heightmap and writes it as STL while it is still being decoded.
+// The decoder publishes rows as they are filled in; a pool of meshers takes
+// chunks of rows in order as soon as the rows below them (needed to average
+// corner heights) arrive, and encodes their triangles; a writer thread
+// writes the chunks in order. Every queue is bounded and lock-free.
+typedef struct {
+	const Heightmap *hm;
+	MeshIndex *index;
+	FILE *fp;
+
+	unsigned char *bandrows; // rows per chunk in each row of MeshIndex blocks
+	unsigned long *bandchunk; // number of the first chunk in each row of blocks, then of chunks
+	unsigned long chunks; // total chunks
+	unsigned long triangles; // total triangles, for the binary STL header
+
+	unsigned int ready; // rows of hm filled in so far
+	unsigned long next; // next chunk for a mesher to take
+	unsigned long written; // chunks written so far
+	int failed; // nonzero once any stage has failed; everything then stops
+	trix_result result; // first error
+
+	PipelineSlot slots[PIPELINE_DEPTH];
+	unsigned int depth; // slots in use
+
+	int started, threads;
+	pthread_t writer, meshers[PIPELINE_THREADS];
+} Pipeline;
+
+unsigned long EstimateOutput(unsigned long triangles);
+unsigned long PipelineMemory(unsigned int width, unsigned int height, unsigned int depth);
+int StartPipeline(Pipeline *p, const Heightmap *hm, unsigned int depth);
+void PipelineRows(Pipeline *p, unsigned int rows);
+trix_result FinishPipeline(Pipeline *p, int failed);
+
+#endif
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef S_SPLINT_S
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "stats.h"
+
+Stats *STATS = NULL;
+
+static const char *stagenames[STAGE_COUNT] = {"decode", "mask", "mesh", "write"};
+
+static double seconds(clockid_t clock) {
+	struct timespec ts;
+	if (clock_gettime(clock, &ts) != 0) {
+		return 0;
+	}
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// heap bytes currently allocated, in kilobytes; -1 if not available
+static long heapinuse(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 mi = mallinfo2();
+	return (long)((mi.uordblks + mi.hblkhd) / 1024);
+#else
+	return -1;
+#endif
+}
+
+// returns 0 on success, nonzero otherwise
+int StatsEnable(void) {
+	if (STATS != NULL) {
+		return 0;
+	}
+	if ((STATS = (Stats *)calloc(1, sizeof(Stats))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for statistics\n");
+		return 1;
+	}
+	STATS->bytes = -1;
+	STATS->heap = -1;
+	return 0;
+}
+
+// Adds hardware counters to the per-stage statistics, if available.
+void StatsEnablePerf(void) {
+	if (STATS == NULL) {
+		return;
+	}
+	STATS->perf = PerfOpen();
+}
+
+void StatsBegin(Stage stage) {
+	if (STATS == NULL) {
+		return;
+	}
+	(void)stage;
+	STATS->wallstart = seconds(CLOCK_MONOTONIC);
+	STATS->cpustart = seconds(CLOCK_PROCESS_CPUTIME_ID);
+	if (STATS->perf) {
+		PerfRead(STATS->eventstart);
+	}
+}
+
+void StatsEnd(Stage stage) {
+	long heap;
+	unsigned long long events[PERF_COUNT];
+	int i;
+	
+	if (STATS == NULL) {
+		return;
+	}
+	
+	if (STATS->perf) {
+		PerfRead(events);
+		for (i = 0; i < PERF_COUNT; i++) {
+			STATS->events[stage][i] += events[i] - STATS->eventstart[i];
+		}
+	}
+	
+	STATS->wall[stage] += seconds(CLOCK_MONOTONIC) - STATS->wallstart;
+	STATS->cpu[stage] += seconds(CLOCK_PROCESS_CPUTIME_ID) - STATS->cpustart;
+	
+	// sampled at the end of each stage, when its allocations are still live
+	if ((heap = heapinuse()) > STATS->heap) {
+		STATS->heap = heap;
+	}
+}
+
+static void finish(void) {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		STATS->peakrss = usage.ru_maxrss;
+	} else {
+		STATS->peakrss = -1;
+	}
+}
+
+static double rate(double count, double secs) {
+	return secs > 0 ? count / secs : 0;
+}
+
+// hardware counter summary for one stage: IPC and events per pixel
+static void printperf(int stage) {
+	const unsigned long long *e = STATS->events[stage];
+	double pixels = (double)(STATS->pixels ? STATS->pixels : 1);
+	const char *sep = " ";
+	int i;
+	
+	fprintf(stderr, "Perf %-6s :", stagenames[stage]);
+	if ((STATS->perf & (1 << PERF_CYCLES)) && (STATS->perf & (1 << PERF_INSTRUCTIONS))) {
+		fprintf(stderr, " %.2f IPC", rate((double)e[PERF_INSTRUCTIONS], (double)e[PERF_CYCLES]));
+		sep = ", ";
+	}
+	for (i = 0; i < PERF_COUNT; i++) {
+		if (STATS->perf & (1 << i)) {
+			fprintf(stderr, "%s%.3f %s/pixel", sep, (double)e[i] / pixels, PERFNAMES[i]);
+			sep = ", ";
+		}
+	}
+	fprintf(stderr, "\n");
+}
+
+void StatsPrint(void) {
+	int i;
+	unsigned long triangles;
+	double total;
+	
+	if (STATS == NULL) {
+		return;
+	}
+	
+	finish();
+	triangles = STATS->surface + STATS->walls + STATS->bottom;
+	
+	if (STATS->hm != NULL) {
+		DumpHeightmap(STATS->hm);
+	}
+	fprintf(stderr, "Masked pixels: %lu\n", STATS->masked);
+	fprintf(stderr, "Triangles: %lu (surface %lu, walls %lu, bottom %lu)\n",
+			triangles, STATS->surface, STATS->walls, STATS->bottom);
+	if (STATS->bytes >= 0) {
+		fprintf(stderr, "Bytes written: %ld\n", STATS->bytes);
+	}
+	for (i = 0; i < STAGE_COUNT; i++) {
+		fprintf(stderr, "Stage %-6s: %9.3fs wall %9.3fs cpu\n", stagenames[i], STATS->wall[i], STATS->cpu[i]);
+	}
+	if (STATS->perf) {
+		for (i = 0; i < STAGE_COUNT; i++) {
+			printperf(i);
+		}
+	}
+	if (STATS->pipelined) {
+		// mesh and write times are only what was left once decoding ended
+		for (i = 0, total = 0; i < STAGE_COUNT; i++) {
+			total += STATS->wall[i];
+		}
+		fprintf(stderr, "Stages overlapped: %.3fs wall in all\n", total);
+		fprintf(stderr, "Overall: %.0f pixels/s, %.0f triangles/s", rate((double)STATS->pixels, total), rate((double)triangles, total));
+		if (STATS->bytes >= 0) {
+			fprintf(stderr, ", %.3f MB/s", rate((double)STATS->bytes / 1e6, total));
+		}
+		fprintf(stderr, "\n");
+	}
+	else {
+		fprintf(stderr, "Decode: %.0f pixels/s\n", rate((double)STATS->pixels, STATS->wall[STAGE_DECODE]));
+		fprintf(stderr, "Mesh: %.0f pixels/s, %.0f triangles/s\n",
+				rate((double)STATS->pixels, STATS->wall[STAGE_MESH]),
+				rate((double)triangles, STATS->wall[STAGE_MESH]));
+		if (STATS->bytes >= 0) {
+			fprintf(stderr, "Write: %.3f MB/s\n", rate((double)STATS->bytes / 1e6, STATS->wall[STAGE_WRITE]));
+		}
+	}
+	fprintf(stderr, "Peak RSS: %ld kB\n", STATS->peakrss);
+	if (STATS->heap >= 0) {
+		fprintf(stderr, "Peak heap: %ld kB\n", STATS->heap);
+	}
+	fprintf(stderr, "Estimated: %lu kB peak, %lu bytes output (%s)\n",
+			STATS->estmemory, STATS->estbytes, STATS->streamed ? "streamed" : "in memory");
+}
+
+// returns 0 on success, nonzero otherwise
+int StatsWriteJSON(const char *path) {
+	FILE *fp;
+	int i;
+	
+	if (STATS == NULL) {
+		return 0;
+	}
+	
+	if ((fp = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "Cannot open statistics file %s\n", path);
+		return 1;
+	}
+	
+	finish();
+	
+	fprintf(fp, "{\n");
+	if (STATS->hm != NULL) {
+		fprintf(fp, "\"width\": %u,\n\"height\": %u,\n\"bits\": %d,\n\"min\": %d,\n\"max\": %d,\n",
+				STATS->hm->width, STATS->hm->height, STATS->hm->wide ? 16 : 8, STATS->hm->min, STATS->hm->max);
+	}
+	fprintf(fp, "\"pixels\": %lu,\n\"masked\": %lu,\n", STATS->pixels, STATS->masked);
+	fprintf(fp, "\"triangles\": {\"surface\": %lu, \"walls\": %lu, \"bottom\": %lu},\n",
+			STATS->surface, STATS->walls, STATS->bottom);
+	fprintf(fp, "\"bytes\": %ld,\n", STATS->bytes);
+	fprintf(fp, "\"stages\": {");
+	for (i = 0; i < STAGE_COUNT; i++) {
+		int k;
+		fprintf(fp, "%s\n  \"%s\": {\"wall\": %.6f, \"cpu\": %.6f", i ? "," : "",
+				stagenames[i], STATS->wall[i], STATS->cpu[i]);
+		for (k = 0; k < PERF_COUNT; k++) {
+			if (STATS->perf & (1 << k)) {
+				fprintf(fp, ", \"%s\": %llu", PERFNAMES[k], STATS->events[i][k]);
+			}
+		}
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n},\n");
+	fprintf(fp, "\"peak_rss_kb\": %ld,\n\"peak_heap_kb\": %ld,\n", STATS->peakrss, STATS->heap);
+	fprintf(fp, "\"pipelined\": %s,\n", STATS->pipelined ? "true" : "false");
+	fprintf(fp, "\"estimate\": {\"peak_kb\": %lu, \"bytes\": %lu, \"streamed\": %s}\n}\n",
+			STATS->estmemory, STATS->estbytes, STATS->streamed ? "true" : "false");
+	
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "Cannot write statistics file %s\n", path);
+		return 1;
+	}
+	return 0;
+}
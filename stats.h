@@ -0,0 +1,69 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include "heightmap.h"
+#include "perfcount.h"
+
+typedef enum {
+	STAGE_DECODE, // ReadHeightmap() of the input heightmap
+	STAGE_MASK,   // mask image decode (or heightmask assignment)
+	STAGE_MESH,   // Mesh() triangle generation
+	STAGE_WRITE,  // trixWrite(), including normal computation
+	STAGE_COUNT
+} Stage;
+
+// In the pipeline, meshing and writing overlap decoding; STAGE_MESH and
+// STAGE_WRITE then count only the time each takes to finish after the
+// stage before it has. Likewise, a mask decoded on its own thread counts
+// in STAGE_MASK only for the time decoding waits for it to finish.
+
+typedef struct {
+	
+	// seconds spent in each stage (wall clock and process CPU time)
+	double wall[STAGE_COUNT], cpu[STAGE_COUNT];
+	double wallstart, cpustart;
+	
+	// heightmap dimensions and relief (as reported by DumpHeightmap)
+	const Heightmap *hm;
+	
+	// pixel counts; masked pixels are omitted from output
+	unsigned long pixels, masked;
+	
+	// triangle counts by part of the model
+	unsigned long surface, walls, bottom;
+	
+	// bytes of STL output; -1 if unknown (ASCII to a pipe)
+	long bytes;
+	
+	// peak resident set size and heap in use (kilobytes; -1 if unknown)
+	long peakrss, heap;
+	
+	// peak memory (kilobytes) and output bytes estimated before decoding,
+	// and whether the mesh was streamed or built in memory
+	unsigned long estmemory, estbytes;
+	int streamed;
+	
+	// whether decoding, meshing, and writing ran at once in the pipeline,
+	// so that only their total time says how fast each went
+	int pipelined;
+	
+	// hardware counter totals per stage (--perf); perf is a bitmask of
+	// the counters that could be opened, or 0 if none were requested or
+	// the kernel disallows them
+	int perf;
+	unsigned long long events[STAGE_COUNT][PERF_COUNT], eventstart[PERF_COUNT];
+	
+} Stats;
+
+// NULL unless statistics were requested; every Stats function
+// returns immediately in that case, so collection costs nothing.
+extern Stats *STATS;
+
+int StatsEnable(void);
+void StatsEnablePerf(void);
+void StatsBegin(Stage stage);
+void StatsEnd(Stage stage);
+void StatsPrint(void);
+int StatsWriteJSON(const char *path);
+
+#endif
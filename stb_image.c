@@ -7,7 +7,7 @@
           avoid problematic images and only need the trivial interface
 
       JPEG baseline (no JPEG progressive)
-      PNG 8-bit-per-channel only
+      PNG 8- or 16-bit-per-channel (16 narrowed to 8 unless rows ask)
 
       TGA (not sure what subset, if a subset)
       BMP non-1bpp, non-RLE
@@ -72,7 +72,8 @@
 //
 // Limitations:
 //    - no jpeg progressive support
-//    - non-HDR formats support 8-bit samples only (jpeg, png)
+//    - non-HDR formats return 8-bit samples only (16-bit png is narrowed
+//      to its high bytes, except in rows asked for with stbi_set_sample_bits)
 //    - no delayed line count (jpeg) -- IJG doesn't support either
 //    - no 1-bit BMP
 //    - GIF always returns *comp=4
@@ -111,6 +112,10 @@
 //       3           red, green, blue
 //       4           red, green, blue, alpha
 //
+// Grey from a colour JPEG is its Y (luma) channel as coded, which weights
+// red, green and blue 0.299, 0.587, 0.114; the other formats use 77, 150,
+// 29 out of 256. The JPEG chroma channels are then skipped over, not decoded.
+//
 // If image loading fails for any reason, the return value will be NULL,
 // and *x, *y, *comp will be unchanged. The function stbi_failure_reason()
 // can be queried for an extremely brief, end-user unfriendly explanation
@@ -291,6 +296,64 @@ extern void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply
 // or just pass them through "as-is"
 extern void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 
+// only the first 'rows' rows of the image are needed; decoders for
+// row-ordered formats (non-interlaced PNG, single-scan JPEG) may stop
+// early, leaving the remaining rows of the result undefined. 0 (the
+// default) decodes every row. the row callback may lower the limit
+// while an image loads; no more rows are handed over, and a PNG loaded
+// with stbi_load_rows is inflated no further. like failure_reason, this
+// and the settings below (except threads) apply to the calling thread
+// only, if the compiler has thread-local storage (see STBI_THREAD_LOCAL)
+extern void stbi_set_row_limit(int rows);
+
+// called with each row of the result, in order, as soon as it is final,
+// for decoders that produce the result a row at a time (JPEG, and
+// non-interlaced PNG loaded with req_comp 1), and for every image loaded
+// with stbi_load_rows. len is the row size in bytes. other loads never call
+// it, so callers must not depend on it. NULL (the default) disables it
+typedef void (*stbi_row_callback)(void *user, int y, stbi_uc const *row, int len);
+extern void stbi_set_row_callback(stbi_row_callback callback, void *user);
+
+// ask for the image reduced by 'denom' in each dimension (rounding up).
+// JPEG does this while decoding, by 2, 4 or 8 (the largest of them that
+// divides denom), from fewer DCT coefficients; other formats ignore it.
+// stbi_scale() then returns how much the last image was reduced by (1 if
+// not at all), so the caller can reduce it the rest of the way. the row
+// limit still counts rows of the full-size image. 1 (the default) decodes
+// at full size
+extern void stbi_set_scale(int denom);
+extern int  stbi_scale(void);
+
+// hand over the samples of 16-bit PNG rows as they are, rather than
+// narrowed to their high 8 bits, if 'bits' is 16: the row callback then
+// gets native-endian unsigned shorts (len still counts bytes, so it
+// doubles), for PNG loaded with stbi_load_rows (interlaced or not).
+// everything else, and every image returned, has 8-bit samples. stbi_sample_bits()
+// then returns the bits a sample of the rows of the last image (8 or 16),
+// from before its first row. 8 (the default) narrows them
+extern void stbi_set_sample_bits(int bits);
+extern int  stbi_sample_bits(void);
+
+// decode JPEG scans that have restart intervals on up to 'threads' threads
+// (if compiled with STBI_THREADS, which needs pthreads); each interval
+// decodes independently of the others. files decode (or fail) the same as
+// with 1 (the default). this one is shared by all threads; set it before
+// any of them load
+extern void stbi_set_threads(int threads);
+
+// load an image only through the row callback: each row is handed over as
+// stbi_load would return it, and nothing is returned. *x, *y and *comp are
+// set before the first row. non-interlaced PNG is inflated and unfiltered a
+// piece at a time, holding a few rows and the 32K inflate window rather
+// than the image; JPEG skips the full-size result. other images are loaded
+// whole and then handed over. the row limit applies. returns 1 on success,
+// 0 on failure
+extern int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+#ifndef STBI_NO_STDIO
+extern int stbi_load_rows            (char const *filename, int *x, int *y, int *comp, int req_comp);
+extern int stbi_load_rows_from_file  (FILE *f,              int *x, int *y, int *comp, int req_comp);
+#endif
+
 
 // ZLIB client - used by PNG, available for other purposes
 
@@ -317,6 +380,7 @@ typedef void (*stbi_YCbCr_to_RGB_run)(stbi_uc *output, stbi_uc const  *y, stbi_u
 //     cb: Cb input channel; scale/biased to be 0..255
 //     cr: Cr input channel; scale/biased to be 0..255
 
+// pass NULL to restore the built-in one
 extern void stbi_install_idct(stbi_idct_8x8 func);
 extern void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
 #endif // STBI_SIMD
@@ -346,6 +410,28 @@ extern void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
 #include <assert.h>
 #include <stdarg.h>
 
+#if defined(__SSE2__) && !defined(STBI_NO_SSE2)
+#define STBI_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef STBI_THREADS
+#include <pthread.h>
+#endif
+
+// failure_reason and the settings that shape one load (row limit, row
+// callback and scale) are kept per thread where the compiler allows, so
+// that images can be loaded on several threads at once
+#ifndef STBI_THREAD_LOCAL
+   #if defined(__GNUC__)
+   #define STBI_THREAD_LOCAL __thread
+   #elif defined(_MSC_VER)
+   #define STBI_THREAD_LOCAL __declspec(thread)
+   #else
+   #define STBI_THREAD_LOCAL
+   #endif
+#endif
+
 #ifndef _MSC_VER
    #ifdef __cplusplus
    #define stbi_inline inline
@@ -364,6 +450,11 @@ typedef   signed short  int16;
 typedef unsigned int   uint32;
 typedef   signed int    int32;
 typedef unsigned int   uint;
+#ifdef _MSC_VER
+typedef unsigned __int64 uint64;
+#else
+typedef unsigned long long uint64;
+#endif
 
 // should produce compiler error if size is wrong
 typedef unsigned char validate_uint32[sizeof(uint32)==4 ? 1 : -1];
@@ -492,14 +583,66 @@ static stbi_uc *stbi_gif_load(stbi *s, int *x, int *y, int *comp, int req_comp);
 static int      stbi_gif_info(stbi *s, int *x, int *y, int *comp);
 
 
-// this is not threadsafe
-static const char *failure_reason;
+// per thread (see STBI_THREAD_LOCAL)
+static STBI_THREAD_LOCAL const char *failure_reason;
 
 const char *stbi_failure_reason(void)
 {
    return failure_reason;
 }
 
+// see stbi_set_row_limit; per thread, like failure_reason
+static STBI_THREAD_LOCAL int row_limit;
+
+void stbi_set_row_limit(int rows)
+{
+   row_limit = rows > 0 ? rows : 0;
+}
+
+static STBI_THREAD_LOCAL stbi_row_callback row_callback;
+static STBI_THREAD_LOCAL void *row_callback_user;
+
+void stbi_set_row_callback(stbi_row_callback callback, void *user)
+{
+   row_callback = callback;
+   row_callback_user = user;
+}
+
+// set by stbi_load_rows; decoders that can then hand over rows without
+// making the whole image set rows_streamed
+static STBI_THREAD_LOCAL int rows_only, rows_streamed;
+
+static STBI_THREAD_LOCAL int scale_denom = 1, scale_applied = 1;
+
+void stbi_set_scale(int denom)
+{
+   scale_denom = denom > 1 ? denom : 1;
+}
+
+int stbi_scale(void)
+{
+   return scale_applied;
+}
+
+static STBI_THREAD_LOCAL int bits_wanted = 8, bits_applied = 8;
+
+void stbi_set_sample_bits(int bits)
+{
+   bits_wanted = bits == 16 ? 16 : 8;
+}
+
+int stbi_sample_bits(void)
+{
+   return bits_applied;
+}
+
+static int threads = 1;
+
+void stbi_set_threads(int n)
+{
+   threads = n > 1 ? n : 1;
+}
+
 static int e(const char *str)
 {
    failure_reason = str;
@@ -533,6 +676,8 @@ static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp);
 
 static unsigned char *stbi_load_main(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
+   scale_applied = 1;
+   bits_applied = 8;
    if (stbi_jpeg_test(s)) return stbi_jpeg_load(s,x,y,comp,req_comp);
    if (stbi_png_test(s))  return stbi_png_load(s,x,y,comp,req_comp);
    if (stbi_bmp_test(s))  return stbi_bmp_load(s,x,y,comp,req_comp);
@@ -579,6 +724,53 @@ unsigned char *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int
    return stbi_load_main(&s,x,y,comp,req_comp);
 }
 
+static int load_rows(stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_uc *data;
+   int j, n, k;
+   if (comp == NULL) comp = &k;
+   rows_only = 1;
+   rows_streamed = 0;
+   data = stbi_load_main(s,x,y,comp,req_comp);
+   rows_only = 0;
+   if (data == NULL) return 0;
+   if (!rows_streamed && row_callback) {
+      n = req_comp ? req_comp : *comp;
+      for (j=0; j < *y; ++j) {
+         if (row_limit && j >= row_limit) break;
+         row_callback(row_callback_user, j, data + n * *x * j, n * *x);
+      }
+   }
+   free(data);
+   return 1;
+}
+
+#ifndef STBI_NO_STDIO
+int stbi_load_rows(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f = fopen(filename, "rb");
+   int result;
+   if (!f) return e("can't fopen", "Unable to open file");
+   result = stbi_load_rows_from_file(f,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+int stbi_load_rows_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_file(&s,f);
+   return load_rows(&s,x,y,comp,req_comp);
+}
+#endif //!STBI_NO_STDIO
+
+int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_mem(&s,buffer,len);
+   return load_rows(&s,x,y,comp,req_comp);
+}
+
 unsigned char *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
 {
    stbi s;
@@ -740,10 +932,11 @@ stbi_inline static int get8(stbi *s)
 stbi_inline static int at_eof(stbi *s)
 {
    if (s->io.read) {
-      if (!(s->io.eof)(s->io_user_data)) return 0;
-      // if feof() is true, check if buffer = end
-      // special case: we've only got the special 0 character at the end
+      // once refill_buffer has hit the end, read_from_callbacks is 0 and
+      // nothing more will be read, even if a skip's fseek() has since
+      // cleared feof(); the special 0 character is all that's left
       if (s->read_from_callbacks == 0) return 1;
+      if (!(s->io.eof)(s->io_user_data)) return 0;
    }
 
    return s->img_buffer >= s->img_buffer_end;   
@@ -831,9 +1024,111 @@ static uint8 compute_y(int r, int g, int b)
    return (uint8) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
+// write the luminance of a row of 2-, 3- or 4-component pixels
+static void luma_row(uint8 *out, uint8 const *src, uint32 x, int img_n)
+{
+   uint32 i=0;
+   if (img_n == 2) {
+      for (; i < x; ++i) out[i] = src[i*2];
+      return;
+   }
+   #ifdef STBI_SSE2
+   {
+      // eight pixels at a time: spread each pixel over a 32-bit lane, mask
+      // out r, g and b, and pack them to 16 bits for the weighted sum (at
+      // most 255*256, so it can't overflow an unsigned 16-bit lane)
+      __m128i mask = _mm_set1_epi32(0xff);
+      __m128i wr = _mm_set1_epi16(77), wg = _mm_set1_epi16(150), wb = _mm_set1_epi16(29);
+      for (; i+9 <= x; i += 8) {
+         uint8 const *p = src + i*img_n;
+         __m128i lo, hi, r, g, b, y;
+         if (img_n == 4) {
+            lo = _mm_loadu_si128((__m128i const *) p);
+            hi = _mm_loadu_si128((__m128i const *) (p+16));
+         } else {
+            // the ninth pixel keeps the last 4-byte load inside the row
+            uint32 v[8];
+            int k;
+            for (k=0; k < 8; ++k) memcpy(&v[k], p + 3*k, 4);
+            lo = _mm_loadu_si128((__m128i const *) v);
+            hi = _mm_loadu_si128((__m128i const *) (v+4));
+         }
+         r = _mm_packs_epi32(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask));
+         g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 8), mask), _mm_and_si128(_mm_srli_epi32(hi, 8), mask));
+         b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 16), mask), _mm_and_si128(_mm_srli_epi32(hi, 16), mask));
+         y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, wr), _mm_mullo_epi16(g, wg)), _mm_mullo_epi16(b, wb));
+         y = _mm_srli_epi16(y, 8);
+         _mm_storel_epi64((__m128i *) (out+i), _mm_packus_epi16(y, y));
+      }
+   }
+   #endif
+   for (; i < x; ++i) {
+      uint8 const *p = src + i*img_n;
+      out[i] = compute_y(p[0], p[1], p[2]);
+   }
+}
+
+// convert a row of x pixels with img_n components to one with req_comp
+static void convert_row(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, uint x)
+{
+   int i;
+
+   if (req_comp == 1 && img_n > 1) {
+      luma_row(dest, src, x, img_n);
+      return;
+   }
+
+   #define COMBO(a,b)  ((a)*8+(b))
+   #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (COMBO(img_n, req_comp)) {
+      CASE(1,2) dest[0]=src[0], dest[1]=255; break;
+      CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
+      CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
+      CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
+      CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
+      CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
+      CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
+      default: assert(0);
+   }
+   #undef CASE
+   #undef COMBO
+}
+
+// convert_row for 16-bit samples, with the same luminance weights
+static void convert_row16(uint16 *dest, uint16 const *src, int img_n, int req_comp, uint x)
+{
+   int i;
+
+   #define Y16(r,g,b)  (uint16) ((((uint32) (r)*77) + ((uint32) (g)*150) + (29*(uint32) (b))) >> 8)
+   #define COMBO(a,b)  ((a)*8+(b))
+   #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   switch (COMBO(img_n, req_comp)) {
+      CASE(2,1) dest[0]=src[0]; break;
+      CASE(3,1) dest[0]=Y16(src[0],src[1],src[2]); break;
+      CASE(4,1) dest[0]=Y16(src[0],src[1],src[2]); break;
+      CASE(1,2) dest[0]=src[0], dest[1]=65535; break;
+      CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=65535; break;
+      CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
+      CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=65535; break;
+      CASE(3,2) dest[0]=Y16(src[0],src[1],src[2]), dest[1] = 65535; break;
+      CASE(4,2) dest[0]=Y16(src[0],src[1],src[2]), dest[1] = src[3]; break;
+      CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
+      default: assert(0);
+   }
+   #undef CASE
+   #undef COMBO
+   #undef Y16
+}
+
 static unsigned char *convert_format(unsigned char *data, int img_n, int req_comp, uint x, uint y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
@@ -845,31 +1140,8 @@ static unsigned char *convert_format(unsigned char *data, int img_n, int req_com
       return epuc("outofmem", "Out of memory");
    }
 
-   for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define COMBO(a,b)  ((a)*8+(b))
-      #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (COMBO(img_n, req_comp)) {
-         CASE(1,2) dest[0]=src[0], dest[1]=255; break;
-         CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
-         CASE(2,1) dest[0]=src[0]; break;
-         CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
-         CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
-         CASE(3,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
-         CASE(4,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
-         CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
-         default: assert(0);
-      }
-      #undef CASE
-   }
+   for (j=0; j < (int) y; ++j)
+      convert_row(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x);
 
    free(data);
    return good;
@@ -969,6 +1241,7 @@ typedef struct
    stbi *s;
    huffman huff_dc[4];
    huffman huff_ac[4];
+   int16 fast_ac[4][1 << FAST_BITS]; // see build_fast_ac
    uint8 dequant[4][64];
 
 // sizes for components, interleaved MCUs
@@ -991,13 +1264,26 @@ typedef struct
       uint8 *linebuf;
    } img_comp[4];
 
-   uint32         code_buffer; // jpeg entropy-coded buffer
+   uint64         code_buffer; // jpeg entropy-coded buffer, msb first
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
 
+   // where the 32-bit reader this one replaced would be in the input, which
+   // decides how corrupt data fails (see track_refill and sync_reader);
+   // bit offsets from the start of the interval
+   int            read_bits;   // bits put in code_buffer, zeros after a marker too
+   int            data_end;    // read_bits at the marker, once nomore
+   int            old_ahead;   // bits the 32-bit reader would have read, less read_bits
+   uint8          pending[20]; // input read ahead of it, for the scan for a marker
+   int            npending, next_pending; // after the entropy-coded data
+
    int scan_n, order[4];
    int restart_interval, todo;
+   int stopped;     // flag if decoding stopped early at the row limit
+   int luma_only;   // flag if only grey is wanted, so chroma can be skipped
+   int row_limit;   // row_limit of the thread that started the load
+   int scale;       // 1, 2, 4 or 8: blocks decode to 8/scale pixels square
 } jpeg;
 
 static int build_huffman(huffman *h, int *count)
@@ -1041,25 +1327,155 @@ static int build_huffman(huffman *h, int *count)
    return 1;
 }
 
+// build a table that decodes an AC code and the extra bits after it in one
+// lookup, for codes that fit in FAST_BITS with their extra bits and values
+// that fit in a byte: value << 8 | run << 4 | length of both. 0 if not
+static void build_fast_ac(int16 *fast_ac, huffman *h)
+{
+   int i;
+   for (i=0; i < (1 << FAST_BITS); ++i) {
+      uint8 fast = h->fast[i];
+      fast_ac[i] = 0;
+      if (fast < 255) {
+         int rs = h->values[fast];
+         int run = (rs >> 4) & 15;
+         int magbits = rs & 15;
+         int len = h->size[fast];
+         if (magbits && len + magbits <= FAST_BITS) {
+            // extend the extra bits as extend_receive does
+            int k = ((i << len) & ((1 << FAST_BITS) - 1)) >> (FAST_BITS - magbits);
+            if (k < (1 << (magbits - 1)))
+               k += 1 - (1 << magbits);
+            if (k >= -128 && k <= 127)
+               fast_ac[i] = (int16) (k * 256 + run * 16 + len + magbits);
+         }
+      }
+   }
+}
+
 static void grow_buffer_unsafe(jpeg *j)
 {
+   stbi *s = j->s;
+
+   // bulk refill: as many whole bytes as fit, in one load, when the input
+   // buffer has 8 and none of them is 0xff (which a stuffed zero or a
+   // marker follows, and which the byte loop below handles)
+   if (!j->nomore && s->img_buffer_end - s->img_buffer >= 8) {
+      uint8 *p = s->img_buffer;
+      uint64 x = ((uint64) p[0] << 56) | ((uint64) p[1] << 48) | ((uint64) p[2] << 40) | ((uint64) p[3] << 32) |
+                 ((uint64) p[4] << 24) | ((uint64) p[5] << 16) | ((uint64) p[6] <<  8) |  (uint64) p[7];
+      uint64 t = ~x;
+      if (!((t - 0x0101010101010101ull) & ~t & 0x8080808080808080ull)) {
+         int n = (64 - j->code_bits) >> 3;
+         x >>= j->code_bits;
+         if (j->code_bits + n*8 < 64)
+            x &= ~(~(uint64) 0 >> (j->code_bits + n*8));
+         j->code_buffer |= x;
+         j->code_bits += n*8;
+         j->read_bits += n*8;
+         j->old_ahead -= n*8;
+         s->img_buffer += n;
+         return;
+      }
+   }
+
    do {
-      int b = j->nomore ? 0 : get8(j->s);
+      int b = j->nomore ? 0 : get8(s);
       if (b == 0xff) {
-         int c = get8(j->s);
+         int c = get8(s);
          if (c != 0) {
             j->marker = (unsigned char) c;
             j->nomore = 1;
+            j->data_end = j->read_bits;
             return;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (uint64) b << (56 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+      j->read_bits += 8;
+      j->old_ahead -= 8;
+   } while (j->code_bits <= 56);
+}
+
+#define MARKER_none  0xff
+
+// the 32-bit reader refilled whenever it held fewer than n bits (after
+// taking used more), a byte at a time until it held more than 24. this
+// one reads further ahead, so follow where that one would have read to:
+// whether it would have reached the marker at the end of a restart
+// interval, and where it would have left the input, decide which corrupt
+// files fail
+stbi_inline static void track_refill(jpeg *j, int used, int n)
+{
+   int left = j->old_ahead + j->code_bits - used;
+   if (left < n)
+      j->old_ahead += (((24 - left) >> 3) + 1) << 3;
 }
 
-// (1 << n) - 1
-static uint32 bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
+// at the end of an interval or scan, leave things as the 32-bit reader
+// would have: read on as far as it would have, or keep the bytes this one
+// read ahead of it (and the marker, if it wouldn't have reached that) for
+// the scan for a marker after the entropy-coded data
+static void sync_reader(jpeg *j)
+{
+   int p, end, used, old_read = j->old_ahead + j->read_bits;
+   while (!j->nomore && j->read_bits < old_read) {
+      int b = get8(j->s);
+      if (b == 0xff) {
+         int c = get8(j->s);
+         if (c != 0) {
+            j->marker = (unsigned char) c;
+            j->nomore = 1;
+            j->data_end = j->read_bits;
+            break;
+         }
+      }
+      j->read_bits += 8;
+   }
+
+   used = j->read_bits - j->code_bits;
+   end = j->nomore ? j->data_end : j->read_bits;
+   j->npending = j->next_pending = 0;
+   for (p = old_read; p < end; p += 8) {
+      if (p >= used) {
+         // bytes of 0xff were followed by a stuffed zero
+         uint8 b = (uint8) ((j->code_buffer << (p - used)) >> 56);
+         j->pending[j->npending++] = b;
+         if (b == 0xff) j->pending[j->npending++] = 0;
+      }
+   }
+   if (j->nomore && j->data_end >= old_read) {
+      j->pending[j->npending++] = 0xff;
+      j->pending[j->npending++] = j->marker;
+      j->marker = MARKER_none;
+   }
+}
+
+// the next byte of input after the entropy-coded data
+static int get8_after(jpeg *j)
+{
+   if (j->next_pending < j->npending)
+      return j->pending[j->next_pending++];
+   return get8(j->s);
+}
+
+// find the marker after the entropy-coded data, if the scan didn't end at
+// it; returns 0 if anything but zeros comes first
+static int find_marker(jpeg *j)
+{
+   // handle 0s at the end of image data from IP Kamera 9060
+   while (j->next_pending < j->npending || !at_eof(j->s)) {
+      int x = get8_after(j);
+      if (x == 255) {
+         j->marker = (uint8) get8_after(j);
+         break;
+      } else if (x != 0) {
+         return 0;
+      }
+   }
+   // if we reach eof without hitting a marker, get_marker() will fail
+   return 1;
+}
 
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int decode(jpeg *j, huffman *h)
@@ -1067,11 +1483,12 @@ stbi_inline static int decode(jpeg *j, huffman *h)
    unsigned int temp;
    int c,k;
 
+   track_refill(j, 0, 16);
    if (j->code_bits < 16) grow_buffer_unsafe(j);
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (64 - FAST_BITS));
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -1088,7 +1505,7 @@ stbi_inline static int decode(jpeg *j, huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> 48);
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -1102,8 +1519,8 @@ stbi_inline static int decode(jpeg *j, huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & bmask[k]) + h->delta[k];
-   assert((((j->code_buffer) >> (32 - h->size[c])) & bmask[h->size[c]]) == h->code[c]);
+   c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
+   assert((j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -1117,18 +1534,12 @@ stbi_inline static int extend_receive(jpeg *j, int n)
 {
    unsigned int m = 1 << (n-1);
    unsigned int k;
+   track_refill(j, 0, n);
    if (j->code_bits < n) grow_buffer_unsafe(j);
 
-   #if 1
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~bmask[n];
-   k &= bmask[n];
-   j->code_bits -= n;
-   #else
-   k = (j->code_buffer >> (32 - n)) & bmask[n];
+   k = (unsigned int) (j->code_buffer >> (64 - n));
    j->code_bits -= n;
    j->code_buffer <<= n;
-   #endif
    // the following test is probably a random branch that won't
    // predict well. I tried to table accelerate it but failed.
    // maybe it's compiling as a conditional move?
@@ -1156,9 +1567,18 @@ static uint8 dezigzag[64+15] =
 };
 
 // decode one 64-entry block--
-static int decode_block(jpeg *j, short data[64], huffman *hdc, huffman *hac, int b)
+stbi_inline static void skip_bits(jpeg *j, int n)
+{
+   track_refill(j, 0, n);
+   if (j->code_bits < n) grow_buffer_unsafe(j);
+   j->code_buffer <<= n;
+   j->code_bits -= n;
+}
+
+static int decode_block(jpeg *j, short data[64], huffman *hdc, huffman *hac, int16 *fac, int b)
 {
    int diff,dc,k;
+   int n = 8 / j->scale; // a reduced-size IDCT only reads the top left n x n
    int t = decode(j, hdc);
    if (t < 0) return e("bad huffman code","Corrupt JPEG");
 
@@ -1173,8 +1593,24 @@ static int decode_block(jpeg *j, short data[64], huffman *hdc, huffman *hac, int
    // decode AC components, see JPEG spec
    k = 1;
    do {
-      int r,s;
-      int rs = decode(j, hac);
+      int r,s,rs;
+      // short codes, and their extra bits, take a single lookup (which
+      // the 32-bit reader's refill for the extra bits never follows, as
+      // they fit in the 16 bits it had for the code)
+      track_refill(j, 0, 16);
+      if (j->code_bits < 16) grow_buffer_unsafe(j);
+      rs = fac[j->code_buffer >> (64 - FAST_BITS)];
+      if (rs && (rs & 15) <= j->code_bits) {
+         k += (rs >> 4) & 15;
+         s = rs & 15;
+         j->code_buffer <<= s;
+         j->code_bits -= s;
+         if (n == 8 || ((dezigzag[k] & 7) < n && (dezigzag[k] >> 3) < n))
+            data[dezigzag[k]] = (short) (rs >> 8);
+         ++k;
+         continue;
+      }
+      rs = decode(j, hac);
       if (rs < 0) return e("bad huffman code","Corrupt JPEG");
       s = rs & 15;
       r = rs >> 4;
@@ -1184,7 +1620,52 @@ static int decode_block(jpeg *j, short data[64], huffman *hdc, huffman *hac, int
       } else {
          k += r;
          // decode into unzigzag'd location
-         data[dezigzag[k++]] = (short) extend_receive(j,s);
+         if (n == 8 || ((dezigzag[k] & 7) < n && (dezigzag[k] >> 3) < n))
+            data[dezigzag[k]] = (short) extend_receive(j,s);
+         else
+            skip_bits(j, s);
+         ++k;
+      }
+   } while (k < 64);
+   return 1;
+}
+
+// true if component b of a colour image isn't needed (only its luma is)
+stbi_inline static int skip_component(jpeg *j, int b)
+{
+   return j->luma_only && j->s->img_n == 3 && b != 0;
+}
+
+// like decode_block, but only consumes the block from the bitstream
+static int skip_block(jpeg *j, huffman *hdc, huffman *hac, int16 *fac)
+{
+   int k;
+   int t = decode(j, hdc);
+   if (t < 0) return e("bad huffman code","Corrupt JPEG");
+   if (t) skip_bits(j, t);
+
+   k = 1;
+   do {
+      int r,s,rs;
+      track_refill(j, 0, 16);
+      if (j->code_bits < 16) grow_buffer_unsafe(j);
+      rs = fac[j->code_buffer >> (64 - FAST_BITS)];
+      if (rs && (rs & 15) <= j->code_bits) {
+         k += ((rs >> 4) & 15) + 1;
+         j->code_buffer <<= rs & 15;
+         j->code_bits -= rs & 15;
+         continue;
+      }
+      rs = decode(j, hac);
+      if (rs < 0) return e("bad huffman code","Corrupt JPEG");
+      s = rs & 15;
+      r = rs >> 4;
+      if (s == 0) {
+         if (rs != 0xf0) break; // end block
+         k += 16;
+      } else {
+         k += r + 1;
+         skip_bits(j, s);
       }
    } while (k < 64);
    return 1;
@@ -1244,8 +1725,15 @@ stbi_inline static uint8 clamp(int x)
 
 #ifdef STBI_SIMD
 typedef unsigned short stbi_dequantize_t;
+// blocks handed to an installed IDCT are 16-byte aligned
+#ifdef _MSC_VER
+#define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
+#else
+#define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
+#endif
 #else
 typedef uint8 stbi_dequantize_t;
+#define STBI_SIMD_ALIGN(type, name) type name
 #endif
 
 // .344 seconds on 3*anemones.jpg
@@ -1315,11 +1803,77 @@ static stbi_idct_8x8 stbi_idct_installed = idct_block;
 
 void stbi_install_idct(stbi_idct_8x8 func)
 {
-   stbi_idct_installed = func;
+   stbi_idct_installed = func ? func : idct_block;
 }
 #endif
 
-#define MARKER_none  0xff
+// reduced-size IDCTs: an n x n block (n = 4, 2 or 1) from the lowest n x n
+// coefficients, sampling the full IDCT at the centre of each n x n group of
+// pixels. pixel i is the sum over u of 0.5*C(u)*cos((2i+1)u*pi/(2n)) times
+// coefficient u, which for n = 4 factors into even and odd halves
+#define IDCT_SCALED_4(s0,s1,s2,s3) \
+   t0 = ((s0) + (s2)) * f2f(0.35355339f); \
+   t1 = ((s0) - (s2)) * f2f(0.35355339f); \
+   t2 = (s1) * f2f(0.46193977f) + (s3) * f2f(0.19134172f); \
+   t3 = (s1) * f2f(0.19134172f) - (s3) * f2f(0.46193977f); \
+   x0 = t0 + t2; x1 = t1 + t3; x2 = t1 - t3; x3 = t0 - t2;
+
+stbi_inline static void idct_scaled(uint8 *out, int out_stride, short data[64], uint8 *dq, int n)
+{
+   int i,val[16],*v,t0,t1,t2,t3,x0,x1,x2,x3;
+
+   // columns, keeping 2 extra bits of precision as idct_block does
+   for (i=0; i < n; ++i) {
+      if (n == 4) {
+         IDCT_SCALED_4(data[i]*dq[i], data[8+i]*dq[8+i], data[16+i]*dq[16+i], data[24+i]*dq[24+i])
+         val[i]    = (x0 + 512) >> 10;
+         val[4+i]  = (x1 + 512) >> 10;
+         val[8+i]  = (x2 + 512) >> 10;
+         val[12+i] = (x3 + 512) >> 10;
+      } else if (n == 2) {
+         val[i]   = ((data[i]*dq[i] + data[8+i]*dq[8+i]) * f2f(0.35355339f) + 512) >> 10;
+         val[2+i] = ((data[i]*dq[i] - data[8+i]*dq[8+i]) * f2f(0.35355339f) + 512) >> 10;
+      } else {
+         val[0] = (data[0]*dq[0] * f2f(0.35355339f) + 512) >> 10;
+      }
+   }
+   // rows; remove the 1<<14 scale with rounding, and add 128
+   #define IDCT_SCALED_OUT(x)  clamp(((x) + 8192 + (128 << 14)) >> 14)
+   for (i=0, v=val; i < n; ++i, v += n, out += out_stride) {
+      if (n == 4) {
+         IDCT_SCALED_4(v[0], v[1], v[2], v[3])
+         out[0] = IDCT_SCALED_OUT(x0);
+         out[1] = IDCT_SCALED_OUT(x1);
+         out[2] = IDCT_SCALED_OUT(x2);
+         out[3] = IDCT_SCALED_OUT(x3);
+      } else if (n == 2) {
+         out[0] = IDCT_SCALED_OUT((v[0] + v[1]) * f2f(0.35355339f));
+         out[1] = IDCT_SCALED_OUT((v[0] - v[1]) * f2f(0.35355339f));
+      } else {
+         out[0] = IDCT_SCALED_OUT(v[0] * f2f(0.35355339f));
+      }
+   }
+   #undef IDCT_SCALED_OUT
+}
+
+// decode a block's coefficients into pixels at out
+static void idct_out(jpeg *z, uint8 *out, int out_stride, short data[64], int tq)
+{
+   // (n is constant in each call, so the loops unroll)
+   if (z->scale == 2)
+      idct_scaled(out, out_stride, data, z->dequant[tq], 4);
+   else if (z->scale == 4)
+      idct_scaled(out, out_stride, data, z->dequant[tq], 2);
+   else if (z->scale == 8)
+      idct_scaled(out, out_stride, data, z->dequant[tq], 1);
+   else
+      #ifdef STBI_SIMD
+      stbi_idct_installed(out, out_stride, data, z->dequant2[tq]);
+      #else
+      idct_block(out, out_stride, data, z->dequant[tq]);
+      #endif
+}
+
 // if there's a pending marker from the entropy stream, return that
 // otherwise, fetch from the stream and get a marker. if there's no
 // marker, return 0xff, which is never a valid marker value
@@ -1345,6 +1899,8 @@ static void reset(jpeg *j)
    j->code_bits = 0;
    j->code_buffer = 0;
    j->nomore = 0;
+   j->read_bits = j->data_end = j->old_ahead = 0;
+   j->npending = j->next_pending = 0;
    j->img_comp[0].dc_pred = j->img_comp[1].dc_pred = j->img_comp[2].dc_pred = 0;
    j->marker = MARKER_none;
    j->todo = j->restart_interval ? j->restart_interval : 0x7fffffff;
@@ -1352,78 +1908,262 @@ static void reset(jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int parse_entropy_coded_data(jpeg *z)
+// number of MCUs per row, and of rows, in the current scan
+static void scan_size(jpeg *z, int *w, int *h)
 {
-   reset(z);
    if (z->scan_n == 1) {
-      int i,j;
-      #ifdef STBI_SIMD
-      __declspec(align(16))
-      #endif
-      short data[64];
-      int n = z->order[0];
       // non-interleaved data, we just need to process one block at a time,
       // in trivial scanline order
       // number of blocks to do just depends on how many actual "pixels" this
       // component has, independent of interleaved MCU blocking and such
-      int w = (z->img_comp[n].x+7) >> 3;
-      int h = (z->img_comp[n].y+7) >> 3;
-      for (j=0; j < h; ++j) {
-         for (i=0; i < w; ++i) {
-            if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
-            #ifdef STBI_SIMD
-            stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
-            #else
-            idct_block(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
-            #endif
-            // every data block is an MCU, so countdown the restart interval
-            if (--z->todo <= 0) {
-               if (z->code_bits < 24) grow_buffer_unsafe(z);
-               // if it's NOT a restart, then just bail, so we get corrupt data
-               // rather than no data
-               if (!RESTART(z->marker)) return 1;
-               reset(z);
-            }
+      // (a reduced size rounds up to a multiple of the reduced block size)
+      int n = z->order[0];
+      *w = (z->img_comp[n].x*z->scale+7) >> 3;
+      *h = (z->img_comp[n].y*z->scale+7) >> 3;
+   } else {
+      *w = z->img_mcu_x;
+      *h = z->img_mcu_y;
+   }
+}
+
+// true if the rows needed are complete before MCU row j of the scan
+static int past_row_limit(jpeg *z, int j)
+{
+   if (!z->row_limit)
+      return 0;
+   // a single-component image (or the luma of one) is complete once
+   // the needed rows are done
+   if (z->scan_n == 1)
+      return (z->s->img_n == 1 || z->luma_only) && z->order[0] == 0 && j*8 >= z->row_limit;
+   // a scan with every component is complete once the needed rows are done,
+   // plus one more, which chroma upsampling of the last needed row reads
+   // (unless only full-resolution luma is wanted)
+   return z->scan_n == z->s->img_n && j*z->img_mcu_h >= z->row_limit +
+         (z->luma_only && z->img_comp[0].v == z->img_v_max ? 0 : z->scale);
+}
+
+// decode MCUs first..last-1 of the scan, in raster order
+static int decode_mcus(jpeg *z, int first, int last)
+{
+   int w,h,m,i,j,k,x,y;
+   STBI_SIMD_ALIGN(short, data[64]);
+   scan_size(z, &w, &h);
+   for (m=first; m < last; ++m) {
+      i = m % w;
+      j = m / w;
+      if ((i == 0 || m == first) && past_row_limit(z, j)) { z->stopped = 1; return 1; }
+      if (z->scan_n == 1) {
+         int n = z->order[0];
+         int bs = 8 / z->scale;
+         if (skip_component(z, n)) {
+            if (!skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, z->fast_ac[z->img_comp[n].ha])) return 0;
+         } else {
+            if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, z->fast_ac[z->img_comp[n].ha], n)) return 0;
+            idct_out(z, z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, data, z->img_comp[n].tq);
          }
-      }
-   } else { // interleaved!
-      int i,j,k,x,y;
-      short data[64];
-      for (j=0; j < z->img_mcu_y; ++j) {
-         for (i=0; i < z->img_mcu_x; ++i) {
-            // scan an interleaved mcu... process scan_n components in order
-            for (k=0; k < z->scan_n; ++k) {
-               int n = z->order[k];
-               // scan out an mcu's worth of this component; that's just determined
-               // by the basic H and V specified for the component
-               for (y=0; y < z->img_comp[n].v; ++y) {
-                  for (x=0; x < z->img_comp[n].h; ++x) {
-                     int x2 = (i*z->img_comp[n].h + x)*8;
-                     int y2 = (j*z->img_comp[n].v + y)*8;
-                     if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
-                     #ifdef STBI_SIMD
-                     stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
-                     #else
-                     idct_block(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
-                     #endif
+         // every data block is an MCU, so countdown the restart interval
+      } else { // interleaved!
+         // scan an interleaved mcu... process scan_n components in order
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            // scan out an mcu's worth of this component; that's just determined
+            // by the basic H and V specified for the component
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*8/z->scale;
+                  int y2 = (j*z->img_comp[n].v + y)*8/z->scale;
+                  if (skip_component(z, n)) {
+                     if (!skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, z->fast_ac[z->img_comp[n].ha])) return 0;
+                     continue;
                   }
+                  if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, z->fast_ac[z->img_comp[n].ha], n)) return 0;
+                  idct_out(z, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->img_comp[n].tq);
                }
             }
-            // after all interleaved components, that's an interleaved MCU,
-            // so now count down the restart interval
-            if (--z->todo <= 0) {
-               if (z->code_bits < 24) grow_buffer_unsafe(z);
-               // if it's NOT a restart, then just bail, so we get corrupt data
-               // rather than no data
-               if (!RESTART(z->marker)) return 1;
-               reset(z);
-            }
          }
+         // after all interleaved components, that's an interleaved MCU,
+         // so now count down the restart interval
+      }
+      if (--z->todo <= 0) {
+         track_refill(z, 0, 24);
+         sync_reader(z);
+         // if it's NOT a restart, then just bail, so we get corrupt data
+         // rather than no data
+         if (!RESTART(z->marker)) return 1;
+         reset(z);
       }
    }
+   sync_reader(z);
    return 1;
 }
 
+#ifdef STBI_THREADS
+// how an interval decoded: as far as the marker after it, or not
+enum
+{
+   INTERVAL_done=0,
+   INTERVAL_failed,   // with failure_reason
+   INTERVAL_stopped,  // at the row limit
+   INTERVAL_short     // reading directly, the scan would end there, and fail
+};
+
+// a scan's entropy-coded data, split at its restart markers, for decoding
+// the intervals between them on several threads
+typedef struct
+{
+   jpeg *z;
+   uint8 *data;       // entropy-coded data, including the markers
+   int *start;        // offset of each interval in data, then the length
+   uint8 *outcome;    // how each interval decoded
+   const char **reason; // and its failure_reason, if it failed
+   int intervals, mcus;
+   uint8 marker;      // the marker after the scan
+   int next;          // next interval to decode, taken atomically
+} jpeg_intervals;
+
+// whether the decode of a scan left off where decode_jpeg_image expects:
+// at marker, the one after the scan, or at zeros before it
+static int at_marker(jpeg *z, uint8 marker)
+{
+   if (z->marker == MARKER_none && !find_marker(z)) return 0;
+   return z->marker == marker;
+}
+
+static void *decode_intervals(void *arg)
+{
+   jpeg_intervals *p = (jpeg_intervals *) arg;
+   jpeg z = *p->z;       // private bit reader and dc predictions
+   stbi s = *p->z->s;    // and input; the component planes are shared,
+   int k,first,last;     // but each MCU writes only its own blocks
+   z.s = &s;
+   while ((k = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->intervals) {
+      first = k * z.restart_interval;
+      last = first + z.restart_interval < p->mcus ? first + z.restart_interval : p->mcus;
+      start_mem(&s, p->data + p->start[k], p->start[k+1] - p->start[k]);
+      reset(&z);
+      if (!decode_mcus(&z, first, last)) {
+         // failure_reason is this thread's own
+         p->reason[k] = failure_reason;
+         p->outcome[k] = INTERVAL_failed;
+      } else if (z.stopped) {
+         p->outcome[k] = INTERVAL_stopped;
+      } else if (k+1 < p->intervals ? z.todo <= 0 : !at_marker(&z, p->marker)) {
+         // an interval but the last that didn't reach its restart marker
+         // (so wasn't reset for the next), or a last one followed by more
+         // data: reading directly, the scan would end there, and the
+         // search for the marker after it would fail on the data left
+         p->outcome[k] = INTERVAL_short;
+      } else {
+         p->outcome[k] = INTERVAL_done;
+      }
+   }
+   return NULL;
+}
+
+// read the rest of the scan, up to the marker after it, and decode its
+// restart intervals in parallel. returns 0 on error, or -1 (before reading
+// anything) if the scan isn't worth splitting
+static int decode_parallel(jpeg *z, int mcus)
+{
+   jpeg_intervals p;
+   pthread_t tid[64];
+   int len=0, cap=1<<16, n=0, ncap=64, b, c, t, k, started=0, failed=0, stopped=0;
+   const char *reason = failure_reason;
+   uint8 marker = MARKER_none;
+
+   if (threads < 2 || !z->restart_interval || mcus <= z->restart_interval)
+      return -1;
+   p.intervals = (mcus + z->restart_interval-1) / z->restart_interval;
+
+   // collect the data and the offset of each interval; the restart markers
+   // stay in, so each interval's decoder sees the one that ends it
+   p.data = (uint8 *) malloc(cap);
+   p.start = (int *) malloc(ncap * sizeof(int));
+   p.outcome = (uint8 *) malloc(p.intervals);
+   p.reason = (const char **) malloc(p.intervals * sizeof(*p.reason));
+   if (!p.data || !p.start || !p.outcome || !p.reason) {
+      free(p.data); free(p.start); free(p.outcome); free(p.reason);
+      return e("outofmem", "Out of memory");
+   }
+   p.start[n++] = 0;
+   while (z->s->img_buffer < z->s->img_buffer_end || !at_eof(z->s)) {
+      if (len + 2 > cap || n + 1 > ncap) {
+         uint8 *d = len + 2 > cap ? (uint8 *) realloc(p.data, cap *= 2) : p.data;
+         int *st = n + 1 > ncap ? (int *) realloc(p.start, (ncap *= 2) * sizeof(int)) : p.start;
+         if (d) p.data = d;
+         if (st) p.start = st;
+         if (!d || !st) { free(p.data); free(p.start); free(p.outcome); free(p.reason); return e("outofmem", "Out of memory"); }
+      }
+      b = p.data[len++] = get8u(z->s);
+      if (b != 0xff) continue;
+      c = p.data[len++] = get8u(z->s);
+      if (c == 0) continue;
+      if (!RESTART(c)) { marker = (uint8) c; break; }
+      p.start[n++] = len;
+   }
+   p.start[n] = len;
+
+   p.z = z;
+   p.mcus = mcus;
+   p.marker = marker;
+   p.next = 0;
+   if (n == p.intervals) {
+      // the calling thread decodes too
+      t = threads < p.intervals ? threads : p.intervals;
+      if (t > 64) t = 64;
+      for (started=0; started < t-1; ++started)
+         if (pthread_create(&tid[started], NULL, decode_intervals, &p)) break;
+      decode_intervals(&p);
+      while (started > 0)
+         pthread_join(tid[--started], NULL);
+      // the first interval that didn't decode whole decides, as it would
+      // reading directly, where the later ones are never reached
+      for (k=0; k < n && p.outcome[k] == INTERVAL_done; ++k)
+         ;
+      if (k < n) {
+         failed = p.outcome[k] != INTERVAL_stopped;
+         stopped = p.outcome[k] == INTERVAL_stopped;
+         if (p.outcome[k] == INTERVAL_failed) reason = p.reason[k];
+      }
+      // not whatever the intervals this thread decoded left
+      failure_reason = reason;
+   } else {
+      // a restart marker is missing (or extra), so the intervals don't line
+      // up with the MCUs; decode the data in one go, as if read directly
+      stbi s = *z->s, *in = z->s;
+      start_mem(&s, p.data, len);
+      z->s = &s;
+      failed = !decode_mcus(z, 0, mcus);
+      stopped = z->stopped;
+      if (!failed && !stopped && !at_marker(z, marker)) failed = 1;
+      z->s = in;
+   }
+
+   free(p.data);
+   free(p.start);
+   free(p.outcome);
+   free(p.reason);
+   z->marker = marker;
+   z->npending = z->next_pending = 0;
+   z->stopped = stopped;
+   return failed ? 0 : 1;
+}
+#endif
+
+static int parse_entropy_coded_data(jpeg *z)
+{
+   int w,h;
+   reset(z);
+   scan_size(z, &w, &h);
+   #ifdef STBI_THREADS
+   {
+      int r = decode_parallel(z, w*h);
+      if (r >= 0) return r;
+   }
+   #endif
+   return decode_mcus(z, 0, w*h);
+}
+
 static int process_marker(jpeg *z, int m)
 {
    int L;
@@ -1480,6 +2220,8 @@ static int process_marker(jpeg *z, int m)
             }
             for (i=0; i < m; ++i)
                v[i] = get8u(z->s);
+            if (tc == 1)
+               build_fast_ac(z->fast_ac[th], z->huff_ac+th);
             L -= m;
          }
          return L==0;
@@ -1564,29 +2306,51 @@ static int process_frame_header(jpeg *z, int scan)
    z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
 
+   // interval threads check the row limit of the thread they decode for
+   z->row_limit = row_limit;
+
+   // reduced-size decoding, by the largest factor of 8 that's asked for
+   z->scale = 1;
+   while (z->scale < 8 && scale_denom % (z->scale * 2) == 0)
+      z->scale *= 2;
+
    for (i=0; i < s->img_n; ++i) {
       // number of effective pixels (e.g. for non-interleaved MCU)
       z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
       z->img_comp[i].y = (s->img_y * z->img_comp[i].v + v_max-1) / v_max;
+      z->img_comp[i].x = (z->img_comp[i].x + z->scale-1) / z->scale;
+      z->img_comp[i].y = (z->img_comp[i].y + z->scale-1) / z->scale;
       // to simplify generation, we'll allocate enough memory to decode
       // the bogus oversized data from using interleaved MCUs and their
       // big blocks (e.g. a 16x16 iMCU on an image of width 33); we won't
       // discard the extra data until colorspace conversion
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8 / z->scale;
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8 / z->scale;
+      z->img_comp[i].linebuf = NULL;
+      if (skip_component(z, i)) {
+         // never written or read
+         z->img_comp[i].raw_data = NULL;
+         z->img_comp[i].data = NULL;
+         continue;
+      }
       z->img_comp[i].raw_data = malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
       if (z->img_comp[i].raw_data == NULL) {
          for(--i; i >= 0; --i) {
             free(z->img_comp[i].raw_data);
+            z->img_comp[i].raw_data = NULL;
             z->img_comp[i].data = NULL;
          }
          return e("outofmem", "Out of memory");
       }
       // align blocks for installable-idct using mmx/sse
       z->img_comp[i].data = (uint8*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
-      z->img_comp[i].linebuf = NULL;
    }
 
+   // from here on, the image is the reduced one
+   s->img_x = (s->img_x + z->scale-1) / z->scale;
+   s->img_y = (s->img_y + z->scale-1) / z->scale;
+   scale_applied = z->scale;
+
    return 1;
 }
 
@@ -1622,25 +2386,15 @@ static int decode_jpeg_image(jpeg *j)
 {
    int m;
    j->restart_interval = 0;
+   j->stopped = 0;
    if (!decode_jpeg_header(j, SCAN_load)) return 0;
    m = get_marker(j);
    while (!EOI(m)) {
       if (SOS(m)) {
          if (!process_scan_header(j)) return 0;
          if (!parse_entropy_coded_data(j)) return 0;
-         if (j->marker == MARKER_none ) {
-            // handle 0s at the end of image data from IP Kamera 9060
-            while (!at_eof(j->s)) {
-               int x = get8(j->s);
-               if (x == 255) {
-                  j->marker = get8u(j->s);
-                  break;
-               } else if (x != 0) {
-                  return 0;
-               }
-            }
-            // if we reach eof without hitting a marker, get_marker() below will fail and we'll eventually return 0
-         }
+         if (j->stopped) return 1; // stopped at the row limit; later rows are undefined
+         if (j->marker == MARKER_none && !find_marker(j)) return 0;
       } else {
          if (!process_marker(j, m)) return 0;
       }
@@ -1774,7 +2528,7 @@ static stbi_YCbCr_to_RGB_run stbi_YCbCr_installed = YCbCr_to_RGB_row;
 
 void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func)
 {
-   stbi_YCbCr_installed = func;
+   stbi_YCbCr_installed = func ? func : YCbCr_to_RGB_row;
 }
 #endif
 
@@ -1811,6 +2565,7 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
    // validate req_comp
    if (req_comp < 0 || req_comp > 4) return epuc("bad req_comp", "Internal error");
    z->s->img_n = 0;
+   z->luma_only = req_comp == 1 || req_comp == 2;
 
    // load a jpeg image from whichever source
    if (!decode_jpeg_image(z)) { cleanup_jpeg(z); return NULL; }
@@ -1854,13 +2609,21 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
          else                               r->resample = resample_row_generic;
       }
 
-      // can't error after this so, this is safe
-      output = (uint8 *) malloc(n * z->s->img_x * z->s->img_y + 1);
+      // can't error after this so, this is safe; only rows are wanted
+      // from stbi_load_rows, so then one is reused for all of them
+      output = (uint8 *) malloc(n * z->s->img_x * (rows_only ? 1 : z->s->img_y) + 1);
       if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
+      rows_streamed = rows_only;
+      *out_x = z->s->img_x;
+      *out_y = z->s->img_y;
+      if (comp) *comp  = z->s->img_n; // report original components, not output
 
       // now go ahead and resample
       for (j=0; j < z->s->img_y; ++j) {
-         uint8 *out = output + n * z->s->img_x * j;
+         uint8 *row = rows_only ? output : output + n * z->s->img_x * j;
+         uint8 *out = row;
+         // the rest is undefined anyway (the limit is in full-size rows)
+         if (row_limit && j * z->scale >= (uint) row_limit) break;
          for (k=0; k < decode_n; ++k) {
             stbi_resample *r = &res_comp[k];
             int y_bot = r->ystep >= (r->vs >> 1);
@@ -1879,7 +2642,7 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
             uint8 *y = coutput[0];
             if (z->s->img_n == 3) {
                #ifdef STBI_SIMD
-               stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s.img_x, n);
+               stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s->img_x, n);
                #else
                YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s->img_x, n);
                #endif
@@ -1896,11 +2659,10 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
             else
                for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
          }
+         if (row_callback)
+            row_callback(row_callback_user, j, row, n * z->s->img_x);
       }
       cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp  = z->s->img_n; // report original components, not output
       return output;
    }
 }
@@ -1909,6 +2671,7 @@ static unsigned char *stbi_jpeg_load(stbi *s, int *x, int *y, int *comp, int req
 {
    jpeg j;
    j.s = s;
+   j.luma_only = 0;
    return load_jpeg_image(&j, x,y,comp,req_comp);
 }
 
@@ -1917,6 +2680,7 @@ static int stbi_jpeg_test(stbi *s)
    int r;
    jpeg j;
    j.s = s;
+   j.luma_only = 0;
    r = decode_jpeg_header(&j, SCAN_type);
    stbi_rewind(s);
    return r;
@@ -1938,6 +2702,7 @@ static int stbi_jpeg_info(stbi *s, int *x, int *y, int *comp)
 {
    jpeg j;
    j.s = s;
+   j.luma_only = 0;
    return stbi_jpeg_info_raw(&j, x, y, comp);
 }
 
@@ -1993,7 +2758,8 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
       ++sizes[sizelist[i]];
    sizes[0] = 0;
    for (i=1; i < 16; ++i)
-      assert(sizes[i] <= (1 << i));
+      if (sizes[i] > (1 << i))
+         return e("bad sizes", "Corrupt PNG");
    code = 0;
    for (i=1; i < 16; ++i) {
       next_code[i] = code;
@@ -2030,13 +2796,16 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
 //    because PNG allows splitting the zlib stream arbitrarily,
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
 //    we require PNG read all the IDATs and combine them into a single
-//    memory buffer
+//    memory buffer (except for stbi_load_rows, where PNG supplies the
+//    input a piece at a time and takes the output as it goes)
 
-typedef struct
+typedef struct zbuf zbuf;
+struct zbuf
 {
    uint8 *zbuffer, *zbuffer_end;
    int num_bits;
-   uint32 code_buffer;
+   uint64 code_buffer;
+   int zpast;  // zero bytes put in code_buffer from past the end of zbuffer
 
    char *zout;
    char *zout_start;
@@ -2044,28 +2813,54 @@ typedef struct
    int   z_expandable;
 
    zhuffman z_length, z_distance;
-} zbuf;
+   uint32 zpair[1 << ZFAST_BITS]; // see zbuild_literal_pairs
+
+   // when set, more() is called for the next piece of input when zbuffer
+   // runs out (returning 0 at the end), and drain() to make room for n
+   // bytes in a fixed zout window by taking what's done, keeping the last
+   // 32K for matches to refer back to (returning 0 to stop)
+   int (*more)(zbuf *z);
+   int (*drain)(zbuf *z, int n);
+   void *user;
+};
+
+stbi_inline static int zmore(zbuf *z)
+{
+   return z->zbuffer < z->zbuffer_end || (z->more && z->more(z));
+}
 
 stbi_inline static int zget8(zbuf *z)
 {
-   if (z->zbuffer >= z->zbuffer_end) return 0;
+   if (!zmore(z)) return 0;
    return *z->zbuffer++;
 }
 
 static void fill_bits(zbuf *z)
 {
+   assert(z->code_buffer < ((uint64) 1 << z->num_bits));
+   // as many whole bytes as fit, in one load, away from the end of input
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      uint8 *p = z->zbuffer;
+      int n = (63 - z->num_bits) >> 3;
+      uint64 x = (uint64) p[0]         | ((uint64) p[1] <<  8) | ((uint64) p[2] << 16) | ((uint64) p[3] << 24) |
+                ((uint64) p[4] << 32) | ((uint64) p[5] << 40) | ((uint64) p[6] << 48) | ((uint64) p[7] << 56);
+      z->code_buffer |= (x & (((uint64) 1 << (n*8)) - 1)) << z->num_bits;
+      z->num_bits += n*8;
+      z->zbuffer += n;
+      return;
+   }
    do {
-      assert(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= zget8(z) << z->num_bits;
+      if (!zmore(z)) ++z->zpast;
+      z->code_buffer |= (uint64) zget8(z) << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= 48);
 }
 
 stbi_inline static unsigned int zreceive(zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;   
@@ -2085,7 +2880,7 @@ stbi_inline static int zhuffman_decode(zbuf *a, zhuffman *z)
 
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = bit_reverse(a->code_buffer, 16);
+   k = bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -2102,11 +2897,18 @@ static int expand(zbuf *z, int n)  // need to make room for n bytes
 {
    char *q;
    int cur, limit;
+   if (z->drain) return z->drain(z, n);
    if (!z->z_expandable) return e("output buffer limit","Corrupt PNG");
+   // the zeros fill_bits puts past the end of input decode as codes too,
+   // so a truncated or corrupt stream would otherwise grow its output
+   // until it ran out of memory
+   if (z->num_bits < 8 * z->zpast) return e("outofdata","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
    limit = (int) (z->zout_end - z->zout_start);
-   while (cur + n > limit)
+   while (cur + n > limit) {
+      if (limit > 0x3fffffff) return e("outofmem", "Out of memory");
       limit *= 2;
+   }
    q = (char *) realloc(z->zout_start, limit);
    if (q == NULL) return e("outofmem", "Out of memory");
    z->zout_start = q;
@@ -2129,30 +2931,99 @@ static int dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
 static int dist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// pairs of literals whose codes fit in ZFAST_BITS together, so both can be
+// decoded with one lookup: first | second << 8 | length of both << 16.
+// 0 if the bits don't start with two such literals
+static void zbuild_literal_pairs(zbuf *a)
+{
+   zhuffman *z = &a->z_length;
+   int i,b,c;
+   for (i=0; i < (1 << ZFAST_BITS); ++i) {
+      a->zpair[i] = 0;
+      b = z->fast[i];
+      if (b == 0xffff || z->value[b] >= 256) continue;
+      // the second code starts after the first; its fast entry is the
+      // same whatever the bits past ZFAST_BITS are, if it's short enough
+      c = z->fast[i >> z->size[b]];
+      if (c == 0xffff || z->value[c] >= 256 || z->size[b] + z->size[c] > ZFAST_BITS) continue;
+      a->zpair[i] = z->value[b] | (z->value[c] << 8) | ((z->size[b] + z->size[c]) << 16);
+   }
+}
+
 static int parse_huffman_block(zbuf *a)
 {
+   char *zout = a->zout;
    for(;;) {
-      int z = zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
-         if (a->zout >= a->zout_end) if (!expand(a, 1)) return 0;
-         *a->zout++ = (char) z;
+      uint8 *p;
+      int z,len,dist;
+      // one refill covers the longest length/distance pair (48 bits)
+      if (a->num_bits < 48) fill_bits(a);
+      if (a->zout_end - zout >= 258 + 8) {
+         // safe zone: there's room for the longest match, and for the
+         // overrun of copying it a word at a time, without checking
+         uint32 pair = a->zpair[a->code_buffer & ZFAST_MASK];
+         if (pair) {
+            zout[0] = (char) (pair & 255);
+            zout[1] = (char) ((pair >> 8) & 255);
+            zout += 2;
+            a->code_buffer >>= pair >> 16;
+            a->num_bits -= pair >> 16;
+            continue;
+         }
+         z = zhuffman_decode(a, &a->z_length);
+         if (z < 256) {
+            if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
+            *zout++ = (char) z;
+            continue;
+         }
+      } else {
+         z = zhuffman_decode(a, &a->z_length);
+         if (z < 256) {
+            if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
+            if (zout >= a->zout_end) {
+               a->zout = zout;
+               if (!expand(a, 1)) return 0;
+               zout = a->zout;
+            }
+            *zout++ = (char) z;
+            continue;
+         }
+      }
+      if (z == 256) {
+         a->zout = zout;
+         return 1;
+      }
+      z -= 257;
+      len = length_base[z];
+      if (length_extra[z]) len += zreceive(a, length_extra[z]);
+      z = zhuffman_decode(a, &a->z_distance);
+      if (z < 0) return e("bad huffman code","Corrupt PNG");
+      dist = dist_base[z];
+      if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
+      if (zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
+      if (zout + len > a->zout_end) {
+         a->zout = zout;
+         if (!expand(a, len)) return 0;
+         zout = a->zout;
+      }
+      p = (uint8 *) (zout - dist);
+      if (dist == 1) {
+         // a run of one byte
+         memset(zout, *p, len);
+         zout += len;
+      } else if (dist >= 8 && a->zout_end - zout >= len + 8) {
+         // a word at a time; the source never overlaps the word being
+         // written, and the overrun is overwritten by what comes next
+         char *end = zout + len;
+         do {
+            memcpy(zout, p, 8);
+            zout += 8;
+            p += 8;
+         } while (zout < end);
+         zout = end;
       } else {
-         uint8 *p;
-         int len,dist;
-         if (z == 256) return 1;
-         z -= 257;
-         len = length_base[z];
-         if (length_extra[z]) len += zreceive(a, length_extra[z]);
-         z = zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return e("bad huffman code","Corrupt PNG");
-         dist = dist_base[z];
-         if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
-         if (a->zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
-         if (a->zout + len > a->zout_end) if (!expand(a, len)) return 0;
-         p = (uint8 *) (a->zout - dist);
          while (len--)
-            *a->zout++ = *p++;
+            *zout++ = *p++;
       }
    }
 }
@@ -2179,10 +3050,11 @@ static int compute_huffman_codes(zbuf *a)
    n = 0;
    while (n < hlit + hdist) {
       int c = zhuffman_decode(a, &z_codelength);
-      assert(c >= 0 && c < 19);
+      if (c < 0 || c >= 19) return e("bad codelengths", "Corrupt PNG");
       if (c < 16)
          lencodes[n++] = (uint8) c;
       else if (c == 16) {
+         if (n == 0) return e("bad codelengths", "Corrupt PNG");
          c = zreceive(a,2)+3;
          memset(lencodes+n, lencodes[n-1], c);
          n += c;
@@ -2211,24 +3083,43 @@ static int parse_uncompressed_block(zbuf *a)
       zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (uint8) (a->code_buffer & 255); // wtf this warns?
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
-   assert(a->num_bits == 0);
    // now fill header the normal way
    while (k < 4)
       header[k++] = (uint8) zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return e("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return e("read past buffer","Corrupt PNG");
-   if (a->zout + len > a->zout_end)
-      if (!expand(a, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   // the bit buffer can hold the start of the data (ahead of any zeros from
+   // past the end of input); if the block ends there, the rest stays put
+   while (len > 0 && (a->num_bits >> 3) > a->zpast) {
+      if (a->zout >= a->zout_end)
+         if (!expand(a, 1)) return 0;
+      *a->zout++ = (char) (a->code_buffer & 255);
+      a->code_buffer >>= 8;
+      a->num_bits -= 8;
+      --len;
+   }
+   if (len == 0) return 1;
+   a->zpast = 0;
+   a->num_bits = 0;
+   a->code_buffer = 0;
+   while (len > 0) {
+      if (!zmore(a)) return e("read past buffer","Corrupt PNG");
+      k = (int) (a->zbuffer_end - a->zbuffer);
+      if (k > len) k = len;
+      if (k > 32768) k = 32768;
+      if (a->zout + k > a->zout_end)
+         if (!expand(a, k)) return 0;
+      memcpy(a->zout, a->zbuffer, k);
+      a->zbuffer += k;
+      a->zout += k;
+      len -= k;
+   }
    return 1;
 }
 
@@ -2245,20 +3136,27 @@ static int parse_zlib_header(zbuf *a)
    return 1;
 }
 
-// @TODO: should statically initialize these for optimal thread safety
-static uint8 default_length[288], default_distance[32];
-static void init_defaults(void)
-{
-   int i;   // use <= to match clearly with spec
-   for (i=0; i <= 143; ++i)     default_length[i]   = 8;
-   for (   ; i <= 255; ++i)     default_length[i]   = 9;
-   for (   ; i <= 279; ++i)     default_length[i]   = 7;
-   for (   ; i <= 287; ++i)     default_length[i]   = 8;
-
-   for (i=0; i <=  31; ++i)     default_distance[i] = 5;
-}
+// fixed Huffman code lengths, initialized statically so that threads can
+// share them: 8 for literals 0-143, 9 for 144-255, 7 for 256-279 and 8
+// for 280-287; 5 for every distance
+#define Z8x16 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8
+#define Z9x16 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9
+#define Z7x8  7,7,7,7,7,7,7,7
+#define Z5x16 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5
+static uint8 default_length[288] = {
+   Z8x16,Z8x16,Z8x16,Z8x16,Z8x16,Z8x16,Z8x16,Z8x16,Z8x16,
+   Z9x16,Z9x16,Z9x16,Z9x16,Z9x16,Z9x16,Z9x16,
+   Z7x8,Z7x8,Z7x8,
+   8,8,8,8,8,8,8,8
+};
+static uint8 default_distance[32] = { Z5x16,Z5x16 };
+#undef Z8x16
+#undef Z9x16
+#undef Z7x8
+#undef Z5x16
 
 int stbi_png_partial; // a quick hack to only allow decoding some of a PNG... I should implement real streaming support instead
+static STBI_THREAD_LOCAL int zlib_limit; // 0, or bytes of output after which parse_zlib can stop (PNG row limit)
 static int parse_zlib(zbuf *a, int parse_header)
 {
    int final, type;
@@ -2266,6 +3164,7 @@ static int parse_zlib(zbuf *a, int parse_header)
       if (!parse_zlib_header(a)) return 0;
    a->num_bits = 0;
    a->code_buffer = 0;
+   a->zpast = 0;
    do {
       final = zreceive(a,1);
       type = zreceive(a,2);
@@ -2276,16 +3175,18 @@ static int parse_zlib(zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!default_distance[31]) init_defaults();
             if (!zbuild_huffman(&a->z_length  , default_length  , 288)) return 0;
             if (!zbuild_huffman(&a->z_distance, default_distance,  32)) return 0;
          } else {
             if (!compute_huffman_codes(a)) return 0;
          }
+         zbuild_literal_pairs(a);
          if (!parse_huffman_block(a)) return 0;
       }
       if (stbi_png_partial && a->zout - a->zout_start > 65536)
          break;
+      if (zlib_limit && a->zout - a->zout_start >= zlib_limit)
+         break;
    } while (!final);
    return 1;
 }
@@ -2296,6 +3197,8 @@ static int do_zlib(zbuf *a, char *obuf, int olen, int exp, int parse_header)
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->more = NULL;
+   a->drain = NULL;
 
    return parse_zlib(a, parse_header);
 }
@@ -2377,7 +3280,7 @@ int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffe
 
 // public domain "baseline" PNG decoder   v0.10  Sean Barrett 2006-11-18
 //    simple implementation
-//      - only 8-bit samples
+//      - 8-bit samples, and 16-bit ones narrowed to 8 (or kept, for rows)
 //      - no CRC checking
 //      - allocates lots of intermediate memory
 //        - avoids problem of streaming data between subsystems
@@ -2415,28 +3318,202 @@ typedef struct
 {
    stbi *s;
    uint8 *idata, *expanded, *out;
+   int final; // out is the 1-component result, made as rows are unfiltered
+   int depth; // bits a sample in the file: 8, or 16
+   int *x, *y, *comp; // for stbi_load_rows, which sets them before any row
 } png;
 
 
 enum {
-   F_none=0, F_sub=1, F_up=2, F_avg=3, F_paeth=4,
-   F_avg_first, F_paeth_first
+   F_none=0, F_sub=1, F_up=2, F_avg=3, F_paeth=4
 };
 
-static uint8 first_row_filter[5] =
+// written as selects rather than branches, which noisy images mispredict
+static int paeth(int a, int b, int c)
 {
-   F_none, F_sub, F_none, F_avg_first, F_paeth_first
-};
+   int pa = abs(b-c); // |p-a| for p = a+b-c
+   int pb = abs(a-c);
+   int pc = abs(a+b-c-c);
+   int t = pb <= pc ? b : c;
+   return pa <= (pb < pc ? pb : pc) ? a : t;
+}
+
+#ifdef STBI_SSE2
+// Sub: within a register the result is a prefix sum over its pixels, done
+// in log steps, with the last pixel of the register before added to the
+// first. Returns the number of bytes done.
+static uint32 sub_row_sse2(uint8 *cur, uint8 const *raw, uint32 len, int n)
+{
+   __m128i last = _mm_setzero_si128(), v;
+   uint32 i=0;
+   #define SUB_LOAD() v = _mm_add_epi8(_mm_loadu_si128((__m128i const *) (raw+i)), last)
+   #define SUB_STEP(k) v = _mm_add_epi8(v, _mm_slli_si128(v, k))
+   #define SUB_STORE() _mm_storeu_si128((__m128i *) (cur+i), v)
+   switch (n) {
+      case 1:
+         for (; i+16 <= len; i += 16) {
+            SUB_LOAD(); SUB_STEP(1); SUB_STEP(2); SUB_STEP(4); SUB_STEP(8); SUB_STORE();
+            last = _mm_srli_si128(v, 15);
+         }
+         break;
+      case 2:
+         for (; i+16 <= len; i += 16) {
+            SUB_LOAD(); SUB_STEP(2); SUB_STEP(4); SUB_STEP(8); SUB_STORE();
+            last = _mm_srli_si128(v, 14);
+         }
+         break;
+      case 3:
+         // four pixels a register; the store's last 4 bytes are redone next
+         for (; i+16 <= len; i += 12) {
+            SUB_LOAD(); SUB_STEP(3); SUB_STEP(6); SUB_STORE();
+            last = _mm_srli_si128(_mm_slli_si128(v, 4), 13);
+         }
+         break;
+      case 4:
+         for (; i+16 <= len; i += 16) {
+            SUB_LOAD(); SUB_STEP(4); SUB_STEP(8); SUB_STORE();
+            last = _mm_srli_si128(v, 12);
+         }
+         break;
+      case 8:
+         for (; i+16 <= len; i += 16) {
+            SUB_LOAD(); SUB_STEP(8); SUB_STORE();
+            last = _mm_srli_si128(v, 8);
+         }
+         break;
+   }
+   #undef SUB_LOAD
+   #undef SUB_STEP
+   #undef SUB_STORE
+   return i;
+}
 
-static int paeth(int a, int b, int c)
+// Average and Paeth depend on the pixel just done, so these go a pixel at a
+// time, its channels side by side in a register. Even so that beats the
+// scalar loops, for grey too. Each pixel moves as 4 bytes, or as 8 for the
+// 6- and 8-byte pixels of 16-bit color; with fewer channels the rest is
+// junk that the next pixel overwrites.
+static __m128i load_pixel(uint8 const *p)
 {
-   int p = a + b - c;
-   int pa = abs(p-a);
-   int pb = abs(p-b);
-   int pc = abs(p-c);
-   if (pa <= pb && pa <= pc) return a;
-   if (pb <= pc) return b;
-   return c;
+   int v;
+   memcpy(&v, p, 4);
+   return _mm_cvtsi32_si128(v);
+}
+
+static void store_pixel(uint8 *p, __m128i x)
+{
+   int v = _mm_cvtsi128_si32(x);
+   memcpy(p, &v, 4);
+}
+
+// pavgb rounds up; take off the odd bit to round down
+static __m128i avg_pixel(__m128i left, __m128i b)
+{
+   return _mm_sub_epi8(_mm_avg_epu8(left, b), _mm_and_si128(_mm_xor_si128(left, b), _mm_set1_epi8(1)));
+}
+
+static uint32 avg_row_sse2(uint8 *cur, uint8 const *prior, uint8 const *raw, uint32 len, int n)
+{
+   __m128i left = _mm_setzero_si128();
+   uint32 i=0;
+   if (n > 4) {
+      for (; i+8 <= len; i += n) {
+         left = _mm_add_epi8(_mm_loadl_epi64((__m128i const *) (raw+i)),
+                             avg_pixel(left, _mm_loadl_epi64((__m128i const *) (prior+i))));
+         _mm_storel_epi64((__m128i *) (cur+i), left);
+      }
+      return i;
+   }
+   for (; i+4 <= len; i += n) {
+      left = _mm_add_epi8(load_pixel(raw+i), avg_pixel(left, load_pixel(prior+i)));
+      store_pixel(cur+i, left);
+   }
+   return i;
+}
+
+// the Paeth predictor of each channel, from a (left), b (above) and c
+// (above left) widened to 16 bits, plus x, the filtered pixel; the result
+// is the unfiltered pixel, still 16 bits a channel
+static __m128i paeth_pixel(__m128i a, __m128i b, __m128i c, __m128i x)
+{
+   __m128i zero = _mm_setzero_si128(), pa, pb, pc, m, t;
+   pa = _mm_sub_epi16(b, c);
+   pb = _mm_sub_epi16(a, c);
+   pc = _mm_add_epi16(pa, pb);
+   pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+   pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+   // b, or c if that's nearer; then a unless either is nearer than it
+   m = _mm_cmpgt_epi16(pb, pc);
+   t = _mm_or_si128(_mm_and_si128(m, c), _mm_andnot_si128(m, b));
+   m = _mm_cmpgt_epi16(pa, _mm_min_epi16(pb, pc));
+   t = _mm_or_si128(_mm_and_si128(m, t), _mm_andnot_si128(m, a));
+   return _mm_and_si128(_mm_add_epi16(t, x), _mm_set1_epi16(255));
+}
+
+static uint32 paeth_row_sse2(uint8 *cur, uint8 const *prior, uint8 const *raw, uint32 len, int n)
+{
+   __m128i zero = _mm_setzero_si128(), a = zero, b, c = zero;
+   uint32 i=0;
+   if (n > 4) {
+      for (; i+8 <= len; i += n) {
+         b = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (prior+i)), zero);
+         a = paeth_pixel(a, b, c, _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (raw+i)), zero));
+         _mm_storel_epi64((__m128i *) (cur+i), _mm_packus_epi16(a, a));
+         c = b;
+      }
+      return i;
+   }
+   for (; i+4 <= len; i += n) {
+      b = _mm_unpacklo_epi8(load_pixel(prior+i), zero);
+      a = paeth_pixel(a, b, c, _mm_unpacklo_epi8(load_pixel(raw+i), zero));
+      store_pixel(cur+i, _mm_packus_epi16(a, a));
+      c = b;
+   }
+   return i;
+}
+#endif
+
+// Undo the filter on a row of len bytes of n-byte pixels, given the row
+// above. That is all zeros for the first row, which makes each filter
+// reduce to the one the spec gives for it there.
+static void unfilter_row(uint8 *cur, uint8 const *prior, uint8 const *raw, int filter, uint32 len, int n)
+{
+   uint32 i=0, first = (uint32) n < len ? (uint32) n : len;
+   switch (filter) {
+      case F_none:
+         memcpy(cur, raw, len);
+         break;
+      case F_sub:
+         #ifdef STBI_SSE2
+         i = sub_row_sse2(cur, raw, len, n);
+         #endif
+         for (; i < first; ++i) cur[i] = raw[i];
+         for (; i < len; ++i) cur[i] = raw[i] + cur[i-n];
+         break;
+      case F_up:
+         #ifdef STBI_SSE2
+         for (; i+16 <= len; i += 16)
+            _mm_storeu_si128((__m128i *) (cur+i), _mm_add_epi8(_mm_loadu_si128((__m128i const *) (raw+i)),
+                                                                _mm_loadu_si128((__m128i const *) (prior+i))));
+         #endif
+         for (; i < len; ++i) cur[i] = raw[i] + prior[i];
+         break;
+      case F_avg:
+         #ifdef STBI_SSE2
+         i = avg_row_sse2(cur, prior, raw, len, n);
+         #endif
+         for (; i < first; ++i) cur[i] = raw[i] + (prior[i]>>1);
+         for (; i < len; ++i) cur[i] = raw[i] + ((prior[i] + cur[i-n])>>1);
+         break;
+      case F_paeth:
+         #ifdef STBI_SSE2
+         i = paeth_row_sse2(cur, prior, raw, len, n);
+         #endif
+         for (; i < first; ++i) cur[i] = raw[i] + prior[i];
+         for (; i < len; ++i) cur[i] = (uint8) (raw[i] + paeth(cur[i-n], prior[i], prior[i-n]));
+         break;
+   }
 }
 
 // create the png data from post-deflated data
@@ -2445,78 +3522,82 @@ static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, u
    stbi *s = a->s;
    uint32 i,j,stride = x*out_n;
    int k;
-   int img_n = s->img_n; // copy it into a local for later
-   assert(out_n == s->img_n || out_n == s->img_n+1);
+   int img_n = s->img_n * a->depth / 8; // bytes a pixel, copied into a local for later
+   uint32 len = x*img_n; // bytes of a row, without the filter type
+   // rows that don't go straight to the output are unfiltered through a
+   // two-row window; otherwise this is just the zero row above the first
+   int window = (a->final && img_n > 1) || img_n != out_n;
+   uint8 *rows;
+   assert(out_n == img_n || out_n == img_n+1);
    if (stbi_png_partial) y = 1;
-   a->out = (uint8 *) malloc(x * y * out_n);
-   if (!a->out) return e("outofmem", "Out of memory");
+   if (a->final && img_n > 1) {
+      // keep only the luminance of each row, instead of converting a
+      // full-size image afterwards
+      assert(out_n == img_n);
+      a->out = (uint8 *) malloc(x * y);
+   } else {
+      a->out = (uint8 *) malloc(x * y * out_n);
+   }
+   rows = (uint8 *) calloc(window ? 2 : 1, len);
+   if (!a->out || !rows) { free(rows); return e("outofmem", "Out of memory"); }
+   // non-interlaced rows past the row limit are left undefined (and the
+   // shorter y takes the less strict length check below)
+   if (row_limit && s->img_x == x && s->img_y == y && (uint32) row_limit < y) y = row_limit;
    if (!stbi_png_partial) {
       if (s->img_x == x && s->img_y == y) {
-         if (raw_len != (img_n * x + 1) * y) return e("not enough pixels","Corrupt PNG");
+         if (raw_len != (img_n * x + 1) * y) { free(rows); return e("not enough pixels","Corrupt PNG"); }
       } else { // interlaced:
-         if (raw_len < (img_n * x + 1) * y) return e("not enough pixels","Corrupt PNG");
+         if (raw_len < (img_n * x + 1) * y) { free(rows); return e("not enough pixels","Corrupt PNG"); }
       }
    }
    for (j=0; j < y; ++j) {
-      uint8 *cur = a->out + stride*j;
-      uint8 *prior = cur - stride;
+      uint8 *row = a->out + stride*j;
+      uint8 *cur = window ? rows + len*(j&1) : row;
+      uint8 *prior = window ? rows + len*((j+1)&1) : j ? row - stride : rows;
       int filter = *raw++;
-      if (filter > 4) return e("invalid filter","Corrupt PNG");
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-      // handle first pixel explicitly
-      for (k=0; k < img_n; ++k) {
-         switch (filter) {
-            case F_none       : cur[k] = raw[k]; break;
-            case F_sub        : cur[k] = raw[k]; break;
-            case F_up         : cur[k] = raw[k] + prior[k]; break;
-            case F_avg        : cur[k] = raw[k] + (prior[k]>>1); break;
-            case F_paeth      : cur[k] = (uint8) (raw[k] + paeth(0,prior[k],0)); break;
-            case F_avg_first  : cur[k] = raw[k]; break;
-            case F_paeth_first: cur[k] = raw[k]; break;
+      if (filter > 4) { free(rows); return e("invalid filter","Corrupt PNG"); }
+      unfilter_row(cur, prior, raw, filter, len, img_n);
+      raw += len;
+      if (img_n != out_n) {
+         // add opaque alpha
+         for (i=0; i < x; ++i, row += out_n, cur += img_n) {
+            for (k=0; k < img_n; ++k) row[k] = cur[k];
+            row[img_n] = 255;
          }
+         row = a->out + stride*j;
       }
-      if (img_n != out_n) cur[img_n] = 255;
-      raw += img_n;
-      cur += out_n;
-      prior += out_n;
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (img_n == out_n) {
-         #define CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, raw+=img_n,cur+=img_n,prior+=img_n) \
-                   for (k=0; k < img_n; ++k)
-         switch (filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-img_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-img_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],prior[k],prior[k-img_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-img_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],0,0)); break;
-         }
-         #undef CASE
-      } else {
-         assert(img_n+1 == out_n);
-         #define CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
-                   for (k=0; k < img_n; ++k)
-         switch (filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-out_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-out_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],prior[k],prior[k-out_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-out_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],0,0)); break;
+      if (a->final) {
+         if (window) {
+            row = a->out + x*j;
+            luma_row(row, cur, x, img_n);
          }
-         #undef CASE
+         if (row_callback) row_callback(row_callback_user, j, row, x);
       }
    }
+   free(rows);
    return 1;
 }
 
+// size of the filtered image data, with n bytes a pixel, so it can be
+// inflated into a buffer of the right size rather than one that keeps growing
+static int png_raw_size(stbi *s, int n, int interlaced)
+{
+   int p,x,y,size=0;
+   if (!interlaced)
+      return (n * s->img_x + 1) * s->img_y;
+   for (p=0; p < 7; ++p) {
+      int xorig[] = { 0,4,0,2,0,1,0 };
+      int yorig[] = { 0,0,4,0,2,0,1 };
+      int xspc[]  = { 8,8,4,4,2,2,1 };
+      int yspc[]  = { 8,8,8,4,4,2,2 };
+      x = (s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
+      y = (s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
+      if (x && y)
+         size += (x * n + 1) * y;
+   }
+   return size;
+}
+
 static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int interlaced)
 {
    uint8 *final;
@@ -2558,14 +3639,11 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int i
    return 1;
 }
 
-static int compute_transparency(png *z, uint8 tc[3], int out_n)
+// compute color-based transparency for pixel_count pixels, assuming we've
+// already got 255 as the alpha value
+static void transparency_row(uint8 *p, uint32 pixel_count, uint8 const *tc, int out_n)
 {
-   stbi *s = z->s;
-   uint32 i, pixel_count = s->img_x * s->img_y;
-   uint8 *p = z->out;
-
-   // compute color-based transparency, assuming we've
-   // already got 255 as the alpha value in the output
+   uint32 i;
    assert(out_n == 2 || out_n == 4);
 
    if (out_n == 2) {
@@ -2580,20 +3658,98 @@ static int compute_transparency(png *z, uint8 tc[3], int out_n)
          p += 4;
       }
    }
+}
+
+static int compute_transparency(png *z, uint8 tc[3], int out_n)
+{
+   transparency_row(z->out, z->s->img_x * z->s->img_y, tc, out_n);
    return 1;
 }
 
-static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+// narrow x pixels of n big-endian 16-bit samples to 8 bits, the high byte
+// of each, adding alpha if out_n is n+1: opaque, or clear where the pixel
+// is the transparent color tc (unless that is NULL). out may be in
+static void narrow_row(uint8 *out, uint8 const *in, uint32 x, int n, int out_n, uint16 const *tc)
 {
-   uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   uint8 *p, *temp_out, *orig = a->out;
+   uint32 i;
+   int k, clear;
+   if (out_n == n) {
+      for (i=0; i < x*n; ++i) out[i] = in[2*i];
+      return;
+   }
+   for (i=0; i < x; ++i, in += 2*n, out += out_n) {
+      clear = tc != NULL;
+      for (k=0; k < n; ++k) {
+         if (tc && ((in[2*k] << 8) | in[2*k+1]) != tc[k]) clear = 0;
+         out[k] = in[2*k];
+      }
+      out[n] = clear ? 0 : 255;
+   }
+}
 
-   p = (uint8 *) malloc(pixel_count * pal_img_n);
-   if (p == NULL) return e("outofmem", "Out of memory");
+// the same, keeping all 16 bits as native unsigned shorts
+static void widen_row(uint16 *out, uint8 const *in, uint32 x, int n, int out_n, uint16 const *tc)
+{
+   uint32 i;
+   int k, clear;
+   if (out_n == n) {
+      for (i=0; i < x*n; ++i) out[i] = (uint16) ((in[2*i] << 8) | in[2*i+1]);
+      return;
+   }
+   for (i=0; i < x; ++i, in += 2*n, out += out_n) {
+      clear = tc != NULL;
+      for (k=0; k < n; ++k) {
+         out[k] = (uint16) ((in[2*k] << 8) | in[2*k+1]);
+         if (tc && out[k] != tc[k]) clear = 0;
+      }
+      out[n] = clear ? 0 : 65535;
+   }
+}
 
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
+// hand over the rows of the whole image in z->out, of 16-bit pixels of n
+// big-endian samples, keeping all 16 bits, for stbi_load_rows on an image
+// that has to be inflated whole (interlaced); alpha is added as for a
+// whole image if out_n is n+1. the row limit applies
+static int png_wide_rows(png *z, int n, int out_n, uint16 const *tc, int req_comp)
+{
+   stbi *s = z->s;
+   uint32 j, rows = row_limit && (uint32) row_limit < s->img_y ? (uint32) row_limit : s->img_y;
+   uint16 *pix = (uint16 *) malloc(s->img_x * 4 * 2);
+   uint16 *out = (uint16 *) malloc(s->img_x * 4 * 2);
+   uint16 const *row;
+   int k;
+   if (!pix || !out) { free(pix); free(out); return e("outofmem", "Out of memory"); }
+   *z->x = s->img_x;
+   *z->y = s->img_y;
+   if (z->comp) *z->comp = s->img_n;
+   bits_applied = 16;
+   rows_streamed = 1;
+   for (j=0; j < rows; ++j) {
+      widen_row(pix, z->out + j * s->img_x * n * 2, s->img_x, n, out_n, tc);
+      row = pix;
+      k = out_n;
+      if (req_comp && req_comp != k) {
+         convert_row16(out, pix, k, req_comp, s->img_x);
+         row = out;
+         k = req_comp;
+      }
+      if (row_callback) row_callback(row_callback_user, j, (uint8 const *) row, 2 * k * s->img_x);
+      // the callback may have lowered the row limit
+      if (row_limit && (uint32) row_limit < rows)
+         rows = (uint32) row_limit > j+1 ? (uint32) row_limit : j+1;
+   }
+   // what do_png returns isn't used, so it needn't be converted
+   free(z->out);
+   z->out = (uint8 *) pix;
+   s->img_out_n = req_comp ? req_comp : out_n;
+   free(out);
+   return 1;
+}
 
+// look up pixel_count palette indices in orig, writing pal_img_n components
+static void palette_row(uint8 *p, uint8 const *orig, uint32 pixel_count, uint8 const *palette, int pal_img_n)
+{
+   uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -2612,14 +3768,230 @@ static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
          p += 4;
       }
    }
+}
+
+static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+{
+   uint32 pixel_count = a->s->img_x * a->s->img_y;
+   uint8 *p;
+
+   p = (uint8 *) malloc(pixel_count * pal_img_n);
+   if (p == NULL) return e("outofmem", "Out of memory");
+   palette_row(p, a->out, pixel_count, palette, pal_img_n);
    free(a->out);
-   a->out = temp_out;
+   a->out = p;
 
    STBI_NOTUSED(len);
 
    return 1;
 }
 
+// State for stbi_load_rows on a non-interlaced PNG: IDAT data is read a
+// piece at a time as inflate asks for it, and whenever inflate's output
+// window fills, the rows in it are unfiltered, converted and handed over.
+typedef struct
+{
+   png *p;
+   uint32 left;            // bytes of the current IDAT chunk not read yet
+   int ended;              // past the last IDAT chunk
+   int failed;             // couldn't read the rest of the file
+   int done;               // all the rows wanted are handed over
+   uint32 len;             // bytes of a row, without the filter type
+   uint32 next;            // offset in the window of the first row not done
+   uint32 y, rows;         // rows done, and rows wanted
+   uint8 *in;              // a piece of IDAT data
+   uint8 *cur, *prior;     // unfiltered rows
+   uint8 *pix;             // the row with alpha or the palette applied
+   uint8 *out;             // the row as asked for
+   uint8 const *palette;
+   uint8 const *tc;        // transparent color, or NULL
+   uint16 const *tc16;     // the same for 16-bit samples
+   int bytes;              // bytes a sample: 1, or 2 for 16 bits
+   int pal_img_n, out_n, req_comp;
+} png_rows;
+
+#define PNG_ROWS_IN 65536
+
+static int png_rows_more(zbuf *z)
+{
+   png_rows *r = (png_rows *) z->user;
+   stbi *s = r->p->s;
+   uint32 n;
+   while (r->left == 0) {
+      chunk c;
+      if (r->ended) return 0;
+      get32(s); // CRC of the chunk done
+      c = get_chunk_header(s);
+      if (c.type != PNG_TYPE('I','D','A','T')) {
+         // whatever follows doesn't matter for the rows
+         r->ended = 1;
+         return 0;
+      }
+      r->left = c.length;
+   }
+   n = r->left < PNG_ROWS_IN ? r->left : PNG_ROWS_IN;
+   if (!getn(s, r->in, n)) {
+      r->ended = r->failed = 1;
+      return e("outofdata","Corrupt PNG");
+   }
+   r->left -= n;
+   z->zbuffer = r->in;
+   z->zbuffer_end = r->in + n;
+   return 1;
+}
+
+// unfilter, convert and hand over the whole rows in the window
+static int png_rows_flush(zbuf *z)
+{
+   png_rows *r = (png_rows *) z->user;
+   stbi *s = r->p->s;
+   uint8 *raw = (uint8 *) z->zout_start + r->next, *row, *t;
+   int n, wide;
+   if (r->failed) return 0;
+   while ((uint32) ((uint8 *) z->zout - raw) > r->len && r->y < r->rows) {
+      if (*raw > 4) return e("invalid filter","Corrupt PNG");
+      unfilter_row(r->cur, r->prior, raw+1, *raw, r->len, s->img_n * r->bytes);
+      raw += r->len + 1;
+      row = r->cur;
+      n = s->img_n;
+      wide = 0;
+      if (r->bytes == 2) {
+         // kept 16 bits a sample, or narrowed to 8; alpha added either way
+         wide = bits_applied == 16;
+         if (wide)
+            widen_row((uint16 *) r->pix, row, s->img_x, n, r->out_n, r->tc16);
+         else
+            narrow_row(r->pix, row, s->img_x, n, r->out_n, r->tc16);
+         row = r->pix;
+         n = r->out_n;
+      } else if (r->pal_img_n) {
+         palette_row(r->pix, row, s->img_x, r->palette, r->out_n);
+         row = r->pix;
+         n = r->out_n;
+      } else if (r->out_n != n) {
+         uint32 i;
+         int k;
+         for (i=0; i < s->img_x; ++i) {
+            for (k=0; k < n; ++k) r->pix[i*r->out_n+k] = row[i*n+k];
+            r->pix[i*r->out_n+n] = 255;
+         }
+         if (r->tc) transparency_row(r->pix, s->img_x, r->tc, r->out_n);
+         row = r->pix;
+         n = r->out_n;
+      }
+      if (r->req_comp && r->req_comp != n) {
+         if (wide)
+            convert_row16((uint16 *) r->out, (uint16 const *) row, n, r->req_comp, s->img_x);
+         else
+            convert_row(r->out, row, n, r->req_comp, s->img_x);
+         row = r->out;
+         n = r->req_comp;
+      }
+      if (row_callback) row_callback(row_callback_user, r->y, row, (wide ? 2 : 1) * n * s->img_x);
+      ++r->y;
+      t = r->prior; r->prior = r->cur; r->cur = t;
+      // the callback may have lowered the row limit
+      if (row_limit && (uint32) row_limit < r->rows)
+         r->rows = (uint32) row_limit > r->y ? (uint32) row_limit : r->y;
+   }
+   r->next = (uint32) (raw - (uint8 *) z->zout_start);
+   return 1;
+}
+
+static int png_rows_drain(zbuf *z, int n)
+{
+   png_rows *r = (png_rows *) z->user;
+   char *keep;
+   if (!png_rows_flush(z)) return 0;
+   if (r->y == r->rows) {
+      // more data than rows, which only a row limit allows
+      if (r->rows == r->p->s->img_y) return e("not enough pixels","Corrupt PNG");
+      r->done = 1;
+      return 0;
+   }
+   // keep the row in progress and the 32K matches can refer to
+   keep = z->zout - 32768;
+   if (keep > z->zout_start + r->next) keep = z->zout_start + r->next;
+   if (keep < z->zout_start) keep = z->zout_start;
+   memmove(z->zout_start, keep, z->zout - keep);
+   r->next -= (uint32) (keep - z->zout_start);
+   z->zout -= keep - z->zout_start;
+   if (z->zout + n > z->zout_end) return e("output buffer limit","Corrupt PNG");
+   return 1;
+}
+
+// decode from the first IDAT chunk (of length first) on, a row at a time
+static int png_load_rows(png *a, uint32 first, uint8 const *palette, int pal_img_n, uint8 const *tc, uint16 const *tc16, int req_comp)
+{
+   stbi *s = a->s;
+   png_rows r;
+   zbuf z;
+   uint8 *rows;
+   int window, ok;
+   r.p = a;
+   r.left = first;
+   r.ended = 0;
+   r.failed = 0;
+   r.done = 0;
+   r.bytes = a->depth / 8;
+   r.len = s->img_x * s->img_n * r.bytes;
+   r.next = 0;
+   r.y = 0;
+   r.rows = row_limit && (uint32) row_limit < s->img_y ? (uint32) row_limit : s->img_y;
+   r.palette = palette;
+   r.tc = tc;
+   r.tc16 = tc16;
+   r.pal_img_n = pal_img_n;
+   r.req_comp = req_comp;
+   // the components before any conversion, as for a whole image
+   if (pal_img_n)
+      r.out_n = req_comp >= 3 ? req_comp : pal_img_n;
+   else if ((req_comp == s->img_n+1 && req_comp != 3) || tc)
+      r.out_n = s->img_n+1;
+   else
+      r.out_n = s->img_n;
+   // room for the matches to refer back to, and for a row and a stored
+   // block's piece on top of that
+   window = 65536 + 2 * (r.len + 1);
+   r.in = (uint8 *) malloc(PNG_ROWS_IN);
+   rows = (uint8 *) calloc(2, r.len);
+   r.pix = (uint8 *) malloc(s->img_x * 4 * r.bytes);
+   a->out = (uint8 *) malloc(s->img_x * 4 * r.bytes);
+   z.zout_start = (char *) malloc(window);
+   if (!r.in || !rows || !r.pix || !a->out || !z.zout_start) {
+      free(r.in); free(rows); free(r.pix); free(z.zout_start);
+      return e("outofmem", "Out of memory");
+   }
+   r.cur = rows;
+   r.prior = rows + r.len; // all zeros above the first row
+   r.out = a->out;
+
+   s->img_out_n = req_comp ? req_comp : r.out_n;
+   *a->x = s->img_x;
+   *a->y = s->img_y;
+   if (a->comp) *a->comp = pal_img_n ? pal_img_n : s->img_n;
+   if (r.bytes == 2) bits_applied = bits_wanted;
+   rows_streamed = 1;
+
+   z.zbuffer = z.zbuffer_end = r.in;
+   z.zout = z.zout_start;
+   z.zout_end = z.zout_start + window;
+   z.z_expandable = 0;
+   z.more = png_rows_more;
+   z.drain = png_rows_drain;
+   z.user = &r;
+   ok = parse_zlib(&z, 1);
+   if (ok) {
+      ok = png_rows_flush(&z);
+      if (ok && (r.y < r.rows || (r.rows == s->img_y && z.zout != z.zout_start + r.next)))
+         ok = e("not enough pixels","Corrupt PNG");
+   } else if (r.done)
+      ok = 1;
+   if (pal_img_n) s->img_n = pal_img_n;
+   free(r.in); free(rows); free(r.pix); free(z.zout_start);
+   return ok;
+}
+
 static int stbi_unpremultiply_on_load = 0;
 static int stbi_de_iphone_flag = 0;
 
@@ -2678,6 +4050,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
 {
    uint8 palette[1024], pal_img_n=0;
    uint8 has_trans=0, tc[3];
+   uint16 tc16[3];
    uint32 ioff=0, idata_limit=0, i, pal_len=0;
    int first=1,k,interlace=0, iphone=0;
    stbi *s = z->s;
@@ -2698,28 +4071,33 @@ static int parse_png_file(png *z, int scan, int req_comp)
             skip(s, c.length);
             break;
          case PNG_TYPE('I','H','D','R'): {
-            int depth,color,comp,filter;
+            int depth,color,comp,filter,whole;
             if (!first) return e("multiple IHDR","Corrupt PNG");
             first = 0;
             if (c.length != 13) return e("bad IHDR len","Corrupt PNG");
             s->img_x = get32(s); if (s->img_x > (1 << 24)) return e("too large","Very large image (corrupt?)");
             s->img_y = get32(s); if (s->img_y > (1 << 24)) return e("too large","Very large image (corrupt?)");
-            depth = get8(s);  if (depth != 8)        return e("8bit only","PNG not supported: 8-bit only");
+            depth = get8(s);  if (depth != 8 && depth != 16) return e("8/16bit only","PNG not supported: 8-bit or 16-bit only");
             color = get8(s);  if (color > 6)         return e("bad ctype","Corrupt PNG");
             if (color == 3) pal_img_n = 3; else if (color & 1) return e("bad ctype","Corrupt PNG");
+            if (pal_img_n && depth != 8) return e("bad ctype","Corrupt PNG");
+            z->depth = depth;
             comp  = get8(s);  if (comp) return e("bad comp method","Corrupt PNG");
             filter= get8(s);  if (filter) return e("bad filter method","Corrupt PNG");
             interlace = get8(s); if (interlace>1) return e("bad interlace method","Corrupt PNG");
             if (!s->img_x || !s->img_y) return e("0-pixel image","Corrupt PNG");
+            // only a whole image is limited in size: a header scan holds
+            // nothing, and stbi_load_rows a few rows of a non-interlaced one
+            whole = scan == SCAN_load && !(rows_only && !interlace && !iphone);
             if (!pal_img_n) {
                s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
-               if ((1 << 30) / s->img_x / s->img_n < s->img_y) return e("too large", "Image too large to decode");
+               if (whole && (1 << 30) / s->img_x / (s->img_n * depth / 8) < s->img_y) return e("too large", "Image too large to decode");
                if (scan == SCAN_header) return 1;
             } else {
                // if paletted, then pal_n is our final components, and
                // img_n is # components to decompress/filter.
                s->img_n = 1;
-               if ((1 << 30) / s->img_x / 4 < s->img_y) return e("too large","Corrupt PNG");
+               if (whole && (1 << 30) / s->img_x / 4 < s->img_y) return e("too large","Corrupt PNG");
                // if SCAN_header, have to scan to see if we have a tRNS
             }
             break;
@@ -2753,8 +4131,10 @@ static int parse_png_file(png *z, int scan, int req_comp)
                if (!(s->img_n & 1)) return e("tRNS with alpha","Corrupt PNG");
                if (c.length != (uint32) s->img_n*2) return e("bad tRNS len","Corrupt PNG");
                has_trans = 1;
-               for (k=0; k < s->img_n; ++k)
-                  tc[k] = (uint8) get16(s); // non 8-bit images will be larger
+               for (k=0; k < s->img_n; ++k) {
+                  tc16[k] = (uint16) get16(s);
+                  tc[k] = (uint8) tc16[k]; // for 8-bit images
+               }
             }
             break;
          }
@@ -2763,6 +4143,8 @@ static int parse_png_file(png *z, int scan, int req_comp)
             if (first) return e("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return e("no PLTE","Corrupt PNG");
             if (scan == SCAN_header) { s->img_n = pal_img_n; return 1; }
+            if (rows_only && !interlace && !iphone && !z->idata)
+               return png_load_rows(z, c.length, palette, pal_img_n, has_trans ? tc : NULL, has_trans ? tc16 : NULL, req_comp);
             if (ioff + c.length > idata_limit) {
                uint8 *p;
                if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
@@ -2778,19 +4160,43 @@ static int parse_png_file(png *z, int scan, int req_comp)
 
          case PNG_TYPE('I','E','N','D'): {
             uint32 raw_len;
+            int bytes = z->depth / 8;
             if (first) return e("first not IHDR", "Corrupt PNG");
             if (scan != SCAN_load) return 1;
             if (z->idata == NULL) return e("no IDAT","Corrupt PNG");
-            z->expanded = (uint8 *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, 16384, (int *) &raw_len, !iphone);
+            // rows are stored in order unless interlaced, so later rows need not be inflated
+            if (row_limit && !interlace && (uint32) row_limit < s->img_y)
+               zlib_limit = (s->img_n * bytes * s->img_x + 1) * row_limit;
+            z->expanded = (uint8 *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, png_raw_size(s, s->img_n * bytes, interlace), (int *) &raw_len, !iphone);
+            zlib_limit = 0;
             if (z->expanded == NULL) return 0; // zlib should set error
             free(z->idata); z->idata = NULL;
+            if (req_comp == 1 && !pal_img_n && !iphone && !interlace && bytes == 1) {
+               // grey is all that's wanted and rows come out in order, so
+               // make it as they're unfiltered; transparency doesn't matter
+               z->final = 1;
+               if (!create_png_image(z, z->expanded, raw_len, s->img_n, interlace)) return 0;
+               s->img_out_n = 1;
+               free(z->expanded); z->expanded = NULL;
+               return 1;
+            }
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace)) return 0;
-            if (has_trans)
-               if (!compute_transparency(z, tc, s->img_out_n)) return 0;
+            if (bytes == 2) {
+               // unfilter whole 16-bit pixels, then narrow them in place,
+               // matching the transparent color before it is narrowed; or
+               // hand rows that ask for 16 bits over as they are
+               if (!create_png_image(z, z->expanded, raw_len, s->img_n * 2, interlace)) return 0;
+               if (rows_only && bits_wanted == 16 && !iphone)
+                  return png_wide_rows(z, s->img_n, s->img_out_n, has_trans ? tc16 : NULL, req_comp);
+               narrow_row(z->out, z->out, s->img_x * s->img_y, s->img_n, s->img_out_n, has_trans ? tc16 : NULL);
+            } else {
+               if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace)) return 0;
+               if (has_trans)
+                  if (!compute_transparency(z, tc, s->img_out_n)) return 0;
+            }
             if (iphone && s->img_out_n > 2)
                stbi_de_iphone(z);
             if (pal_img_n) {
@@ -2831,6 +4237,9 @@ static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
 {
    unsigned char *result=NULL;
    if (req_comp < 0 || req_comp > 4) return epuc("bad req_comp", "Internal error");
+   p->x = x;
+   p->y = y;
+   p->comp = n;
    if (parse_png_file(p, SCAN_load, req_comp)) {
       result = p->out;
       p->out = NULL;
@@ -2854,6 +4263,7 @@ static unsigned char *stbi_png_load(stbi *s, int *x, int *y, int *comp, int req_
 {
    png p;
    p.s = s;
+   p.final = 0;
    return do_png(&p, x,y,comp,req_comp);
 }
 
@@ -2881,6 +4291,7 @@ static int      stbi_png_info(stbi *s, int *x, int *y, int *comp)
 {
    png p;
    p.s = s;
+   p.final = 0;
    return stbi_png_info_raw(&p, x, y, comp);
 }
 
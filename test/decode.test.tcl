@@ -0,0 +1,171 @@
+package require Tcl 8.6
+package require tcltest 2
+namespace import ::tcltest::test
+
+# Use the test directory as the working directory for all tests.
+::tcltest::workingDirectory [file dirname [info script]]
+
+# Stow any temporary test files in a tmp subdirectory.
+::tcltest::configure -tmpdir tmp
+
+# Apply any additional configuration arguments.
+eval ::tcltest::configure $argv
+
+# Decoder regression tests. Each case converts a small image in sample/ and
+# compares a CRC of the STL output with one recorded when the decoder was
+# checked against other decoders (PIL for PNG, and the luma channel libjpeg
+# decodes for JPEG, within a level or two of rounding) and earlier builds.
+
+::tcltest::testConstraint has_hmstl [file executable ../hmstl]
+
+file mkdir [::tcltest::configure -tmpdir]
+
+# Converts with the given arguments; returns the CRC of the output in hex
+proc checksum {args} {
+	set path [file join [::tcltest::configure -tmpdir] decode.stl]
+	exec ../hmstl {*}$args -o $path
+	set f [open $path rb]
+	set crc [zlib crc32 [read $f]]
+	close $f
+	file delete $path
+	return [format %08x $crc]
+}
+
+# sample/jpeg-*.jpg are one 117x83 color image, whose blocks overhang the
+# right and bottom edges, with chroma at 4:4:4, 4:2:2 and 4:2:0, and each
+# again with a restart marker every three MCUs. The luma channel is coded
+# the same in all of them, and nothing else is decoded, so they all mesh
+# the same.
+
+test decode-jpeg-luma {
+# Luma of each chroma layout, with and without restart intervals
+} -constraints {
+	has_hmstl
+} -body {
+	set results {}
+	foreach layout {444 422 420 444-restart 422-restart 420-restart} {
+		lappend results [checksum -i sample/jpeg-$layout.jpg]
+	}
+	lsort -unique $results
+} -result 1cf81621
+
+test decode-jpeg-scale {
+# Reduced by 2, 4 and 8 while decoding, and by 3 after, with and without
+# subsampled chroma and restart intervals
+} -constraints {
+	has_hmstl
+} -body {
+	set results {}
+	foreach scale {2 3 4 8} {
+		lappend results [lsort -unique [list [checksum -i sample/jpeg-444.jpg -d $scale] \
+				[checksum -i sample/jpeg-420-restart.jpg -d $scale]]]
+	}
+	set results
+} -result {5102fdcb de5a60e0 e10290ca fdaba673}
+
+test decode-jpeg-threads {
+# Restart intervals decoded on one thread or several, at full size and
+# reduced, and sample/restart.jpg, which is greyscale with an interval for
+# each row of blocks
+} -constraints {
+	has_hmstl
+} -body {
+	set results {}
+	foreach scale {1 4} {
+		set checksums {}
+		foreach threads {1 2 3 4 8} {
+			foreach layout {444 422 420} {
+				lappend checksums [checksum -i sample/jpeg-$layout-restart.jpg -d $scale --threads $threads]
+			}
+		}
+		lappend results [lsort -unique $checksums]
+		set checksums {}
+		foreach threads {1 2 3 4 8} {
+			lappend checksums [checksum -i sample/restart.jpg -d $scale --threads $threads]
+		}
+		lappend results [lsort -unique $checksums]
+	}
+	set results
+} -result {1cf81621 fa2e67cd e10290ca 1c9300f1}
+
+# sample/png-stored.png, png-fixed.png and png-dynamic.png are one 97x61
+# greyscale image with each filter type, deflated in stored blocks (some
+# empty), in a fixed Huffman block, and in two dynamic Huffman blocks; and
+# png-split.png has it in IDAT chunks of 37 bytes, after an empty one.
+
+test decode-png-inflate {
+# Each deflate block type, and IDAT split across chunks, in full, reduced,
+# and stopping after a region of interest
+} -constraints {
+	has_hmstl
+} -body {
+	set results {}
+	foreach options {{} {-d 2} {-R 10,20,40,15}} {
+		set checksums {}
+		foreach blocks {stored fixed dynamic split} {
+			lappend checksums [checksum -i sample/png-$blocks.png {*}$options]
+		}
+		lappend results [lsort -unique $checksums]
+	}
+	set results
+} -result {931cf487 c40b92f9 d77c69bc}
+
+# sample/png-filters-*.png are 53x41 images with rows filtered by each
+# filter type in turn, in each of the pixel formats read: grey, grey with
+# alpha, RGB and RGBA, with 8 and 16-bit samples (so pixels of 1 to 8
+# bytes). Color is meshed by luminance; 16-bit samples are kept whole.
+
+test decode-png-filters {
+# Each filter type for each pixel size, in full and stopping after a region
+# of interest
+} -constraints {
+	has_hmstl
+} -body {
+	set results {}
+	foreach options {{} {-R 3,5,20,17}} {
+		foreach format {grey8 greyalpha8 rgb8 rgba8 grey16 greyalpha16 rgb16 rgba16} {
+			lappend results [checksum -i sample/png-filters-$format.png {*}$options]
+		}
+	}
+	set results
+} -result {33ae7e4d 30cf2ac9 25559e6d 308c146d fa3f13b9 16ea3515 59d5b405 63e33392\
+		6e50a48d 19d55347 a2dd13df 59c16590 e1d64426 357b2079 0a228c55 c6e43d36}
+
+# sample/png-interlaced-grey8.png and png-interlaced-rgb8.png are Adam7
+# interlaced 53x41 images, every pass of which is filtered with each filter
+# type; png-interlaced-tiny.png is 3x2, so that some passes are empty.
+
+test decode-png-interlaced {
+# Adam7, in full, reduced, and (for the larger ones) stopping after a region
+# of interest
+} -constraints {
+	has_hmstl
+} -body {
+	set results {}
+	foreach format {grey8 rgb8 tiny} {
+		lappend results [checksum -i sample/png-interlaced-$format.png] \
+				[checksum -i sample/png-interlaced-$format.png -d 2]
+	}
+	foreach format {grey8 rgb8} {
+		lappend results [checksum -i sample/png-interlaced-$format.png -R 3,5,20,17]
+	}
+	set results
+} -result {5946d0cb c6d93614 224358dd a38d4bba ca1aea65 a2272aee b6bf81df 2d6d6e96}
+
+# sample/png-interlaced-grey16.png is an Adam7 interlaced 53x41 image with
+# 16-bit samples, which are kept whole as they are for non-interlaced ones;
+# it meshes the same as PIL's non-interlaced copy of it.
+
+test decode-png-interlaced-16 {
+# 16-bit Adam7, in full, reduced, and stopping after a region of interest
+} -constraints {
+	has_hmstl
+} -body {
+	set results {}
+	foreach options {{} {-d 2} {-R 3,5,20,17}} {
+		lappend results [checksum -i sample/png-interlaced-grey16.png {*}$options]
+	}
+	set results
+} -result {3c9257a0 0713d40e 8b2f97ba}
+
+::tcltest::cleanupTests
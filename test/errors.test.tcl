@@ -0,0 +1,179 @@
+package require Tcl 8.5
+package require tcltest 2
+namespace import ::tcltest::test
+
+# Use the test directory as the working directory for all tests.
+::tcltest::workingDirectory [file dirname [info script]]
+
+# Stow any temporary test files in a tmp subdirectory.
+::tcltest::configure -tmpdir tmp
+
+# Apply any additional configuration arguments.
+eval ::tcltest::configure $argv
+
+# Damaged inputs: hmstl should report an error and exit with status 1,
+# leaving no output file, rather than crash or hang.
+
+::tcltest::testConstraint has_hmstl [file executable ../hmstl]
+::tcltest::testConstraint has_hmgen [file executable ../bench/hmgen]
+::tcltest::testConstraint has_timeout [expr {[auto_execok timeout] ne {}}]
+
+file mkdir [::tcltest::configure -tmpdir]
+
+# Write the first bytes bytes of file from to file to
+proc truncate {from to bytes} {
+	set f [open $from rb]
+	set data [read $f $bytes]
+	close $f
+	set f [open $to wb]
+	puts -nonewline $f $data
+	close $f
+}
+
+# Runs hmstl with the given arguments, killing it after ten seconds if it
+# hangs (with timeout, where there is one); returns its exit status, and
+# whether the output file exists
+proc hmstl {output args} {
+	file delete $output
+	set status 0
+	set command [list ../hmstl {*}$args -o $output]
+	if {[::tcltest::testConstraint has_timeout]} {
+		set command [list timeout 10 {*}$command]
+	}
+	if {[catch {exec {*}$command 2>@1} msg opts]} {
+		set code [dict get $opts -errorcode]
+		if {[lindex $code 0] eq "CHILDSTATUS"} {
+			set status [lindex $code 2]
+		} else {
+			set status $code
+		}
+	}
+	return [list $status [file exists $output]]
+}
+
+test errors-truncated-png {
+# A PNG that ends partway through is meshed as it is decoded; the meshers
+# and writer must stop before the raster is freed. Run several times, since
+# the meshers race the decoder.
+} -constraints {
+	has_hmstl has_hmgen
+} -setup {
+	set dir [::tcltest::configure -tmpdir]
+	exec ../bench/hmgen -k terrain -w 333 -h 211 -c 4 -o [file join $dir errors.png]
+	truncate [file join $dir errors.png] [file join $dir errors-truncated.png] \
+			[expr {[file size [file join $dir errors.png]] * 2 / 3}]
+} -body {
+	set results {}
+	for {set i 0} {$i < 20} {incr i} {
+		lappend results [hmstl [file join $dir errors.stl] -i [file join $dir errors-truncated.png]]
+	}
+	lsort -unique $results
+} -cleanup {
+	file delete [file join $dir errors.png] [file join $dir errors-truncated.png]
+} -result {{1 0}}
+
+test errors-truncated-jpeg-1 {
+# The first bytes of a JPEG: the header check must give up at the end of
+# the file rather than spin, and the decoder then reports the error.
+} -constraints {
+	has_hmstl has_timeout
+} -setup {
+	set dir [::tcltest::configure -tmpdir]
+	truncate ../tests/scene-thick-print.jpg [file join $dir errors.jpg] 30
+} -body {
+	hmstl [file join $dir errors.stl] -i [file join $dir errors.jpg]
+} -cleanup {
+	file delete [file join $dir errors.jpg]
+} -result {1 0}
+
+test errors-truncated-jpeg-2 {
+# A JPEG that ends partway through its quantization table.
+} -constraints {
+	has_hmstl has_timeout
+} -setup {
+	set dir [::tcltest::configure -tmpdir]
+	set f [open [file join $dir errors.jpg] wb]
+	puts -nonewline $f [binary format H* ffd8ffe000104a46494600010101004800480000ffdb004300080606070605080707070909080506]
+	close $f
+} -body {
+	hmstl [file join $dir errors.stl] -i [file join $dir errors.jpg]
+} -cleanup {
+	file delete [file join $dir errors.jpg]
+} -result {1 0}
+
+# sample/restart.jpg is greyscale with a restart marker after each row of
+# blocks; the corrupt ones are it, and a copy with a marker every three
+# blocks, with a few bytes of their entropy-coded data changed. Where the
+# bit reader leaves off decides whether a restart marker is seen, and what
+# the search for the marker after the scan meets; they fail there, as they
+# did before the reader kept 64 bits, rather than meshing garbage. They
+# fail the same with the intervals decoded on several threads.
+
+test errors-restart-1 {
+# The intact file converts.
+} -constraints {
+	has_hmstl has_timeout
+} -body {
+	hmstl [file join [::tcltest::configure -tmpdir] errors.stl] -i sample/restart.jpg
+} -cleanup {
+	file delete [file join [::tcltest::configure -tmpdir] errors.stl]
+} -result {0 1}
+
+test errors-restart-2 {
+# Corrupt intervals of a row of blocks.
+} -constraints {
+	has_hmstl has_timeout
+} -body {
+	set results {}
+	foreach threads {1 4} {
+		lappend results [hmstl [file join [::tcltest::configure -tmpdir] errors.stl] -i sample/restart-corrupt-1.jpg --threads $threads]
+	}
+	lsort -unique $results
+} -result {{1 0}}
+
+test errors-restart-3 {
+# Corrupt intervals of three blocks.
+} -constraints {
+	has_hmstl has_timeout
+} -body {
+	set results {}
+	foreach threads {1 4} {
+		lappend results [hmstl [file join [::tcltest::configure -tmpdir] errors.stl] -i sample/restart-corrupt-2.jpg --threads $threads]
+	}
+	lsort -unique $results
+} -result {{1 0}}
+
+test errors-corrupt-interlaced {
+# An interlaced PNG, which is inflated whole, with a byte of its deflate
+# data changed so that the stream runs past the end of its input: it must
+# fail there rather than inflate the zeros after it until memory runs out.
+} -constraints {
+	has_hmstl has_timeout
+} -setup {
+	set dir [::tcltest::configure -tmpdir]
+	set f [open sample/png-interlaced-grey16.png rb]
+	set data [read $f]
+	close $f
+	set f [open [file join $dir errors.png] wb]
+	puts -nonewline $f [string replace $data 4347 4347 \xe3]
+	close $f
+} -body {
+	hmstl [file join $dir errors.stl] -i [file join $dir errors.png]
+} -cleanup {
+	file delete [file join $dir errors.png]
+} -result {1 0}
+
+test errors-region {
+# Regions that are malformed, or lie partly or wholly outside the
+# 138x104 heightmap, including ones whose far edge overflows
+} -constraints {
+	has_hmstl has_timeout
+} -body {
+	set results {}
+	foreach region {-1,1,5,5 4294967295,0,2,5 0,4294967295,5,2 1,1,5,5x 1,1,+5,5 99999999999,0,1,1 0,0,139,104 1,103,5,2} {
+		lappend results [hmstl [file join [::tcltest::configure -tmpdir] errors.stl] -i ../tests/scene.png -R $region]
+	}
+	lsort -unique $results
+} -result {{1 0}}
+
+::tcltest::cleanupTests
@@ -0,0 +1,183 @@
+// Equivalence test driver for the JPEG kernels: runs randomized coefficient
+// blocks and YCbCr rows through stb_image's scalar idct_block and
+// YCbCr_to_RGB_row and through each kernel set this CPU supports, and
+// compares the output bytes. Exits 0 if all cases match, 1 on the first
+// mismatch (after describing it), 2 on other errors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#endif
+
+// the whole of stb_image is compiled here so its static scalar kernels can
+// be called directly
+#define STBI_SIMD
+#include "../stb_image.c"
+
+#include "../jpegsimd.h"
+
+static struct {
+	int cases; // number of randomized blocks and rows per kernel set
+	unsigned long seed; // random seed
+} CHECK = {
+	100000,
+	1
+};
+
+static unsigned long long rngstate;
+
+static unsigned int rng(void) {
+	rngstate ^= rngstate << 13;
+	rngstate ^= rngstate >> 7;
+	rngstate ^= rngstate << 17;
+	return (unsigned int)(rngstate >> 32);
+}
+
+// returns a random integer in -range..range
+static int srng(int range) {
+	return (int)(rng() % (unsigned int)(2 * range + 1)) - range;
+}
+
+// Returns a random coefficient for position i whose dequantized value is
+// within -range..range. (Larger values overflow the scalar IDCT; valid
+// 8-bit JPEG data stays well inside 16384.)
+static short coef(const unsigned short dq[64], int i, int range) {
+	return (short)srng(range / dq[i]);
+}
+
+// Fill a block with coefficients of the given kind (as decode_block would
+// leave them) and a dequantization table.
+static void makeblock(short data[64], unsigned short dq[64], int kind) {
+	int i, k;
+
+	for (i = 0; i < 64; i++) {
+		dq[i] = (unsigned short)(1 + rng() % 255);
+	}
+
+	memset(data, 0, 64 * sizeof(short));
+	switch (kind) {
+		case 0:
+			// DC only, which the scalar IDCT takes a shortcut for
+			data[0] = coef(dq, 0, 16384);
+			break;
+		case 1:
+			// a few low frequencies, as in smooth images
+			data[0] = coef(dq, 0, 16384);
+			for (i = 0; i < 6; i++) {
+				k = (int)(rng() % 16);
+				data[k] = coef(dq, k, 1024);
+			}
+			break;
+		case 2:
+			// anything, including out of range results that get clamped
+			for (i = 0; i < 64; i++) {
+				data[i] = coef(dq, i, 16384);
+			}
+			break;
+		default:
+			// sparse, anywhere in the block
+			for (i = 0; i < 4; i++) {
+				k = (int)(rng() % 64);
+				data[k] = coef(dq, k, 4096);
+			}
+			break;
+	}
+}
+
+// Returns 0 if the installed kernels match the scalar ones, 1 otherwise
+static int check(const char *name) {
+	STBI_SIMD_ALIGN(short, data[64]);
+	STBI_SIMD_ALIGN(unsigned short, dq[64]);
+	static uint8 expect[16 * 8], actual[16 * 8];
+	static uint8 y[64], cb[64], cr[64];
+	static uint8 expectrow[64 * 4 + 1], actualrow[64 * 4 + 1];
+	int n, i, count, step;
+
+	for (n = 0; n < CHECK.cases; n++) {
+		makeblock(data, dq, n % 4);
+		// output blocks sit in a wider buffer, as in a component plane
+		memset(expect, 0, sizeof(expect));
+		memset(actual, 0, sizeof(actual));
+		idct_block(expect + 3, 16, data, dq);
+		stbi_idct_installed(actual + 3, 16, data, dq);
+		if (memcmp(expect, actual, sizeof(expect)) != 0) {
+			for (i = 0; i < (int)sizeof(expect) && expect[i] == actual[i]; i++) {}
+			printf("%s IDCT of block %d (kind %d) differs at row %d column %d: %d, expected %d\n",
+					name, n, n % 4, i / 16, i % 16 - 3, actual[i], expect[i]);
+			return 1;
+		}
+
+		count = 1 + (int)(rng() % 64);
+		step = 3 + (int)(rng() % 2);
+		for (i = 0; i < count; i++) {
+			y[i] = (uint8)rng();
+			cb[i] = (uint8)rng();
+			cr[i] = (uint8)rng();
+		}
+		memset(expectrow, 0, sizeof(expectrow));
+		memset(actualrow, 0, sizeof(actualrow));
+		YCbCr_to_RGB_row(expectrow, y, cb, cr, count, step);
+		stbi_YCbCr_installed(actualrow, y, cb, cr, count, step);
+		if (memcmp(expectrow, actualrow, sizeof(expectrow)) != 0) {
+			for (i = 0; i < (int)sizeof(expectrow) && expectrow[i] == actualrow[i]; i++) {}
+			printf("%s YCbCr row %d (%d pixels, step %d) differs at byte %d: %d, expected %d\n",
+					name, n, count, step, i, actualrow[i], expectrow[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// returns 0 on success, nonzero otherwise
+static int parseopts(int argc, char **argv) {
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+			case 'n':
+				if (sscanf(optarg, "%d", &CHECK.cases) != 1 || CHECK.cases < 1) {
+					fprintf(stderr, "CASES must be a positive integer\n");
+					return 1;
+				}
+				break;
+			case 's':
+				if (sscanf(optarg, "%lu", &CHECK.seed) != 1) {
+					fprintf(stderr, "SEED must be an integer\n");
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: jpegsimd [-n CASES] [-s SEED]\n");
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	JpegKernels k, best;
+
+	if (parseopts(argc, argv)) {
+		return 2;
+	}
+
+	best = BestJpegKernels();
+	for (k = JPEG_SSE2; k <= best; k++) {
+		rngstate = CHECK.seed * 2654435761ULL + 1;
+		if (InstallJpegKernels(k)) {
+			fprintf(stderr, "Cannot install %s kernels\n", JpegKernelsName(k));
+			return 2;
+		}
+		if (check(JpegKernelsName(k))) {
+			return 1;
+		}
+	}
+
+	printf("%d cases match\n", CHECK.cases);
+	return 0;
+}
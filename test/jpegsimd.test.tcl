@@ -0,0 +1,33 @@
+package require Tcl 8.5
+package require tcltest 2
+namespace import ::tcltest::test
+
+# Use the test directory as the working directory for all tests.
+::tcltest::workingDirectory [file dirname [info script]]
+
+# Apply any additional configuration arguments.
+eval ::tcltest::configure $argv
+
+# The jpegsimd driver (built by `make test/jpegsimd`) runs randomized blocks
+# through stb_image's scalar JPEG kernels and each SIMD kernel set this CPU
+# supports, and compares the output.
+
+::tcltest::testConstraint has_jpegsimd [file executable jpegsimd]
+
+test jpegsimd-1 {
+# The SIMD IDCT and YCbCr conversion match the scalar ones exactly.
+} -constraints {
+	has_jpegsimd
+} -body {
+	exec ./jpegsimd -n 100000 -s 1
+} -result {100000 cases match}
+
+test jpegsimd-2 {
+# Another seed.
+} -constraints {
+	has_jpegsimd
+} -body {
+	exec ./jpegsimd -n 100000 -s 2
+} -result {100000 cases match}
+
+::tcltest::cleanupTests
@@ -0,0 +1,466 @@
+// Equivalence test driver: meshes randomized heightmaps and masks with both
+// Mesh() and the scalar MeshReference(), and compares the triangle streams.
+// Both meshes are written as binary STL and compared vertex by vertex,
+// either exactly or within a given tolerance. Exits 0 if all cases match,
+// 1 on the first mismatch (after describing it), 2 on other errors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#endif
+
+#include <libtrix.h>
+#include "../heightmap.h"
+#include "../mesh.h"
+
+static struct {
+	int cases; // number of randomized cases
+	unsigned long seed; // random seed
+	float tolerance; // maximum vertex coordinate difference; 0 for exact
+	char *dir; // directory for temporary STL files
+	int verbose; // boolean; describe each case if true
+} ORACLE = {
+	500,
+	1,
+	0,
+	".",
+	0
+};
+
+static unsigned long long rngstate;
+
+static unsigned int rng(void) {
+	rngstate ^= rngstate << 13;
+	rngstate ^= rngstate >> 7;
+	rngstate ^= rngstate << 17;
+	return (unsigned int)(rngstate >> 32);
+}
+
+// kinds of generated heightmap and mask content
+enum {
+	FILL_NOISE,
+	FILL_FLAT,
+	FILL_GRADIENT,
+	FILL_BLOCKS,
+	FILL_ZERO,
+	FILL_FULL,
+	FILL_SPOT,
+	FILL_COUNT
+};
+
+static const char *FILLNAMES[FILL_COUNT] = {"noise", "flat", "gradient", "blocks", "zero", "full", "spot"};
+
+// Fill hm with 8-bit samples, or 16-bit if wide.
+// returns 0 on success, nonzero otherwise
+static int fill(Heightmap *hm, unsigned int width, unsigned int height, int kind, int wide) {
+	unsigned int x, y;
+	unsigned int top = (wide ? 65535 : 255);
+	unsigned int flat = rng() % (top + 1);
+	unsigned int sx = rng() % width, sy = rng() % height;
+	unsigned int sw = 1 + rng() % (width - sx), sh = 1 + rng() % (height - sy);
+
+	hm->width = width;
+	hm->height = height;
+	hm->size = (unsigned long)width * height;
+	hm->wide = wide;
+	if ((hm->data = (unsigned char *)malloc(hm->size * (wide ? 2 : 1))) == NULL) {
+		return 1;
+	}
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			unsigned int v;
+			switch (kind) {
+				case FILL_FLAT:
+					v = flat;
+					break;
+				case FILL_GRADIENT:
+					v = (x * top) / width;
+					break;
+				case FILL_BLOCKS:
+					v = ((((x / 3) + (y / 3)) % 2) ? top : 0);
+					break;
+				case FILL_ZERO:
+					v = 0;
+					break;
+				case FILL_FULL:
+					v = top;
+					break;
+				case FILL_SPOT:
+					v = ((x >= sx && x < sx + sw && y >= sy && y < sy + sh) ? top : 0);
+					break;
+				default:
+					v = rng() % (top + 1);
+					break;
+			}
+			if (wide) {
+				((unsigned short *)hm->data)[(unsigned long)y * width + x] = (unsigned short)v;
+			} else {
+				hm->data[(unsigned long)y * width + x] = (unsigned char)v;
+			}
+		}
+	}
+
+	hm->xoff = 0;
+	hm->yoff = 0;
+	hm->imagewidth = width;
+	hm->imageheight = height;
+
+	ScanHeightmap(hm);
+	return 0;
+}
+
+// returns 0 on success, nonzero otherwise
+static int meshto(const Heightmap *hm, int reference, const char *path) {
+	trix_mesh *mesh;
+	trix_result r;
+
+	if (trixCreate(&mesh, "oracle") != TRIX_OK) {
+		return 1;
+	}
+	r = (reference ? MeshReference(hm, mesh) : Mesh(hm, mesh));
+	if (r == TRIX_OK) {
+		r = trixWrite(mesh, path, TRIX_STL_BINARY);
+	}
+	(void)trixRelease(&mesh);
+	return r != TRIX_OK;
+}
+
+// returns contents of binary STL file at path (length in *len), or NULL
+static unsigned char *slurp(const char *path, long *len) {
+	FILE *f;
+	unsigned char *data;
+
+	if ((f = fopen(path, "rb")) == NULL) {
+		return NULL;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || (*len = ftell(f)) < 84 || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return NULL;
+	}
+	if ((data = (unsigned char *)malloc((size_t)*len)) != NULL &&
+			fread(data, 1, (size_t)*len, f) != (size_t)*len) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	return data;
+}
+
+static unsigned long le32(const unsigned char *p) {
+	return (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static float lefloat(const unsigned char *p) {
+	unsigned long u = le32(p);
+	unsigned int w = (unsigned int)u;
+	float f;
+	memcpy(&f, &w, sizeof(f));
+	return f;
+}
+
+// Compares vertices (not the header or normals) of two binary STL files.
+// Returns 0 if they match, 1 if they differ, 2 on error.
+static int compare(const char *refpath, const char *testpath) {
+	unsigned char *a, *b;
+	long alen, blen;
+	unsigned long count, t;
+	int v, result = 0;
+
+	a = slurp(refpath, &alen);
+	b = slurp(testpath, &blen);
+	if (a == NULL || b == NULL) {
+		fprintf(stderr, "Cannot read STL output\n");
+		free(a);
+		free(b);
+		return 2;
+	}
+
+	count = le32(a + 80);
+	if (le32(b + 80) != count || alen != blen) {
+		fprintf(stderr, "Triangle count differs: reference %lu, Mesh %lu\n", count, le32(b + 80));
+		result = 1;
+	}
+
+	for (t = 0; result == 0 && t < count && 84 + 50 * (long)(t + 1) <= alen; t++) {
+		const unsigned char *ta = a + 84 + 50 * t + 12;
+		const unsigned char *tb = b + 84 + 50 * t + 12;
+		for (v = 0; v < 9; v++) {
+			float fa = lefloat(ta + 4 * v), fb = lefloat(tb + 4 * v);
+			if (ORACLE.tolerance > 0 ? fabsf(fa - fb) > ORACLE.tolerance : memcmp(ta + 4 * v, tb + 4 * v, 4) != 0) {
+				fprintf(stderr, "Triangle %lu vertex %c %c differs: reference %.9g, Mesh %.9g\n",
+						t, "abc"[v / 3], "xyz"[v % 3], fa, fb);
+				result = 1;
+				break;
+			}
+		}
+	}
+
+	free(a);
+	free(b);
+	return result;
+}
+
+// Checks the packed mask against the 8-bit rule it was built from (applied
+// to the high byte of 16-bit samples).
+// Returns 0 if every pixel matches, 1 otherwise.
+static int checkmask(const Heightmap *src) {
+	unsigned int x, y;
+	int expect;
+
+	for (y = 0; y < src->height; y++) {
+		for (x = 0; x < src->width; x++) {
+			expect = ((HeightmapSample(src, (unsigned long)y * src->width + x) >> (src->wide ? 8 : 0)) <=
+					(unsigned int)CONFIG.threshold);
+			if (CONFIG.reversed) {
+				expect = !expect;
+			}
+			if (Masked(x, y) != expect) {
+				fprintf(stderr, "Mask bit %u, %u is %d; expected %d\n", x, y, Masked(x, y), expect);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// Checks the occupancy index against per-pixel mask tests, block by block,
+// and its total triangle count against the triangles actually written.
+// Returns 0 if everything matches, 1 otherwise.
+static int checkindex(const Heightmap *hm, const char *path) {
+	MeshIndex *index;
+	unsigned int col, row, x, y;
+	unsigned long visible, area, total;
+	unsigned char header[84];
+	BlockState expect;
+	FILE *f = NULL;
+	int result = 0;
+
+	if ((index = CreateMeshIndex(hm)) == NULL) {
+		return 1;
+	}
+
+	for (row = 0; row < index->rows && result == 0; row++) {
+		for (col = 0; col < index->cols && result == 0; col++) {
+			visible = area = 0;
+			for (y = row * MESH_BLOCK; y < hm->height && y < (row + 1) * MESH_BLOCK; y++) {
+				for (x = col * MESH_BLOCK; x < hm->width && x < (col + 1) * MESH_BLOCK; x++) {
+					visible += !Masked(x, y);
+					area++;
+				}
+			}
+			expect = (visible == 0 ? BLOCK_EMPTY : (visible == area ? BLOCK_FULL : BLOCK_MIXED));
+			if (IndexVisible(index, col, row, col + 1, row + 1) != visible || IndexBlock(index, col, row) != expect) {
+				fprintf(stderr, "Index block %u, %u has %lu visible pixels (state %d); expected %lu (state %d)\n",
+						col, row, IndexVisible(index, col, row, col + 1, row + 1), (int)IndexBlock(index, col, row),
+						visible, (int)expect);
+				result = 1;
+			}
+		}
+	}
+
+	total = IndexTriangles(index, 0, 0, index->cols, index->rows);
+	FreeMeshIndex(&index);
+
+	if (result == 0 && ((f = fopen(path, "rb")) == NULL || fread(header, 1, 84, f) != 84)) {
+		fprintf(stderr, "Cannot read STL output\n");
+		result = 1;
+	} else if (result == 0 && le32(header + 80) != total) {
+		fprintf(stderr, "Index counts %lu triangles; Mesh wrote %lu\n", total, le32(header + 80));
+		result = 1;
+	}
+	if (f != NULL) {
+		fclose(f);
+	}
+
+	return result;
+}
+
+// Returns 0 if Mesh() and MeshReference() agree on case n, nonzero otherwise.
+static int runcase(int n, const char *refpath, const char *testpath) {
+	Heightmap hm, mk;
+	unsigned int width, height;
+	unsigned int rx, ry, rw, rh;
+	int hmkind, maskmode, maskkind = FILL_NOISE, cropped, region, result, wide;
+
+	// the first cases pin down degenerate shapes; the rest are random
+	switch (n) {
+		case 0: width = 1; height = 1; break;
+		case 1: width = 1; height = 1 + rng() % 64; break;
+		case 2: width = 1 + rng() % 64; height = 1; break;
+		case 3: width = 2; height = 2; break;
+		default:
+			width = 1 + rng() % (rng() % 4 ? 24 : 150);
+			height = 1 + rng() % (rng() % 4 ? 24 : 150);
+			break;
+	}
+	hmkind = (int)(rng() % FILL_COUNT);
+
+	// one heightmap in four has 16-bit samples, which have a mesher of their own
+	wide = (rng() % 4 == 0);
+
+	// 0: no mask; 1: mask image; 2: heightmask
+	maskmode = (int)(rng() % 3);
+
+	CONFIG.base = (int)(rng() % 4 != 0);
+	CONFIG.reversed = (int)(rng() % 2);
+	CONFIG.heightmask = (maskmode == 2);
+	CONFIG.zscale = (float)(1 + rng() % 400) / 100.0f;
+	CONFIG.baseheight = (float)(100 + rng() % 400) / 100.0f;
+	switch (rng() % 5) {
+		case 0: CONFIG.threshold = 0; break;
+		case 1: CONFIG.threshold = 255; break;
+		case 2: CONFIG.threshold = 127; break;
+		default: CONFIG.threshold = (int)(rng() % 256); break;
+	}
+
+	if (fill(&hm, width, height, hmkind, wide)) {
+		return 2;
+	}
+
+	mask = NULL;
+	mk.data = NULL;
+	if (maskmode == 1) {
+		maskkind = (int)(rng() % FILL_COUNT);
+		if (fill(&mk, width, height, maskkind, 0) ||
+				(mask = MaskFromHeightmap(&mk, CONFIG.threshold, CONFIG.reversed)) == NULL) {
+			free(mk.data);
+			free(hm.data);
+			return 2;
+		}
+	} else if (maskmode == 2) {
+		if ((mask = MaskFromHeightmap(&hm, CONFIG.threshold, CONFIG.reversed)) == NULL) {
+			free(hm.data);
+			return 2;
+		}
+	}
+
+	if (ORACLE.verbose) {
+		fprintf(stderr, "case %d: %ux%u %s%s, mask %s, threshold %d%s%s, z %g, base %g\n",
+				n, width, height, FILLNAMES[hmkind], wide ? " (16-bit)" : "",
+				maskmode == 0 ? "none" : (maskmode == 2 ? "height" : FILLNAMES[maskkind]),
+				CONFIG.threshold, CONFIG.reversed ? " reversed" : "", CONFIG.base ? "" : " surface only",
+				CONFIG.zscale, CONFIG.baseheight);
+	}
+
+	// half the masked cases mesh the heightmap cropped to the mask; the
+	// reference always meshes the whole image
+	cropped = (mask != NULL && rng() % 2 == 0);
+
+	// one case in four also restricts meshing to a region of interest; the
+	// reference masks everything outside it, while Mesh() gets a cropped copy
+	region = (rng() % 4 == 0);
+	rx = rng() % width;
+	ry = rng() % height;
+	rw = 1 + rng() % (width - rx);
+	rh = 1 + rng() % (height - ry);
+
+	if (mask != NULL && checkmask(maskmode == 1 ? &mk : &hm)) {
+		result = 1;
+	} else if ((region && RestrictToRegion(&hm, rx, ry, rw, rh, 0)) || meshto(&hm, 1, refpath) ||
+			(region && RestrictToRegion(&hm, rx, ry, rw, rh, 1)) ||
+			(cropped && CropToMask(&hm)) || meshto(&hm, 0, testpath)) {
+		fprintf(stderr, "Cannot mesh case %d\n", n);
+		result = 2;
+	} else if ((result = compare(refpath, testpath)) == 0) {
+		result = checkindex(&hm, testpath);
+	}
+	if (result == 1) {
+		fprintf(stderr, "Mismatch in case %d (seed %lu): %ux%u %s %d-bit heightmap%s, region %s%u,%u,%u,%u, mask %s, threshold %d, reversed %d, base %d, z %g, base height %g\n",
+				n, ORACLE.seed, width, height, FILLNAMES[hmkind], wide ? 16 : 8, cropped ? " (cropped)" : "",
+				region ? "" : "(none) ", rx, ry, rw, rh,
+				maskmode == 0 ? "none" : (maskmode == 2 ? "height" : FILLNAMES[maskkind]),
+				CONFIG.threshold, CONFIG.reversed, CONFIG.base, CONFIG.zscale, CONFIG.baseheight);
+	}
+
+	FreeMask(&mask);
+	free(mk.data);
+	free(hm.data);
+	return result;
+}
+
+// returns 0 if options are parsed successfully; nonzero otherwise
+int parseopts(int argc, char **argv) {
+
+	int c;
+
+	opterr = 0;
+
+	while ((c = getopt(argc, argv, "n:s:t:d:v")) != -1) {
+		switch (c) {
+			case 'n':
+				if (sscanf(optarg, "%10d", &ORACLE.cases) != 1 || ORACLE.cases < 1) {
+					fprintf(stderr, "CASES must be a positive integer.\n");
+					return 1;
+				}
+				break;
+			case 's':
+				if (sscanf(optarg, "%20lu", &ORACLE.seed) != 1) {
+					fprintf(stderr, "SEED must be a non-negative integer.\n");
+					return 1;
+				}
+				break;
+			case 't':
+				if (sscanf(optarg, "%20f", &ORACLE.tolerance) != 1 || ORACLE.tolerance < 0) {
+					fprintf(stderr, "TOLERANCE must be a non-negative number.\n");
+					return 1;
+				}
+				break;
+			case 'd':
+				ORACLE.dir = optarg;
+				break;
+			case 'v':
+				ORACLE.verbose = 1;
+				break;
+			case '?':
+				if (isprint(optopt)) {
+					fprintf(stderr, "Unknown option or missing argument -%c\n", optopt);
+				} else {
+					fprintf(stderr, "Unknown option character \\x%x\n", optopt);
+				}
+				return 1;
+			default:
+				return 1;
+		}
+	}
+
+	if (optind < argc) {
+		fprintf(stderr, "Extraneous arguments\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	char refpath[1024], testpath[1024];
+	int n, result = 0;
+
+	if (parseopts(argc, argv)) {
+		fprintf(stderr, "usage: oracle [-n CASES] [-s SEED] [-t TOLERANCE] [-d DIR] [-v]\n");
+		return 2;
+	}
+
+	snprintf(refpath, sizeof(refpath), "%s/oracle-reference.stl", ORACLE.dir);
+	snprintf(testpath, sizeof(testpath), "%s/oracle-mesh.stl", ORACLE.dir);
+
+	// seed 0 would leave the xorshift generator stuck at zero
+	rngstate = 0x9E3779B97F4A7C15ULL ^ ((unsigned long long)ORACLE.seed * 0xBF58476D1CE4E5B9ULL);
+
+	for (n = 0; n < ORACLE.cases && result == 0; n++) {
+		result = runcase(n, refpath, testpath);
+	}
+
+	(void)remove(refpath);
+	(void)remove(testpath);
+
+	if (result == 0) {
+		printf("%d cases match\n", ORACLE.cases);
+	}
+	return result;
+}
@@ -0,0 +1,37 @@
+package require Tcl 8.5
+package require tcltest 2
+namespace import ::tcltest::test
+
+# Use the test directory as the working directory for all tests.
+::tcltest::workingDirectory [file dirname [info script]]
+
+# Stow any temporary test files in a tmp subdirectory.
+::tcltest::configure -tmpdir tmp
+
+# Apply any additional configuration arguments.
+eval ::tcltest::configure $argv
+
+# The oracle driver (built by `make test/oracle`) meshes randomized heightmaps
+# and masks with both Mesh() and MeshReference() and compares the results.
+
+::tcltest::testConstraint has_oracle [file executable oracle]
+
+file mkdir [::tcltest::configure -tmpdir]
+
+test oracle-1 {
+# Mesh() matches the reference mesher exactly on randomized inputs.
+} -constraints {
+	has_oracle
+} -body {
+	exec ./oracle -n 500 -s 1 -d [::tcltest::configure -tmpdir]
+} -result {500 cases match}
+
+test oracle-2 {
+# Another seed, including some larger images.
+} -constraints {
+	has_oracle
+} -body {
+	exec ./oracle -n 500 -s 2 -d [::tcltest::configure -tmpdir]
+} -result {500 cases match}
+
+::tcltest::cleanupTests
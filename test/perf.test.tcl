@@ -0,0 +1,195 @@
+package require Tcl 8.6
+package require tcltest 2
+namespace import ::tcltest::test
+
+# Use the test directory as the working directory for all tests.
+::tcltest::workingDirectory [file dirname [info script]]
+
+# Stow any temporary test files in a tmp subdirectory.
+::tcltest::configure -tmpdir tmp
+
+# Apply any additional configuration arguments.
+eval ::tcltest::configure $argv
+
+# Performance regression tests. Each case converts a generated heightmap and
+# compares the triangle count, a checksum of the vertex coordinates, and the
+# throughput (pixels per second) against perf.baseline. Skipped by default;
+# to run them, run `make perftest` or `tclsh test/all.tcl -constraints perf`
+#
+# The images are 1024x1024, so that a conversion takes long enough (about a
+# tenth of a second to a second) for process startup not to matter. The first
+# conversion of each case only warms up the caches and writes the STL that is
+# checked; throughput is that of the fastest of the timed ones after it, since
+# other load on the machine only ever makes a run slower.
+#
+# To record a new baseline (after an intentional change in output, or on a
+# different machine), set HMSTL_PERF_RECORD=1 in the environment. Throughput
+# may drop by HMSTL_PERF_TOLERANCE percent (default 25) before a test fails.
+
+::tcltest::testConstraint has_hmstl [file executable ../hmstl]
+::tcltest::testConstraint has_hmgen [file executable ../bench/hmgen]
+
+set baselinefile perf.baseline
+set record [info exists ::env(HMSTL_PERF_RECORD)]
+set tolerance 25
+if {[info exists ::env(HMSTL_PERF_TOLERANCE)]} {
+	set tolerance $::env(HMSTL_PERF_TOLERANCE)
+}
+set repeat 7
+set size 1024
+
+# baseline: dict of case name -> {triangles checksum pixelspersec}
+set baseline [dict create]
+if {[file exists $baselinefile]} {
+	set f [open $baselinefile r]
+	foreach line [split [read $f] \n] {
+		if {[string trim $line] ne {} && [string index $line 0] ne "#"} {
+			dict set baseline [lindex $line 0] [lrange $line 1 3]
+		}
+	}
+	close $f
+}
+set recorded [dict create]
+
+file mkdir [::tcltest::configure -tmpdir]
+
+# Returns path to generated image of the given kind, creating it if needed.
+proc image {kind} {
+	set path [file join [::tcltest::configure -tmpdir] perf-$kind-$::size.png]
+	if {![file exists $path]} {
+		exec ../bench/hmgen -k $kind -n $::size -o $path
+	}
+	return $path
+}
+
+# Returns {triangles checksum} for a binary STL file. The checksum is a CRC of
+# the vertex coordinates only; the header, normals, and attributes are ignored
+# so that it reflects the mesh geometry rather than how the STL was written.
+proc stlsum {path} {
+	set f [open $path rb]
+	set data [read $f]
+	close $f
+	binary scan $data @80iu count
+	set crc 0
+	set offset 84
+	for {set i 0} {$i < $count} {incr i} {
+		set crc [zlib crc32 [string range $data [expr {$offset + 12}] [expr {$offset + 47}]] $crc]
+		incr offset 50
+	}
+	if {[string length $data] != $offset} {
+		error "$path is [string length $data] bytes; expected $offset for $count triangles"
+	}
+	return [list $count [format %08x $crc]]
+}
+
+# Converts the image with the given hmstl options repeatedly and checks the
+# results against the baseline. Returns "ok" or a description of the failure.
+proc perfcase {name options} {
+	global baseline recorded record tolerance repeat size
+
+	set out [file join [::tcltest::configure -tmpdir] perf-$name.stl]
+	exec ../hmstl {*}$options -o $out
+	lassign [stlsum $out] triangles checksum
+	file delete $out
+
+	set times {}
+	for {set i 0} {$i < $repeat} {incr i} {
+		set start [clock microseconds]
+		exec ../hmstl {*}$options -o /dev/null
+		lappend times [expr {[clock microseconds] - $start}]
+	}
+	set fastest [lindex [lsort -integer $times] 0]
+	set rate [expr {int($size * $size / ($fastest / 1e6))}]
+
+	if {$record} {
+		dict set recorded $name [list $triangles $checksum $rate]
+		return ok
+	}
+	if {![dict exists $baseline $name]} {
+		return "no baseline for $name; record one with HMSTL_PERF_RECORD=1"
+	}
+
+	lassign [dict get $baseline $name] btriangles bchecksum brate
+	set failures {}
+	if {$triangles != $btriangles} {
+		lappend failures "triangle count changed: $triangles (baseline $btriangles)"
+	}
+	if {$checksum ne $bchecksum} {
+		lappend failures "geometry checksum changed: $checksum (baseline $bchecksum)"
+	}
+	if {$rate < $brate * (100 - $tolerance) / 100.0} {
+		lappend failures [format "throughput regressed: %d pixels/s (baseline %d, %.1f%% slower)" \
+				$rate $brate [expr {100.0 * ($brate - $rate) / $brate}]]
+	}
+	if {[llength $failures]} {
+		return [join $failures \n]
+	}
+	return ok
+}
+
+test perf-terrain {
+# Binary STL of terrain with walls and bottom.
+} -constraints {
+	perf has_hmstl has_hmgen
+} -body {
+	perfcase terrain [list -z 0.25 -i [image terrain]]
+} -result ok
+
+test perf-surface {
+# Terrain surface only.
+} -constraints {
+	perf has_hmstl has_hmgen
+} -body {
+	perfcase surface [list -z 0.25 -s -i [image terrain]]
+} -result ok
+
+test perf-plateau {
+# Flat terraces (large runs of equal heights).
+} -constraints {
+	perf has_hmstl has_hmgen
+} -body {
+	perfcase plateau [list -z 0.25 -i [image plateau]]
+} -result ok
+
+test perf-noise {
+# White noise (no spatial coherence).
+} -constraints {
+	perf has_hmstl has_hmgen
+} -body {
+	perfcase noise [list -z 0.25 -i [image noise]]
+} -result ok
+
+test perf-heightmask {
+# Terrain used as its own mask.
+} -constraints {
+	perf has_hmstl has_hmgen
+} -body {
+	perfcase heightmask [list -z 0.25 -h -i [image terrain]]
+} -result ok
+
+test perf-mask-sparse {
+# Sparse mask (about 10% visible).
+} -constraints {
+	perf has_hmstl has_hmgen
+} -body {
+	perfcase mask-sparse [list -z 0.25 -i [image terrain] -m [image sparse]]
+} -result ok
+
+test perf-mask-dense {
+# Dense mask, reversed (about 10% visible, in many small pieces).
+} -constraints {
+	perf has_hmstl has_hmgen
+} -body {
+	perfcase mask-dense [list -z 0.25 -i [image terrain] -m [image dense] -r]
+} -result ok
+
+if {$record && [dict size $recorded]} {
+	set f [open $baselinefile w]
+	puts $f "# name triangles checksum pixels/s ($size x $size images, recorded [clock format [clock seconds] -format %Y-%m-%d])"
+	dict for {name values} $recorded {
+		puts $f [list $name {*}$values]
+	}
+	close $f
+}
+
+::tcltest::cleanupTests
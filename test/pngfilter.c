@@ -0,0 +1,157 @@
+// Equivalence test driver for PNG unfiltering: runs randomized rows of 1 to
+// 4 byte pixels, and the 6 and 8 byte pixels of 16-bit RGB and RGBA, through
+// stb_image's unfilter_row (with whatever SIMD kernels it was built with)
+// and through a direct reading of the PNG spec, and compares the output
+// bytes. Exits 0 if all cases match, 1 on the first mismatch (after
+// describing it), 2 on other errors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#endif
+
+// the whole of stb_image is compiled here so its static unfilter_row can be
+// called directly
+#include "../stb_image.c"
+
+#define MAXLEN (8 * 300)
+
+static struct {
+	int cases; // number of randomized rows
+	unsigned long seed; // random seed
+} CHECK = {
+	100000,
+	1
+};
+
+static unsigned long long rngstate;
+
+static unsigned int rng(void) {
+	rngstate ^= rngstate << 13;
+	rngstate ^= rngstate >> 7;
+	rngstate ^= rngstate << 17;
+	return (unsigned int)(rngstate >> 32);
+}
+
+static const char *filtername[] = {"None", "Sub", "Up", "Average", "Paeth"};
+
+static int predictor(int a, int b, int c) {
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+	if (pb <= pc) {
+		return b;
+	}
+	return c;
+}
+
+// Undo filter on a row of len bytes of n-byte pixels, as the spec puts it
+static void reference(uint8 *cur, const uint8 *prior, const uint8 *raw, int filter, int len, int n) {
+	int i, a, b, c, pred;
+	
+	for (i = 0; i < len; i++) {
+		a = i >= n ? cur[i - n] : 0;
+		b = prior[i];
+		c = i >= n ? prior[i - n] : 0;
+		switch (filter) {
+			case 1:
+				pred = a;
+				break;
+			case 2:
+				pred = b;
+				break;
+			case 3:
+				pred = (a + b) / 2;
+				break;
+			case 4:
+				pred = predictor(a, b, c);
+				break;
+			default:
+				pred = 0;
+				break;
+		}
+		cur[i] = (uint8)(raw[i] + pred);
+	}
+}
+
+// Returns 0 if unfilter_row matches the reference, 1 otherwise
+static int check(void) {
+	static uint8 prior[MAXLEN], raw[MAXLEN];
+	static uint8 expect[MAXLEN + 16], actual[MAXLEN + 16];
+	static const int sizes[6] = {1, 2, 3, 4, 6, 8};
+	int c, i, n, len, filter;
+	
+	for (c = 0; c < CHECK.cases; c++) {
+		n = sizes[rng() % 6];
+		len = n * (1 + (int)(rng() % (MAXLEN / n)));
+		filter = (int)(rng() % 5);
+		for (i = 0; i < len; i++) {
+			// every few rows is all zeros above, as for the first row
+			prior[i] = (uint8)(c % 8 == 0 ? 0 : rng());
+			raw[i] = (uint8)rng();
+		}
+		// the kernels must not write past the row either
+		memset(expect, 0xa5, sizeof(expect));
+		memset(actual, 0xa5, sizeof(actual));
+		reference(expect, prior, raw, filter, len, n);
+		unfilter_row(actual, prior, raw, filter, (uint32)len, n);
+		if (memcmp(expect, actual, sizeof(expect)) != 0) {
+			for (i = 0; i < (int)sizeof(expect) && expect[i] == actual[i]; i++) {}
+			printf("%s row %d (%d bytes of %d-byte pixels) differs at byte %d: %d, expected %d\n",
+					filtername[filter], c, len, n, i, actual[i], expect[i]);
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+// returns 0 on success, nonzero otherwise
+static int parseopts(int argc, char **argv) {
+	int c;
+	
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+			case 'n':
+				if (sscanf(optarg, "%d", &CHECK.cases) != 1 || CHECK.cases < 1) {
+					fprintf(stderr, "CASES must be a positive integer\n");
+					return 1;
+				}
+				break;
+			case 's':
+				if (sscanf(optarg, "%lu", &CHECK.seed) != 1) {
+					fprintf(stderr, "SEED must be an integer\n");
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: pngfilter [-n CASES] [-s SEED]\n");
+				return 1;
+		}
+	}
+	
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	
+	if (parseopts(argc, argv)) {
+		return 2;
+	}
+	
+	rngstate = CHECK.seed * 2654435761ULL + 1;
+	if (check()) {
+		return 1;
+	}
+	
+	printf("%d cases match\n", CHECK.cases);
+	return 0;
+}
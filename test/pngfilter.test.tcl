@@ -0,0 +1,33 @@
+package require Tcl 8.5
+package require tcltest 2
+namespace import ::tcltest::test
+
+# Use the test directory as the working directory for all tests.
+::tcltest::workingDirectory [file dirname [info script]]
+
+# Apply any additional configuration arguments.
+eval ::tcltest::configure $argv
+
+# The pngfilter driver (built by `make test/pngfilter`) runs randomized rows
+# through stb_image's PNG unfiltering and a plain reading of the spec, and
+# compares the output.
+
+::tcltest::testConstraint has_pngfilter [file executable pngfilter]
+
+test pngfilter-1 {
+# Unfiltering matches the spec for every filter and pixel size.
+} -constraints {
+	has_pngfilter
+} -body {
+	exec ./pngfilter -n 100000 -s 1
+} -result {100000 cases match}
+
+test pngfilter-2 {
+# Another seed.
+} -constraints {
+	has_pngfilter
+} -body {
+	exec ./pngfilter -n 100000 -s 2
+} -result {100000 cases match}
+
+::tcltest::cleanupTests
@@ -0,0 +1,138 @@
+package require Tcl 8.5
+package require tcltest 2
+namespace import ::tcltest::test
+
+# Use the test directory as the working directory for all tests.
+::tcltest::workingDirectory [file dirname [info script]]
+
+# Stow any temporary test files in a tmp subdirectory.
+::tcltest::configure -tmpdir tmp
+
+# Apply any additional configuration arguments.
+eval ::tcltest::configure $argv
+
+# Output of the default conversion, which decodes, meshes in chunks on one
+# thread per CPU, and encodes STL in the pipeline, compared byte for byte
+# with that of --reference, which meshes the whole heightmap with the
+# scalar mesher and writes it with libtrix.
+
+::tcltest::testConstraint has_hmstl [file executable ../hmstl]
+::tcltest::testConstraint has_hmgen [file executable ../bench/hmgen]
+
+file mkdir [::tcltest::configure -tmpdir]
+
+# Returns path to a generated 300x200 image of the given kind (and number
+# of channels), creating it if needed. The 300 pixel rows make for chunks
+# of 32 rows, so the pipeline meshes several.
+proc image {kind {channels 1}} {
+	set path [file join [::tcltest::configure -tmpdir] reference-$kind-$channels.png]
+	if {![file exists $path]} {
+		exec ../bench/hmgen -k $kind -w 300 -h 200 -c $channels -s 7 -o $path
+	}
+	return $path
+}
+
+# Returns the contents of file path
+proc slurp {path} {
+	set f [open $path rb]
+	set data [read $f]
+	close $f
+	return $data
+}
+
+# Converts with the given arguments both ways; returns "identical", or
+# where the outputs first differ
+proc compare {args} {
+	set dir [::tcltest::configure -tmpdir]
+	set a [file join $dir reference-a.stl]
+	set b [file join $dir reference-b.stl]
+	exec ../hmstl {*}$args -o $a
+	exec ../hmstl {*}$args --reference -o $b
+	set x [slurp $a]
+	set y [slurp $b]
+	file delete $a $b
+	if {$x eq $y} {
+		return identical
+	}
+	for {set i 0} {$i < [string length $x] && [string index $x $i] eq [string index $y $i]} {incr i} {}
+	return "differ at byte $i of [string length $x] and [string length $y]"
+}
+
+test reference-binary {
+# Binary STL, with walls and bottom
+} -constraints {
+	has_hmstl has_hmgen
+} -body {
+	compare -i [image terrain] -z 0.25
+} -result identical
+
+test reference-ascii {
+# ASCII STL
+} -constraints {
+	has_hmstl has_hmgen
+} -body {
+	compare -i [image terrain] -z 0.25 -a
+} -result identical
+
+test reference-surface {
+# Surface only, with a thicker base scale
+} -constraints {
+	has_hmstl has_hmgen
+} -body {
+	list [compare -i [image plateau] -s] [compare -i [image terrain] -b 5 -z 0.5]
+} -result {identical identical}
+
+test reference-mask {
+# A sparse mask, and a dense one reversed
+} -constraints {
+	has_hmstl has_hmgen
+} -body {
+	list [compare -i [image terrain] -m [image sparse]] \
+			[compare -i [image noise] -m [image dense] -r -a]
+} -result {identical identical}
+
+test reference-heightmask {
+# The heightmap as its own mask
+} -constraints {
+	has_hmstl has_hmgen
+} -body {
+	compare -i [image terrain] -h -t 100
+} -result identical
+
+test reference-region {
+# A region of interest, with and without a mask
+} -constraints {
+	has_hmstl has_hmgen
+} -body {
+	list [compare -i [image terrain] -R 20,30,150,90] \
+			[compare -i [image terrain] -m [image sparse] -R 100,10,199,189]
+} -result {identical identical}
+
+test reference-scale {
+# Reduced size, of a grey and a colour image, and with a mask
+} -constraints {
+	has_hmstl has_hmgen
+} -body {
+	list [compare -i [image terrain] -d 3] [compare -i [image terrain 3] -d 2] \
+			[compare -i [image terrain] -m [image dense] -d 4]
+} -result {identical identical identical}
+
+test reference-threads {
+# Several meshers, whatever the number of CPUs, with a mask and reduced, and
+# with a mask read on a thread of its own
+} -constraints {
+	has_hmstl has_hmgen
+} -body {
+	list [compare -i [image terrain] --threads 3] [compare -i [image noise] -m [image sparse] -d 2 --threads 8] \
+			[compare -i [image terrain 3] -m [image dense] -r -a --threads 2]
+} -result {identical identical identical}
+
+test reference-16bit {
+# A 16-bit heightmap, in full and reduced
+} -constraints {
+	has_hmstl
+} -body {
+	list [compare -i sample/terrain16.png -z 0.001] [compare -i sample/terrain16.png -z 0.001 -d 2 -a]
+} -result {identical identical}
+
+::tcltest::cleanupTests
@@ -37,6 +37,15 @@ test static-splint-2 {
 	exec splint -weak +quiet ../heightmap.c
 } -result {}
 
+test static-splint-3 {
+# splint mesh
+} -constraints {
+	static
+	has_splint
+} -body {
+	exec splint -weak +quiet -unrecog ../mesh.c -I/usr/local/include
+} -result {}
+
 test static-cppcheck-1 {
 # Check that CPPCheck reports no issues.
 } -constraints {
@@ -55,6 +64,15 @@ test static-cppcheck-2 {
 	exec cppcheck --enable=all --quiet ../heightmap.c
 } -result {}
 
+test static-cppcheck-3 {
+# cppcheck mesh
+} -constraints {
+	static
+	has_cppcheck
+} -body {
+	exec cppcheck --enable=all --quiet ../mesh.c
+} -result {}
+
 test static-clang-1 {
 # Check that Clang's analyzer reports no issues.
 } -constraints {
@@ -78,4 +96,15 @@ test static-clang-2 {
 	file delete heightmap.plist
 } -result {}
 
+test static-clang-3 {
+# clang analyze mesh
+} -constraints {
+	static
+	has_clang
+} -body {
+	exec clang --analyze ../mesh.c
+} -cleanup {
+	file delete mesh.plist
+} -result {}
+
 ::tcltest::cleanupTests
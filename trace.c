@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+
+// Spans are recorded into buffers owned by the thread that ends them, so
+// recording never takes a lock. Each thread's buffer is pushed onto a global
+// list (with an atomic compare-and-swap) the first time that thread records
+// a span. TraceWrite() reads every buffer, so it must only be called once
+// all other threads have finished.
+
+#define TRACE_BLOCK 4096
+
+typedef struct TraceBlock {
+	TraceSpan spans[TRACE_BLOCK];
+	unsigned int count;
+	struct TraceBlock *next;
+} TraceBlock;
+
+typedef struct TraceBuffer {
+	int tid;
+	const char *name;
+	TraceBlock *first, *last;
+	struct TraceBuffer *next;
+} TraceBuffer;
+
+int TRACING = 0;
+
+static double origin;
+static TraceBuffer *buffers = NULL;
+static int nexttid = 1;
+static __thread TraceBuffer *local = NULL;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+// returns 0 on success, nonzero otherwise
+int TraceEnable(void) {
+	origin = now();
+	TRACING = 1;
+	return 0;
+}
+
+// the calling thread's buffer, created and registered on first use
+static TraceBuffer *localbuffer(void) {
+	TraceBuffer *b;
+	
+	if (local != NULL) {
+		return local;
+	}
+	
+	if ((b = (TraceBuffer *)calloc(1, sizeof(TraceBuffer))) == NULL) {
+		return NULL;
+	}
+	b->tid = __atomic_fetch_add(&nexttid, 1, __ATOMIC_RELAXED);
+	b->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&buffers, &b->next, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		// b->next now holds the current head; try again
+	}
+	
+	local = b;
+	return b;
+}
+
+// Labels the calling thread's timeline; name must outlive the trace.
+void TraceThreadName(const char *name) {
+	TraceBuffer *b;
+	if (TRACING && (b = localbuffer()) != NULL) {
+		b->name = name;
+	}
+}
+
+void TraceBegin(TraceSpan *span, const char *name, const char *detail, long first, long last) {
+	if (!TRACING) {
+		return;
+	}
+	span->name = name;
+	span->detail = detail;
+	span->first = first;
+	span->last = last;
+	span->start = now() - origin;
+}
+
+void TraceEnd(TraceSpan *span) {
+	TraceBuffer *b;
+	TraceBlock *block;
+	
+	if (!TRACING) {
+		return;
+	}
+	
+	span->end = now() - origin;
+	
+	if ((b = localbuffer()) == NULL) {
+		return;
+	}
+	
+	if (b->last == NULL || b->last->count == TRACE_BLOCK) {
+		if ((block = (TraceBlock *)malloc(sizeof(TraceBlock))) == NULL) {
+			return;
+		}
+		block->count = 0;
+		block->next = NULL;
+		if (b->last == NULL) {
+			b->first = block;
+		} else {
+			b->last->next = block;
+		}
+		b->last = block;
+	}
+	
+	b->last->spans[b->last->count++] = *span;
+}
+
+static void writestring(FILE *fp, const char *s) {
+	fputc('"', fp);
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\') {
+			fputc('\\', fp);
+			fputc(*s, fp);
+		} else if ((unsigned char)*s < 0x20) {
+			fprintf(fp, "\\u%04x", (unsigned int)(unsigned char)*s);
+		} else {
+			fputc(*s, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+// Writes all recorded spans as Trace Event Format JSON, viewable in
+// chrome://tracing or Perfetto. Releases the recorded spans.
+// returns 0 on success, nonzero otherwise
+int TraceWrite(const char *path) {
+	TraceBuffer *b, *nextb;
+	TraceBlock *block, *nextblock;
+	unsigned int i;
+	int first = 1;
+	FILE *fp;
+	
+	if (!TRACING) {
+		return 0;
+	}
+	
+	if ((fp = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "Cannot open trace file %s\n", path);
+		return 1;
+	}
+	
+	fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	
+	for (b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b != NULL; b = nextb) {
+		fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ",
+				first ? "" : ",\n", b->tid);
+		writestring(fp, b->name != NULL ? b->name : "worker");
+		fprintf(fp, "}}");
+		first = 0;
+		for (block = b->first; block != NULL; block = nextblock) {
+			for (i = 0; i < block->count; i++) {
+				const TraceSpan *s = &block->spans[i];
+				fprintf(fp, ",\n{\"name\": ");
+				writestring(fp, s->name);
+				fprintf(fp, ", \"cat\": \"hmstl\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {",
+						b->tid, s->start, s->end - s->start);
+				if (s->detail != NULL) {
+					fprintf(fp, "\"detail\": ");
+					writestring(fp, s->detail);
+				}
+				if (s->first >= 0) {
+					fprintf(fp, "%s\"first_row\": %ld, \"last_row\": %ld", s->detail != NULL ? ", " : "", s->first, s->last);
+				}
+				fprintf(fp, "}}");
+			}
+			nextblock = block->next;
+			free(block);
+		}
+		nextb = b->next;
+		free(b);
+	}
+	
+	fprintf(fp, "\n]}\n");
+	
+	buffers = NULL;
+	local = NULL;
+	TRACING = 0;
+	
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "Cannot write trace file %s\n", path);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+// A completed span of work, recorded as a Trace Event Format "X" event.
+typedef struct {
+	const char *name;   // span name; must outlive the trace (string literal)
+	const char *detail; // optional argument, such as an input path, or NULL
+	long first, last;   // rows covered by the span, or -1 if not applicable
+	double start, end;  // microseconds since tracing was enabled
+} TraceSpan;
+
+// Nonzero while tracing is enabled. Trace functions do nothing otherwise.
+extern int TRACING;
+
+int TraceEnable(void);
+void TraceThreadName(const char *name);
+void TraceBegin(TraceSpan *span, const char *name, const char *detail, long first, long last);
+void TraceEnd(TraceSpan *span);
+int TraceWrite(const char *path);
+
+#endif